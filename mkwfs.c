@@ -0,0 +1,670 @@
+/* mkwfs -- Create a WFS file system image from a directory tree.
+ *
+ * Copyright (C) 2017  Leiden University, The Netherlands.
+ *
+ * The tree is walked once. File data is streamed to the data area in
+ * large sequential writes, in the order in which blocks are allocated,
+ * so that every chain is contiguous. The file entries, the block table
+ * and the directory blocks are kept in memory and written at the end.
+ * With -e, an image in the extent format is created; -b and -n select
+ * a geometry other than the original one, recorded in a superblock.
+ * Every -s adds a device the data blocks are striped over.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <time.h>
+#include <dirent.h>
+#include <sys/stat.h>
+
+#include "wfs.h"
+
+
+#define MKWFS_BUFFER_SIZE (1024 * 1024)
+
+typedef struct
+{
+  int fd;
+  const char *filename;
+  uint32_t features;
+  wfs_layout_t layout;
+
+  /* Devices of a striped image; "stripe_fds[0]" is "fd". */
+  int stripe_fds[WFS_MAX_STRIPES];
+
+  wfs_file_entry_t root[WFS_N_FILES];
+  uint16_t *table;
+
+  /* Number of the next block to allocate; blocks are handed out in the
+   * order in which their data is written.
+   */
+  int next_block;
+
+  /* Data not yet written to the data area, which follows the
+   * "data_written" bytes written before.
+   */
+  uint8_t *buffer;
+  size_t buffer_used;
+  uint64_t data_written;
+
+  /* Contents of all directory blocks, indexed by block. */
+  wfs_file_entry_t **dirs;
+} mkwfs_t;
+
+/* Writes the buffered data to the data area. For striped images this
+ * is done a block at a time, as consecutive blocks are stored on
+ * different devices.
+ */
+static int
+mkwfs_flush(mkwfs_t *mk)
+{
+  const wfs_layout_t *layout = &mk->layout;
+  size_t done = 0;
+
+  while (done < mk->buffer_used)
+    {
+      size_t len = mk->buffer_used - done;
+      ssize_t res;
+
+      if (layout->n_stripes > 1)
+        {
+          uint64_t position = mk->data_written + done;
+          int block = position / layout->block_size;
+          uint32_t block_position = position % layout->block_size;
+
+          if (len > layout->block_size - block_position)
+            len = layout->block_size - block_position;
+
+          res = pwrite(mk->stripe_fds[wfs_get_stripe(layout, block)],
+                       mk->buffer + done, len,
+                       wfs_get_stripe_offset(layout, block) + block_position);
+        }
+      else
+        res = write(mk->fd, mk->buffer + done, len);
+
+      if (res < 0 && errno == EINTR)
+        continue;
+      if (res < 0)
+        {
+          fprintf(stderr, "error: could not write '%s': %s\n",
+                  mk->filename, strerror(errno));
+          return -1;
+        }
+
+      done += res;
+    }
+
+  mk->data_written += mk->buffer_used;
+  mk->buffer_used = 0;
+
+  return 0;
+}
+
+/* Appends "size" bytes to the data area; "data" may be NULL to append
+ * zeroes.
+ */
+static int
+mkwfs_append(mkwfs_t *mk, const void *data, size_t size)
+{
+  while (size > 0)
+    {
+      size_t len = MKWFS_BUFFER_SIZE - mk->buffer_used;
+      if (len > size)
+        len = size;
+
+      if (data)
+        {
+          memcpy(mk->buffer + mk->buffer_used, data, len);
+          data = (const uint8_t *)data + len;
+        }
+      else
+        memset(mk->buffer + mk->buffer_used, 0, len);
+
+      mk->buffer_used += len;
+      size -= len;
+
+      if (mk->buffer_used == MKWFS_BUFFER_SIZE && mkwfs_flush(mk) < 0)
+        return -1;
+    }
+
+  return 0;
+}
+
+/* Allocates a chain of "n" contiguous blocks and returns its first
+ * block, or WFS_BLOCK_FREE if the image is full.
+ */
+static uint16_t
+mkwfs_alloc(mkwfs_t *mk, int n)
+{
+  if (mk->next_block + n - 1 > mk->layout.n_blocks)
+    return WFS_BLOCK_FREE;
+
+  uint16_t first = mk->next_block;
+  for (int i = 0; i < n; i++)
+    mk->table[first - 1 + i] = i + 1 < n ? first + i + 1 : WFS_BLOCK_EOF;
+
+  mk->next_block += n;
+
+  return first;
+}
+
+/* Reads the "size" bytes of the host file "path" into the inline data
+ * of "entry". If the file shrinks while it is read, it is padded with
+ * zeroes.
+ */
+static int
+mkwfs_add_inline_file(const char *path, size_t size,
+                      wfs_file_entry_t *entry)
+{
+  char *data = wfs_file_entry_get_inline_data(entry);
+
+  entry->start_block = WFS_BLOCK_EOF;
+  entry->size = WFS_SIZE_IS_INLINE | size;
+
+  int fd = open(path, O_RDONLY);
+  if (fd < 0)
+    {
+      fprintf(stderr, "error: could not open '%s': %s\n",
+              path, strerror(errno));
+      return -1;
+    }
+
+  size_t done = 0;
+  int res = 0;
+  while (done < size)
+    {
+      ssize_t len_read = read(fd, data + done, size - done);
+      if (len_read < 0 && errno == EINTR)
+        continue;
+      if (len_read < 0)
+        {
+          fprintf(stderr, "error: could not read '%s': %s\n",
+                  path, strerror(errno));
+          res = -1;
+          break;
+        }
+      if (len_read == 0)
+        break;
+
+      done += len_read;
+    }
+
+  close(fd);
+
+  return res;
+}
+
+/* Streams the contents of the host file "path" into a new chain and
+ * fills in "entry". The size determined by lstat() is used; if the file
+ * changes while it is read, it is truncated or padded with zeroes.
+ */
+static int
+mkwfs_add_file(mkwfs_t *mk, const char *path, const struct stat *st,
+               wfs_file_entry_t *entry)
+{
+  const uint32_t block_size = mk->layout.block_size;
+
+  if (st->st_size > wfs_get_max_file_size(&mk->layout))
+    {
+      fprintf(stderr, "error: file '%s' is too large\n", path);
+      return -1;
+    }
+
+  size_t size = st->st_size;
+  if ((mk->features & WFS_FEATURE_INLINE)
+      && size <= wfs_file_entry_get_inline_capacity(entry))
+    return mkwfs_add_inline_file(path, size, entry);
+
+  int n = (size + block_size - 1) / block_size;
+  if (n == 0)
+    n = 1;
+
+  entry->start_block = mkwfs_alloc(mk, n);
+  entry->size = size;
+  if (entry->start_block == WFS_BLOCK_FREE)
+    {
+      fprintf(stderr, "error: image full while adding '%s'\n", path);
+      return -1;
+    }
+
+  int fd = open(path, O_RDONLY);
+  if (fd < 0)
+    {
+      fprintf(stderr, "error: could not open '%s': %s\n",
+              path, strerror(errno));
+      return -1;
+    }
+
+  size_t done = 0;
+  int res = 0;
+  while (done < size)
+    {
+      if (mk->buffer_used == MKWFS_BUFFER_SIZE && mkwfs_flush(mk) < 0)
+        {
+          res = -1;
+          break;
+        }
+
+      /* Read straight into the write buffer. */
+      size_t len = MKWFS_BUFFER_SIZE - mk->buffer_used;
+      if (len > size - done)
+        len = size - done;
+
+      ssize_t len_read = read(fd, mk->buffer + mk->buffer_used, len);
+      if (len_read < 0 && errno == EINTR)
+        continue;
+      if (len_read < 0)
+        {
+          fprintf(stderr, "error: could not read '%s': %s\n",
+                  path, strerror(errno));
+          res = -1;
+          break;
+        }
+      if (len_read == 0)
+        break;
+
+      mk->buffer_used += len_read;
+      done += len_read;
+    }
+
+  close(fd);
+
+  /* Pad the last block, and the file if it shrunk. */
+  if (res == 0 && mkwfs_append(mk, NULL, (size_t)n * block_size - done) < 0)
+    res = -1;
+
+  return res;
+}
+
+static int
+compare_names(const void *a, const void *b)
+{
+  return strcmp(*(char * const *)a, *(char * const *)b);
+}
+
+/* Reads the names in the host directory "path", sorted so that images
+ * are reproducible. Returns the number of names, or -1.
+ */
+static int
+mkwfs_read_dir(const char *path, char ***names)
+{
+  DIR *dir = opendir(path);
+  if (!dir)
+    {
+      fprintf(stderr, "error: could not open directory '%s': %s\n",
+              path, strerror(errno));
+      return -1;
+    }
+
+  int n = 0, n_allocated = 0;
+  bool oom = false;
+  struct dirent *de;
+
+  *names = NULL;
+  while ((de = readdir(dir)))
+    {
+      if (!strcmp(de->d_name, ".") || !strcmp(de->d_name, ".."))
+        continue;
+
+      if (n == n_allocated)
+        {
+          int capacity = n_allocated ? n_allocated * 2 : 16;
+          char **grown = realloc(*names, capacity * sizeof(char *));
+          if (!grown)
+            {
+              oom = true;
+              break;
+            }
+          *names = grown;
+          n_allocated = capacity;
+        }
+      if (!((*names)[n] = strdup(de->d_name)))
+        {
+          oom = true;
+          break;
+        }
+      n++;
+    }
+
+  closedir(dir);
+
+  if (oom)
+    {
+      fprintf(stderr, "error: out of memory\n");
+      for (int i = 0; i < n; i++)
+        free((*names)[i]);
+      free(*names);
+      *names = NULL;
+      return -1;
+    }
+
+  qsort(*names, n, sizeof(char *), compare_names);
+
+  return n;
+}
+
+/* Adds the contents of the host directory "path" to the directory whose
+ * entries are "entries".
+ */
+static int
+mkwfs_add_dir(mkwfs_t *mk, const char *path, wfs_file_entry_t *entries,
+              int n_entries)
+{
+  char **names;
+  int n = mkwfs_read_dir(path, &names);
+  if (n < 0)
+    return -1;
+
+  int res = 0, slot = 0;
+  for (int i = 0; i < n && res == 0; i++)
+    {
+      char child[PATH_MAX];
+      struct stat st;
+
+      snprintf(child, sizeof(child), "%s/%s", path, names[i]);
+      if (lstat(child, &st) < 0)
+        {
+          fprintf(stderr, "error: could not stat '%s': %s\n",
+                  child, strerror(errno));
+          res = -1;
+          break;
+        }
+
+      if (!S_ISREG(st.st_mode) && !S_ISDIR(st.st_mode))
+        {
+          fprintf(stderr, "warning: skipping '%s', not a regular file "
+                  "or directory\n", child);
+          continue;
+        }
+
+      if (strlen(names[i]) >= WFS_FILENAME_SIZE)
+        {
+          fprintf(stderr, "error: name of '%s' is too long\n", child);
+          res = -1;
+          break;
+        }
+
+      if (slot == n_entries)
+        {
+          fprintf(stderr, "error: directory '%s' has more than %d entries\n",
+                  path, n_entries);
+          res = -1;
+          break;
+        }
+
+      wfs_file_entry_t *entry = &entries[slot++];
+      strncpy(entry->filename, names[i], WFS_FILENAME_SIZE);
+
+      if (S_ISREG(st.st_mode))
+        {
+          res = mkwfs_add_file(mk, child, &st, entry);
+          continue;
+        }
+
+      /* A directory block; its contents are written at the end, a
+       * placeholder keeps the data area sequential.
+       */
+      entry->start_block = mkwfs_alloc(mk, 1);
+      entry->size = WFS_SIZE_IS_DIRECTORY;
+      if (entry->start_block == WFS_BLOCK_FREE)
+        {
+          fprintf(stderr, "error: image full while adding '%s'\n", child);
+          res = -1;
+          continue;
+        }
+
+      wfs_file_entry_t *dir_entries = calloc(mk->layout.n_dir_files,
+                                             sizeof(wfs_file_entry_t));
+      mk->dirs[entry->start_block - 1] = dir_entries;
+      if (!dir_entries)
+        {
+          fprintf(stderr, "error: out of memory\n");
+          res = -1;
+        }
+      else if (mkwfs_append(mk, NULL, mk->layout.block_size) < 0)
+        res = -1;
+      else
+        res = mkwfs_add_dir(mk, child, dir_entries, mk->layout.n_dir_files);
+    }
+
+  for (int i = 0; i < n; i++)
+    free(names[i]);
+  free(names);
+
+  return res;
+}
+
+/* Returns an id for the image, which differs from that of an image
+ * created at another time or by another process.
+ */
+static uint32_t
+mkwfs_make_id(void)
+{
+  struct timespec now;
+
+  clock_gettime(CLOCK_REALTIME, &now);
+  uint32_t id = (uint32_t)now.tv_sec * 1000003u ^ (uint32_t)now.tv_nsec
+      ^ (uint32_t)getpid() << 16;
+
+  return id ? id : 1;
+}
+
+/* Writes the magic, the superblock, the root entries, the block table
+ * and all directory blocks, and extends the image to its full size.
+ */
+static int
+mkwfs_write_metadata(mkwfs_t *mk)
+{
+  const wfs_layout_t *layout = &mk->layout;
+  uint32_t magic[WFS_MAGIC_SIZE / sizeof(uint32_t)] =
+    {
+      WFS_MAGIC0, WFS_MAGIC1 | mk->features, WFS_MAGIC2, WFS_MAGIC3
+    };
+  const wfs_superblock_t superblock =
+    {
+      .block_size = layout->block_size,
+      .n_blocks = layout->n_blocks,
+      .n_stripes = (mk->features & WFS_FEATURE_STRIPED)
+          ? layout->n_stripes : 0,
+      .image_id = mkwfs_make_id()
+    };
+
+  uint16_t *table = mk->table;
+  if (mk->features & WFS_FEATURE_EXTENTS)
+    {
+      table = malloc(layout->block_table_size);
+      if (!table)
+        {
+          fprintf(stderr, "error: out of memory\n");
+          return -1;
+        }
+      wfs_block_table_encode(mk->table, layout->n_blocks, 0,
+                             layout->n_blocks, table);
+    }
+
+  if (pwrite(mk->fd, magic, sizeof(magic), 0) != sizeof(magic)
+      || ((mk->features & WFS_FEATURE_SUPERBLOCK)
+          && pwrite(mk->fd, &superblock, sizeof(superblock), WFS_MAGIC_SIZE)
+             != sizeof(superblock))
+      || pwrite(mk->fd, mk->root, sizeof(mk->root), layout->entries_start)
+         != sizeof(mk->root)
+      || pwrite(mk->fd, table, layout->block_table_size,
+                layout->block_table_start) != layout->block_table_size)
+    goto error;
+
+  size_t dir_size = layout->n_dir_files * sizeof(wfs_file_entry_t);
+  for (int i = 0; i < mk->next_block - 1; i++)
+    {
+      if (!mk->dirs[i] || !mk->dirs[i][0].filename[0])
+        continue;
+
+      if (pwrite(mk->stripe_fds[wfs_get_stripe(layout, i)], mk->dirs[i],
+                 dir_size, wfs_get_stripe_offset(layout, i)) != dir_size)
+        goto error;
+    }
+
+  for (uint32_t i = 0; i < layout->n_stripes; i++)
+    if (ftruncate(mk->stripe_fds[i], wfs_get_stripe_size(layout, i)) < 0)
+      goto error;
+
+  if (table != mk->table)
+    free(table);
+
+  return 0;
+
+error:
+  fprintf(stderr, "error: could not write '%s': %s\n",
+          mk->filename, strerror(errno));
+  if (table != mk->table)
+    free(table);
+  return -1;
+}
+
+int
+main(int argc, char *argv[])
+{
+  uint32_t features = 0;
+  uint32_t block_size = WFS_BLOCK_SIZE, n_blocks = WFS_N_BLOCKS;
+  const char *stripes[WFS_MAX_STRIPES];
+  int n_stripes = 1;
+  bool usage = false;
+  int c;
+
+  while ((c = getopt(argc, argv, "eib:n:s:")) != -1)
+    {
+      if (c == 'e')
+        features |= WFS_FEATURE_EXTENTS;
+      else if (c == 'i')
+        features |= WFS_FEATURE_INLINE;
+      else if (c == 'b')
+        block_size = strtoul(optarg, NULL, 0);
+      else if (c == 'n')
+        n_blocks = strtoul(optarg, NULL, 0);
+      else if (c == 's' && n_stripes < WFS_MAX_STRIPES)
+        stripes[n_stripes++] = optarg;
+      else
+        usage = true;
+    }
+
+  if (usage || argc - optind < 1 || argc - optind > 2)
+    {
+      fprintf(stderr, "usage: %s [-e] [-i] [-b block_size] [-n n_blocks] "
+              "[-s stripe]... <image> [directory]\n\n"
+              "Creates WFS image <image>, containing the files and "
+              "directories in [directory].\n"
+              "  -e  use the extent format\n"
+              "  -i  store small files in their directory entries\n"
+              "  -b  block size in bytes, a power of two (default: %d)\n"
+              "  -n  number of blocks (default: %d)\n"
+              "  -s  stripe the data blocks over file <stripe> as well, "
+              "at most %d times\n",
+              argv[0], WFS_BLOCK_SIZE, WFS_N_BLOCKS, WFS_MAX_STRIPES - 1);
+      return 1;
+    }
+
+  if (n_stripes > 1)
+    features |= WFS_FEATURE_STRIPED;
+  if (block_size != WFS_BLOCK_SIZE || n_blocks != WFS_N_BLOCKS
+      || n_stripes > 1)
+    features |= WFS_FEATURE_SUPERBLOCK;
+
+  mkwfs_t *mk = calloc(1, sizeof(mkwfs_t));
+  if (!mk)
+    {
+      fprintf(stderr, "error: out of memory\n");
+      return 1;
+    }
+
+  if (!wfs_layout_init(&mk->layout, features, block_size, n_blocks))
+    {
+      fprintf(stderr, "error: unsupported geometry: %u blocks of %u bytes\n",
+              n_blocks, block_size);
+      return 1;
+    }
+
+  mk->layout.n_stripes = n_stripes;
+  mk->filename = argv[optind];
+  mk->features = features;
+  mk->next_block = 1;
+  mk->buffer = malloc(MKWFS_BUFFER_SIZE);
+  mk->table = calloc(n_blocks, sizeof(uint16_t));
+  mk->dirs = calloc(n_blocks, sizeof(*mk->dirs));
+  if (!mk->buffer || !mk->table || !mk->dirs)
+    {
+      fprintf(stderr, "error: out of memory\n");
+      return 1;
+    }
+
+  stripes[0] = mk->filename;
+  for (int i = 0; i < n_stripes; i++)
+    {
+      mk->stripe_fds[i] = open(stripes[i], O_WRONLY | O_CREAT | O_TRUNC,
+                               0644);
+      if (mk->stripe_fds[i] < 0)
+        {
+          fprintf(stderr, "error: could not create file '%s': %s\n",
+                  stripes[i], strerror(errno));
+          return 1;
+        }
+    }
+  mk->fd = mk->stripe_fds[0];
+
+  int res = 0;
+  if (lseek(mk->fd, mk->layout.data_start, SEEK_SET) < 0)
+    {
+      fprintf(stderr, "error: could not seek in '%s': %s\n",
+              mk->filename, strerror(errno));
+      res = -1;
+    }
+
+  if (res == 0 && argc - optind == 2)
+    res = mkwfs_add_dir(mk, argv[optind + 1], mk->root, WFS_N_FILES);
+
+  if (res == 0)
+    res = mkwfs_flush(mk);
+  if (res == 0)
+    res = mkwfs_write_metadata(mk);
+
+  for (int i = 0; i < n_stripes; i++)
+    {
+      if (close(mk->stripe_fds[i]) < 0 && res == 0)
+        {
+          fprintf(stderr, "error: could not write '%s': %s\n",
+                  stripes[i], strerror(errno));
+          res = -1;
+        }
+    }
+
+  /* A journal left behind by the previous image would be replayed onto
+   * the new one, see wfsjournal.c; its index file and snapshot would be
+   * taken for those of the new one.
+   */
+  static const char * const suffixes[] = { ".jnl", ".idx", ".snap" };
+  for (size_t i = 0;
+       res == 0 && i < sizeof(suffixes) / sizeof(suffixes[0]); i++)
+    {
+      char path[PATH_MAX];
+      if (snprintf(path, sizeof(path), "%s%s", mk->filename, suffixes[i])
+          < sizeof(path))
+        unlink(path);
+    }
+
+  if (res == 0)
+    printf("%s: %d of %u blocks used\n", mk->filename, mk->next_block - 1,
+           n_blocks);
+
+  free(mk->buffer);
+  free(mk->table);
+  for (uint32_t i = 0; i < n_blocks; i++)
+    free(mk->dirs[i]);
+  free(mk->dirs);
+  free(mk);
+
+  return res == 0 ? 0 : 1;
+}
@@ -5,8 +5,17 @@
   COPYING and AUTHORS.
 */
 
+#ifndef __WFS_H__
+#define __WFS_H__
+
 #include <stdint.h>
 
+#if defined(__AVX2__)
+#include <immintrin.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
 /* We keep a copy here and not re-use the kernel header include
  * paths to save us a lot of trouble.
  */
@@ -19,6 +28,42 @@
 #define WFS_MAGIC2 0xf00d1350
 #define WFS_MAGIC3 0x0000beef
 
+/* Feature bits stored in the second magic word. Images without any
+ * feature bits use the original format.
+ */
+#define WFS_FEATURE_EXTENTS 0x00000001 /* Block table stores extents */
+#define WFS_FEATURE_SUPERBLOCK 0x00000002 /* Superblock follows the magic */
+#define WFS_FEATURE_INLINE 0x00000004 /* Small files are stored inline */
+#define WFS_FEATURE_STRIPED 0x00000008 /* Data is striped over devices */
+
+#define WFS_FEATURES (WFS_FEATURE_EXTENTS | WFS_FEATURE_SUPERBLOCK \
+                      | WFS_FEATURE_INLINE | WFS_FEATURE_STRIPED)
+
+/* Images with WFS_FEATURE_SUPERBLOCK record their geometry in a
+ * superblock stored directly after the magic, which moves all other
+ * structures back. Their data area starts at a multiple of the block
+ * size. Other images use WFS_BLOCK_SIZE and WFS_N_BLOCKS. The image id
+ * tells files kept next to the image, such as its snapshot, apart from
+ * those of a previous image created at the same path.
+ */
+typedef struct
+{
+  uint32_t block_size;
+  uint32_t n_blocks;
+  uint32_t n_stripes; /* Only used with WFS_FEATURE_STRIPED */
+  uint32_t image_id;  /* Chosen when the image is created, 0 if unknown */
+  uint8_t reserved[48];
+} __attribute__((__packed__)) wfs_superblock_t;
+
+/* The data blocks of images with WFS_FEATURE_STRIPED, which requires a
+ * superblock, are distributed round-robin over "n_stripes" devices:
+ * block i is stored on device i % n_stripes, as its (i / n_stripes)th
+ * block. Device 0 is the image itself, which holds all metadata and
+ * stores its blocks in the data area as usual. On the other devices the
+ * blocks start at offset 0.
+ */
+#define WFS_MAX_STRIPES 16
+
 #define WFS_FILENAME_SIZE 58
 
 typedef struct
@@ -26,42 +71,129 @@ typedef struct
   char filename[WFS_FILENAME_SIZE];
   uint16_t start_block;
 
-  /* Given that the maximum size of a file is about 8Mb, we use the top
-   * 4 bits of the size field for flags.
+  /* Given that the maximum size of a file is at most 256Mb, we use the
+   * top 4 bits of the size field for flags.
    */
   uint32_t size;
 } __attribute__((__packed__)) wfs_file_entry_t;
 
-#define WFS_BLOCK_SIZE 512 /* Assume 512 byte block size */
+#define WFS_BLOCK_SIZE 512 /* Block size without superblock */
 
 #define WFS_N_FILES 64 /* 4 Kb, 8 x 512 byte block */
-#define WFS_N_BLOCKS 16384
+#define WFS_N_BLOCKS 16384 /* Number of blocks without superblock */
+
+#define WFS_MIN_BLOCK_SIZE 512
+#define WFS_MAX_BLOCK_SIZE 65536
+
+/* Block numbers and extent lengths must stay clear of WFS_BLOCK_EXTENT
+ * and WFS_BLOCK_EOF.
+ */
+#define WFS_MAX_N_BLOCKS 0x7ff0
 
 #define WFS_SIZE_MASK 0x0fffffff /* Mask to extract the size */
 #define WFS_SIZE_IS_DIRECTORY (1 << 31) /* Is directory flag */
+#define WFS_SIZE_IS_INLINE (1 << 30) /* Data is stored in the entry */
+
+/* In images with WFS_FEATURE_INLINE, the data of a small regular file
+ * may be stored in its entry instead: in the filename field, directly
+ * following the terminating zero of the name. The bytes beyond the size
+ * of the file are zero. Such an entry has WFS_SIZE_IS_INLINE set and
+ * WFS_BLOCK_EOF as start block, so that it is not considered empty, and
+ * owns no blocks.
+ */
 
 #define WFS_BLOCK_FREE 0x0
 #define WFS_BLOCK_EOF 0xfffe
 
-#define WFS_ENTRIES_START WFS_MAGIC_SIZE
-
-#define WFS_BLOCK_TABLE_START (WFS_ENTRIES_START + (WFS_N_FILES * sizeof(wfs_file_entry_t)))
-#define WFS_BLOCK_TABLE_SIZE (WFS_N_BLOCKS * sizeof(uint16_t))
+/* In images with WFS_FEATURE_EXTENTS, a chain is a list of extents: runs
+ * of consecutive blocks. The table entry of the first block of a run of
+ * two or more blocks holds WFS_BLOCK_EXTENT combined with the length of
+ * the run; all other entries link to the next block as usual. The end of
+ * an extent and the start of the next one are thus found with a single
+ * lookup. Block numbers never have this bit set, WFS_BLOCK_EOF does.
+ */
+#define WFS_BLOCK_EXTENT 0x8000
 
-#define WFS_DATA_START (WFS_BLOCK_TABLE_START + WFS_BLOCK_TABLE_SIZE)
+/* Geometry of an image and the resulting offsets of its structures. */
+typedef struct
+{
+  uint32_t block_size;
+  uint32_t n_blocks;
+  uint32_t n_dir_files; /* Sub directories occupy a single block */
+  uint32_t entries_start;
+  uint32_t block_table_start;
+  uint32_t block_table_size;
+  uint32_t data_start;
+  uint32_t n_stripes; /* Devices the data blocks are striped over */
+} wfs_layout_t;
 
 
 /*
  * Assorted utility functions
  */
 
-static inline size_t
-wfs_get_size(void)
+/* Computes the layout of an image with the given feature bits and
+ * geometry. Returns false if the geometry is not supported. The layout
+ * is that of an image stored on a single device; "n_stripes" is set
+ * separately for striped images.
+ */
+static inline bool
+wfs_layout_init(wfs_layout_t *layout, uint32_t features,
+                uint32_t block_size, uint32_t n_blocks)
+{
+  if (block_size < WFS_MIN_BLOCK_SIZE || block_size > WFS_MAX_BLOCK_SIZE
+      || (block_size & (block_size - 1)) != 0
+      || n_blocks == 0 || n_blocks > WFS_MAX_N_BLOCKS)
+    return false;
+
+  layout->block_size = block_size;
+  layout->n_blocks = n_blocks;
+  layout->n_dir_files = block_size / sizeof(wfs_file_entry_t);
+  layout->n_stripes = 1;
+
+  layout->entries_start = WFS_MAGIC_SIZE;
+  if (features & WFS_FEATURE_SUPERBLOCK)
+    layout->entries_start += sizeof(wfs_superblock_t);
+
+  layout->block_table_start = layout->entries_start
+      + WFS_N_FILES * sizeof(wfs_file_entry_t);
+  layout->block_table_size = n_blocks * sizeof(uint16_t);
+  layout->data_start = layout->block_table_start + layout->block_table_size;
+
+  if (features & WFS_FEATURE_SUPERBLOCK)
+    layout->data_start = (layout->data_start + block_size - 1)
+        & ~(block_size - 1);
+
+  return true;
+}
+
+/* Returns the number of bytes of device "stripe" used by the image. */
+static inline uint64_t
+wfs_get_stripe_size(const wfs_layout_t *layout, uint32_t stripe)
+{
+  uint64_t n_blocks = (layout->n_blocks + layout->n_stripes - 1 - stripe)
+      / layout->n_stripes;
+
+  return (stripe == 0 ? layout->data_start : 0)
+      + n_blocks * layout->block_size;
+}
+
+/* Returns the size of the image; the size of the first device for
+ * striped images.
+ */
+static inline uint64_t
+wfs_get_size(const wfs_layout_t *layout)
+{
+  return wfs_get_stripe_size(layout, 0);
+}
+
+/* Returns the largest file size that can be stored in the image. */
+static inline uint32_t
+wfs_get_max_file_size(const wfs_layout_t *layout)
 {
-  return WFS_MAGIC_SIZE
-      + sizeof(wfs_file_entry_t) * WFS_N_FILES
-      + WFS_N_BLOCKS * sizeof(uint16_t)
-      + WFS_N_BLOCKS * WFS_BLOCK_SIZE;
+  uint64_t size = (uint64_t)layout->n_blocks * layout->block_size;
+
+  return size < WFS_SIZE_MASK ? size : WFS_SIZE_MASK;
 }
 
 static inline bool
@@ -82,14 +214,272 @@ wfs_file_entry_is_directory(const wfs_file_entry_t *entry)
   return false;
 }
 
+static inline bool
+wfs_file_entry_is_inline(const wfs_file_entry_t *entry)
+{
+  if ((entry->size & WFS_SIZE_IS_INLINE) == WFS_SIZE_IS_INLINE)
+    return true;
+
+  return false;
+}
+
 static inline uint32_t
 wfs_file_entry_get_size(const wfs_file_entry_t *entry)
 {
   return entry->size & WFS_SIZE_MASK;
 }
 
+/* Returns the number of bytes of data that fit in the entry, given the
+ * length of its name.
+ */
 static inline uint32_t
-wfs_get_block_offset(int block)
+wfs_file_entry_get_inline_capacity(const wfs_file_entry_t *entry)
+{
+  int len = 0;
+  while (len < WFS_FILENAME_SIZE && entry->filename[len])
+    len++;
+
+  return len < WFS_FILENAME_SIZE ? WFS_FILENAME_SIZE - len - 1 : 0;
+}
+
+/* Returns the inline data of the entry. */
+static inline char *
+wfs_file_entry_get_inline_data(const wfs_file_entry_t *entry)
 {
-  return WFS_DATA_START + block * WFS_BLOCK_SIZE;
+  return (char *)entry->filename + WFS_FILENAME_SIZE
+      - wfs_file_entry_get_inline_capacity(entry);
 }
+
+/* Returns the offset of "block" in the image. For striped images this
+ * is a position in the image as if it were stored on a single device;
+ * see wfs_get_stripe_offset().
+ */
+static inline uint64_t
+wfs_get_block_offset(const wfs_layout_t *layout, int block)
+{
+  return layout->data_start + (uint64_t)block * layout->block_size;
+}
+
+/* Returns the device of a striped image that stores "block". */
+static inline uint32_t
+wfs_get_stripe(const wfs_layout_t *layout, int block)
+{
+  return block % layout->n_stripes;
+}
+
+/* Returns the offset of "block" on the device that stores it. */
+static inline uint64_t
+wfs_get_stripe_offset(const wfs_layout_t *layout, int block)
+{
+  return (wfs_get_stripe(layout, block) == 0 ? layout->data_start : 0)
+      + (uint64_t)(block / layout->n_stripes) * layout->block_size;
+}
+
+/* Returns true if the block table entry "value" of an extent image
+ * starts an extent.
+ */
+static inline bool
+wfs_block_is_extent(uint16_t value)
+{
+  return (value & WFS_BLOCK_EXTENT) && value != WFS_BLOCK_EOF;
+}
+
+static inline int
+wfs_block_get_extent_length(uint16_t value)
+{
+  return value & ~WFS_BLOCK_EXTENT;
+}
+
+/* Converts the entries [start, end) of the block table "table" with
+ * "n_blocks" entries, in the original format, to the extent format and
+ * stores them in "out". Entry "start" must not continue the run of the
+ * previous entry. Extents starting within the range may extend beyond it.
+ */
+static inline void
+wfs_block_table_encode(const uint16_t *table, int n_blocks, int start,
+                       int end, uint16_t *out)
+{
+  int i = start;
+
+  while (i < end)
+    {
+      /* Entry i starts a run, find its end. */
+      int last = i;
+      while (last + 1 < n_blocks && table[last] == last + 2)
+        last++;
+
+      out[i - start] = last > i ? WFS_BLOCK_EXTENT | (last - i + 1)
+          : table[i];
+      for (int j = i + 1; j <= last && j < end; j++)
+        out[j - start] = table[j];
+
+      i = last + 1;
+    }
+}
+
+/* Converts the block table "table" with "n_blocks" entries in the extent
+ * format to the original format, in place. Extents reaching beyond the
+ * end of the table are cut off.
+ */
+static inline void
+wfs_block_table_decode(uint16_t *table, int n_blocks)
+{
+  for (int i = 0; i < n_blocks; i++)
+    {
+      if (!wfs_block_is_extent(table[i]))
+        continue;
+
+      int length = wfs_block_get_extent_length(table[i]);
+      if (length < 2 || i + length > n_blocks)
+        table[i] = WFS_BLOCK_EOF;
+      else
+        table[i] = i + 2;
+    }
+}
+
+/* Block table scans. The kernels compare 32 consecutive entries of a
+ * block table at once and return a mask with bit i set for entry i, so
+ * that a table is scanned a free space bitmap word at a time. They use
+ * AVX2 or SSE2 instructions if the compiler targets them.
+ */
+
+/* Returns the mask of the entries equal to "value". */
+static inline uint32_t
+wfs_block_table_match32(const uint16_t *table, uint16_t value)
+{
+#if defined(__AVX2__)
+  const __m256i v = _mm256_set1_epi16(value);
+  __m256i a = _mm256_cmpeq_epi16(_mm256_loadu_si256((const __m256i *)table),
+                                 v);
+  __m256i b = _mm256_cmpeq_epi16(_mm256_loadu_si256((const __m256i *)
+                                                    (table + 16)), v);
+
+  /* Packing works within 128-bit lanes, the permute restores the order
+   * of the entries.
+   */
+  __m256i packed = _mm256_permute4x64_epi64(_mm256_packs_epi16(a, b), 0xd8);
+
+  return (uint32_t)_mm256_movemask_epi8(packed);
+#elif defined(__SSE2__)
+  const __m128i v = _mm_set1_epi16(value);
+  uint32_t mask = 0;
+
+  for (int i = 0; i < 32; i += 16)
+    {
+      __m128i a = _mm_cmpeq_epi16(_mm_loadu_si128((const __m128i *)
+                                                  (table + i)), v);
+      __m128i b = _mm_cmpeq_epi16(_mm_loadu_si128((const __m128i *)
+                                                  (table + i + 8)), v);
+
+      mask |= (uint32_t)_mm_movemask_epi8(_mm_packs_epi16(a, b)) << i;
+    }
+
+  return mask;
+#else
+  uint32_t mask = 0;
+
+  for (int i = 0; i < 32; i++)
+    if (table[i] == value)
+      mask |= 1u << i;
+
+  return mask;
+#endif
+}
+
+/* Returns the mask of the entries of a table in the original format
+ * that refer beyond block "n_blocks" and are not WFS_BLOCK_EOF.
+ */
+static inline uint32_t
+wfs_block_table_invalid32(const uint16_t *table, uint16_t n_blocks)
+{
+#if defined(__AVX2__)
+  const __m256i max = _mm256_set1_epi16(n_blocks);
+  const __m256i eof = _mm256_set1_epi16(WFS_BLOCK_EOF);
+  const __m256i zero = _mm256_setzero_si256();
+  __m256i valid[2];
+
+  /* Entries not above the maximum saturate to zero. */
+  for (int i = 0; i < 2; i++)
+    {
+      __m256i x = _mm256_loadu_si256((const __m256i *)(table + 16 * i));
+      valid[i] = _mm256_or_si256(_mm256_cmpeq_epi16(_mm256_subs_epu16(x, max),
+                                                    zero),
+                                 _mm256_cmpeq_epi16(x, eof));
+    }
+
+  __m256i packed = _mm256_permute4x64_epi64(_mm256_packs_epi16(valid[0],
+                                                               valid[1]),
+                                            0xd8);
+
+  return ~(uint32_t)_mm256_movemask_epi8(packed);
+#elif defined(__SSE2__)
+  const __m128i max = _mm_set1_epi16(n_blocks);
+  const __m128i eof = _mm_set1_epi16(WFS_BLOCK_EOF);
+  const __m128i zero = _mm_setzero_si128();
+  __m128i valid[4];
+
+  /* Entries not above the maximum saturate to zero. */
+  for (int i = 0; i < 4; i++)
+    {
+      __m128i x = _mm_loadu_si128((const __m128i *)(table + 8 * i));
+      valid[i] = _mm_or_si128(_mm_cmpeq_epi16(_mm_subs_epu16(x, max), zero),
+                              _mm_cmpeq_epi16(x, eof));
+    }
+
+  uint32_t mask = (uint32_t)_mm_movemask_epi8(_mm_packs_epi16(valid[0],
+                                                              valid[1]))
+      | (uint32_t)_mm_movemask_epi8(_mm_packs_epi16(valid[2],
+                                                    valid[3])) << 16;
+
+  return ~mask;
+#else
+  uint32_t mask = 0;
+
+  for (int i = 0; i < 32; i++)
+    if (table[i] > n_blocks && table[i] != WFS_BLOCK_EOF)
+      mask |= 1u << i;
+
+  return mask;
+#endif
+}
+
+/* Returns the number of entries among the first "n" of "table" that are
+ * equal to "value".
+ */
+static inline int
+wfs_block_table_count(const uint16_t *table, int n, uint16_t value)
+{
+  int count = 0, i = 0;
+
+  for (; i + 32 <= n; i += 32)
+    count += __builtin_popcount(wfs_block_table_match32(table + i, value));
+  for (; i < n; i++)
+    if (table[i] == value)
+      count++;
+
+  return count;
+}
+
+/* Returns the index of the first invalid entry of the block table
+ * "table" in the original format, which has "n_blocks" entries, or -1
+ * if all of them are valid.
+ */
+static inline int
+wfs_block_table_find_invalid(const uint16_t *table, int n_blocks)
+{
+  int i = 0;
+
+  for (; i + 32 <= n_blocks; i += 32)
+    {
+      uint32_t mask = wfs_block_table_invalid32(table + i, n_blocks);
+      if (mask)
+        return i + __builtin_ctz(mask);
+    }
+  for (; i < n_blocks; i++)
+    if (table[i] > n_blocks && table[i] != WFS_BLOCK_EOF)
+      return i;
+
+  return -1;
+}
+
+#endif /* __WFS_H__ */
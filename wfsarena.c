@@ -0,0 +1,285 @@
+/* wfsarena -- Per-thread allocation of request temporaries.
+ *
+ * Copyright (C) 2017  Leiden University, The Netherlands.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <errno.h>
+
+#include "wfsimage.h"
+
+
+/* Buffers needed only while a request is handled are carved from an
+ * arena owned by the calling thread, so that requests handled by
+ * different threads do not meet in the allocator. Memory is handed out
+ * from chunks in stack order: wfs_arena_release() returns an allocation
+ * and everything allocated after it, and wfs_arena_reset() returns all
+ * memory at the end of a request.
+ *
+ * An arena starts with a single chunk. When an allocation does not fit,
+ * a further chunk is added; on the next reset the chunks are replaced
+ * by a single chunk large enough for all of them, up to
+ * WFS_ARENA_MAX_SIZE, so that after a few requests the arena no longer
+ * allocates at all.
+ */
+
+#define WFS_ARENA_CHUNK_SIZE (256 * 1024)
+#define WFS_ARENA_MAX_SIZE (16 * 1024 * 1024)
+#define WFS_ARENA_ALIGN 16
+
+struct wfs_arena_chunk
+{
+  struct wfs_arena_chunk *prev;
+  size_t size;
+  size_t used;
+  uint8_t data[] __attribute__((aligned(WFS_ARENA_ALIGN)));
+};
+
+struct wfs_arena
+{
+  /* The chunk allocations are taken from, preceded by the chunks that
+   * filled up before.
+   */
+  struct wfs_arena_chunk *chunk;
+  size_t total_size;
+  size_t peak_size;
+
+  wfs_image_t *image;
+  struct wfs_arena *prev;
+  struct wfs_arena *next;
+};
+
+static struct wfs_arena_chunk *
+wfs_arena_chunk_new(size_t size)
+{
+  struct wfs_arena_chunk *chunk = malloc(sizeof(struct wfs_arena_chunk)
+                                         + size);
+  if (!chunk)
+    return NULL;
+
+  chunk->prev = NULL;
+  chunk->size = size;
+  chunk->used = 0;
+
+  return chunk;
+}
+
+static void
+wfs_arena_free(struct wfs_arena *arena)
+{
+  while (arena->chunk)
+    {
+      struct wfs_arena_chunk *prev = arena->chunk->prev;
+      free(arena->chunk);
+      arena->chunk = prev;
+    }
+
+  free(arena);
+}
+
+/* Called when a thread that used the image exits. */
+static void
+wfs_arena_destroy(void *data)
+{
+  struct wfs_arena *arena = data;
+  wfs_image_t *image = arena->image;
+
+  pthread_mutex_lock(&image->arena_lock);
+
+  if (arena->prev)
+    arena->prev->next = arena->next;
+  else
+    image->arenas = arena->next;
+  if (arena->next)
+    arena->next->prev = arena->prev;
+
+  pthread_mutex_unlock(&image->arena_lock);
+
+  wfs_arena_free(arena);
+}
+
+/* Returns the arena of the calling thread, setting it up on first use.
+ * Returns NULL if no arena could be created.
+ */
+static struct wfs_arena *
+wfs_arena_get(wfs_image_t *image)
+{
+  struct wfs_arena *arena = pthread_getspecific(image->arena_key);
+  if (arena)
+    return arena;
+
+  arena = calloc(1, sizeof(struct wfs_arena));
+  if (!arena)
+    return NULL;
+
+  arena->chunk = wfs_arena_chunk_new(WFS_ARENA_CHUNK_SIZE);
+  if (!arena->chunk)
+    {
+      free(arena);
+      return NULL;
+    }
+
+  arena->total_size = WFS_ARENA_CHUNK_SIZE;
+  arena->peak_size = WFS_ARENA_CHUNK_SIZE;
+  arena->image = image;
+
+  pthread_mutex_lock(&image->arena_lock);
+  arena->next = image->arenas;
+  if (arena->next)
+    arena->next->prev = arena;
+  image->arenas = arena;
+  pthread_mutex_unlock(&image->arena_lock);
+
+  pthread_setspecific(image->arena_key, arena);
+
+  return arena;
+}
+
+/* Allocates "size" bytes from the arena of the calling thread. The
+ * memory remains valid until it is released with wfs_arena_release() or
+ * wfs_arena_reset() by the same thread. Returns NULL if memory is
+ * exhausted.
+ */
+void *
+wfs_arena_alloc(wfs_image_t *image, size_t size)
+{
+  struct wfs_arena *arena = wfs_arena_get(image);
+  if (!arena)
+    return NULL;
+
+  size = (size + WFS_ARENA_ALIGN - 1) & ~(size_t)(WFS_ARENA_ALIGN - 1);
+
+  struct wfs_arena_chunk *chunk = arena->chunk;
+  if (chunk->size - chunk->used < size)
+    {
+      size_t chunk_size = WFS_ARENA_CHUNK_SIZE;
+      if (chunk_size < size)
+        chunk_size = size;
+
+      chunk = wfs_arena_chunk_new(chunk_size);
+      if (!chunk)
+        return NULL;
+
+      chunk->prev = arena->chunk;
+      arena->chunk = chunk;
+      arena->total_size += chunk_size;
+      if (arena->peak_size < arena->total_size)
+        arena->peak_size = arena->total_size;
+
+      WFS_STATS_ADD(image, n_arena_chunks, 1);
+    }
+
+  void *res = chunk->data + chunk->used;
+  chunk->used += size;
+
+  return res;
+}
+
+/* Frees the most recent chunk, which must not be the first one. */
+static void
+wfs_arena_pop_chunk(struct wfs_arena *arena)
+{
+  struct wfs_arena_chunk *chunk = arena->chunk;
+
+  arena->chunk = chunk->prev;
+  arena->total_size -= chunk->size;
+  free(chunk);
+}
+
+/* Returns "ptr", allocated by wfs_arena_alloc(), to the arena of the
+ * calling thread, together with everything allocated after it.
+ */
+void
+wfs_arena_release(wfs_image_t *image, void *ptr)
+{
+  struct wfs_arena *arena = pthread_getspecific(image->arena_key);
+  uint8_t *p = ptr;
+
+  if (!arena || !p)
+    return;
+
+  while (arena->chunk->prev
+         && (p < arena->chunk->data
+             || p >= arena->chunk->data + arena->chunk->size))
+    wfs_arena_pop_chunk(arena);
+
+  if (p >= arena->chunk->data && p < arena->chunk->data + arena->chunk->size)
+    arena->chunk->used = p - arena->chunk->data;
+}
+
+/* Returns all memory allocated from the arena of the calling thread, at
+ * the end of a request.
+ */
+void
+wfs_arena_reset(wfs_image_t *image)
+{
+  struct wfs_arena *arena = pthread_getspecific(image->arena_key);
+  if (!arena)
+    return;
+
+  while (arena->chunk->prev)
+    wfs_arena_pop_chunk(arena);
+
+  /* The first chunk is only replaced if the larger one can be had. */
+  size_t size = arena->peak_size;
+  if (size > WFS_ARENA_MAX_SIZE)
+    size = WFS_ARENA_MAX_SIZE;
+
+  if (size > arena->chunk->size)
+    {
+      struct wfs_arena_chunk *chunk = wfs_arena_chunk_new(size);
+      if (chunk)
+        {
+          free(arena->chunk);
+          arena->chunk = chunk;
+          arena->total_size = size;
+        }
+    }
+
+  arena->chunk->used = 0;
+  arena->peak_size = arena->chunk->size;
+}
+
+/* Prepares the image for arena allocations. Returns 0 on success, -1 on
+ * failure.
+ */
+int
+wfs_arena_init(wfs_image_t *image)
+{
+  if (pthread_key_create(&image->arena_key, wfs_arena_destroy) != 0)
+    {
+      fprintf(stderr, "error: could not create arena thread key\n");
+      return -1;
+    }
+
+  image->arena_key_created = true;
+
+  return 0;
+}
+
+/* Releases the arenas of all threads. No thread may access the image
+ * concurrently.
+ */
+void
+wfs_arena_fini(wfs_image_t *image)
+{
+  if (!image->arena_key_created)
+    return;
+
+  pthread_setspecific(image->arena_key, NULL);
+  pthread_key_delete(image->arena_key);
+  image->arena_key_created = false;
+
+  pthread_mutex_lock(&image->arena_lock);
+
+  while (image->arenas)
+    {
+      struct wfs_arena *next = image->arenas->next;
+      wfs_arena_free(image->arenas);
+      image->arenas = next;
+    }
+
+  pthread_mutex_unlock(&image->arena_lock);
+}
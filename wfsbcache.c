@@ -0,0 +1,570 @@
+/* wfsbcache -- Write-back cache of WFS data blocks.
+ *
+ * Copyright (C) 2017  Leiden University, The Netherlands.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <time.h>
+
+#include "wfsimage.h"
+
+
+/* Writes to file data are collected in the cache, so that a burst of
+ * small writes results in a few large sequential writes of the image
+ * once dirty blocks are flushed. Reads are not cached, but are served
+ * from the cache for blocks that it holds. All cache state is protected
+ * by bcache_lock.
+ */
+
+static inline wfs_cached_block_t **
+wfs_bcache_bucket(wfs_image_t *image, uint16_t block)
+{
+  return &image->bcache_hash[block & (WFS_BCACHE_HASH_SIZE - 1)];
+}
+
+static wfs_cached_block_t *
+wfs_bcache_lookup(wfs_image_t *image, uint16_t block)
+{
+  for (wfs_cached_block_t *cb = *wfs_bcache_bucket(image, block);
+       cb; cb = cb->hash_next)
+    {
+      if (cb->block == block)
+        return cb;
+    }
+
+  return NULL;
+}
+
+static void
+wfs_bcache_lru_remove(wfs_image_t *image, wfs_cached_block_t *cb)
+{
+  if (cb->lru_prev)
+    cb->lru_prev->lru_next = cb->lru_next;
+  else
+    image->bcache_lru_head = cb->lru_next;
+
+  if (cb->lru_next)
+    cb->lru_next->lru_prev = cb->lru_prev;
+  else
+    image->bcache_lru_tail = cb->lru_prev;
+
+  cb->lru_prev = cb->lru_next = NULL;
+}
+
+/* Makes "cb" the most recently used block. */
+static void
+wfs_bcache_lru_insert(wfs_image_t *image, wfs_cached_block_t *cb)
+{
+  cb->lru_prev = NULL;
+  cb->lru_next = image->bcache_lru_head;
+
+  if (image->bcache_lru_head)
+    image->bcache_lru_head->lru_prev = cb;
+  else
+    image->bcache_lru_tail = cb;
+
+  image->bcache_lru_head = cb;
+}
+
+/* Removes "cb" from the cache and puts it on the unused list. */
+static void
+wfs_bcache_release(wfs_image_t *image, wfs_cached_block_t *cb)
+{
+  for (wfs_cached_block_t **p = wfs_bcache_bucket(image, cb->block);
+       *p; p = &(*p)->hash_next)
+    {
+      if (*p == cb)
+        {
+          *p = cb->hash_next;
+          break;
+        }
+    }
+
+  wfs_bcache_lru_remove(image, cb);
+
+  if (cb->dirty)
+    image->bcache_n_dirty--;
+
+  cb->block = WFS_BLOCK_FREE;
+  cb->dirty = false;
+  cb->hash_next = image->bcache_unused;
+  image->bcache_unused = cb;
+}
+
+static int
+wfs_bcache_compare(const void *a, const void *b)
+{
+  const wfs_cached_block_t *cb_a = *(wfs_cached_block_t * const *)a;
+  const wfs_cached_block_t *cb_b = *(wfs_cached_block_t * const *)b;
+
+  return (int)cb_a->block - (int)cb_b->block;
+}
+
+/* Writes back the dirty blocks dirty[start] up to dirty[end], which have
+ * been copied to the segments.
+ */
+static int
+wfs_bcache_write_batch(wfs_image_t *image, wfs_cached_block_t **dirty,
+                       int start, int end, wfs_io_segment_t *segments,
+                       int n_segments)
+{
+  if (wfs_image_write_segments(image, segments, n_segments) < 0)
+    return -EIO;
+
+  for (int i = start; i < end; i++)
+    dirty[i]->dirty = false;
+  image->bcache_n_dirty -= end - start;
+
+  return 0;
+}
+
+/* Writes all dirty blocks back to the image, in order of their offset.
+ * Runs of adjacent blocks are combined into a single segment, and up to
+ * WFS_MAX_SEGMENTS segments are submitted as one batch. The caller must
+ * hold bcache_lock. Returns 0 on success, error code otherwise.
+ */
+static int
+wfs_bcache_flush_locked(wfs_image_t *image)
+{
+  const uint32_t block_size = image->layout.block_size;
+  uint8_t *buf = image->bcache_flush_buf;
+  wfs_cached_block_t **dirty = image->bcache_dirty;
+  int n_dirty = 0;
+  int res = 0;
+
+  if (image->bcache_n_dirty == 0)
+    return 0;
+
+  for (wfs_cached_block_t *cb = image->bcache_lru_head; cb; cb = cb->lru_next)
+    {
+      if (cb->dirty)
+        dirty[n_dirty++] = cb;
+    }
+
+  qsort(dirty, n_dirty, sizeof(wfs_cached_block_t *), wfs_bcache_compare);
+
+  /* Readers that did not go through the cache compare this, and retry
+   * if the image was modified while they were reading.
+   */
+  image->bcache_seq++;
+
+  /* The blocks are copied to the flush buffer in order, so that every
+   * run is contiguous in memory as well.
+   */
+  wfs_io_segment_t segments[WFS_MAX_SEGMENTS];
+  int n_segments = 0;
+  int batch_start = 0;
+
+  for (int i = 0; i < n_dirty; i++)
+    {
+      bool extends = i > 0 && dirty[i]->block == dirty[i - 1]->block + 1;
+
+      if (!extends && n_segments == WFS_MAX_SEGMENTS)
+        {
+          if (wfs_bcache_write_batch(image, dirty, batch_start, i,
+                                     segments, n_segments) < 0)
+            res = -EIO;
+
+          batch_start = i;
+          n_segments = 0;
+        }
+
+      memcpy(buf + i * block_size, dirty[i]->data, block_size);
+
+      if (extends && n_segments > 0)
+        segments[n_segments - 1].size += block_size;
+      else
+        {
+          segments[n_segments].buf = buf + i * block_size;
+          segments[n_segments].size = block_size;
+          segments[n_segments].offset =
+              wfs_get_block_offset(&image->layout, dirty[i]->block - 1);
+          n_segments++;
+        }
+    }
+
+  if (n_segments > 0
+      && wfs_bcache_write_batch(image, dirty, batch_start, n_dirty,
+                                segments, n_segments) < 0)
+    res = -EIO;
+
+  return res;
+}
+
+/* Returns a cache block that is not in use. If the cache is full, the
+ * least recently used block is evicted, after writing back all dirty
+ * blocks if it is dirty. Returns NULL on I/O error.
+ */
+static wfs_cached_block_t *
+wfs_bcache_get_unused(wfs_image_t *image)
+{
+  wfs_cached_block_t *cb = image->bcache_unused;
+
+  if (cb)
+    {
+      image->bcache_unused = cb->hash_next;
+      return cb;
+    }
+
+  cb = image->bcache_lru_tail;
+  if (cb->dirty && wfs_bcache_flush_locked(image) < 0)
+    return NULL;
+
+  wfs_bcache_release(image, cb);
+
+  cb = image->bcache_unused;
+  image->bcache_unused = cb->hash_next;
+
+  return cb;
+}
+
+/* Writes all dirty blocks back to the image. Returns 0 on success,
+ * error code otherwise.
+ */
+int
+wfs_bcache_flush(wfs_image_t *image)
+{
+  if (!image->bcache)
+    return 0;
+
+  pthread_mutex_lock(&image->bcache_lock);
+  int res = wfs_bcache_flush_locked(image);
+  pthread_mutex_unlock(&image->bcache_lock);
+
+  return res;
+}
+
+/* Drops "block" from the cache without writing it back. Must be called
+ * when a block is freed, as it may be reused for a directory, which is
+ * accessed without going through the cache.
+ */
+void
+wfs_bcache_discard(wfs_image_t *image, uint16_t block)
+{
+  if (!image->bcache)
+    return;
+
+  pthread_mutex_lock(&image->bcache_lock);
+
+  wfs_cached_block_t *cb = wfs_bcache_lookup(image, block);
+  if (cb)
+    wfs_bcache_release(image, cb);
+
+  pthread_mutex_unlock(&image->bcache_lock);
+}
+
+/* Calls "func" for every part of the segments that falls within a
+ * single data block. Returns the first error returned by "func".
+ */
+static int
+wfs_bcache_foreach_block(const wfs_layout_t *layout,
+                         const wfs_io_segment_t *segments, int n_segments,
+                         int (* func) (uint16_t block, size_t block_offset,
+                                       uint8_t *buf, size_t size,
+                                       void *data),
+                         void *data)
+{
+  for (int i = 0; i < n_segments; i++)
+    {
+      off_t offset = segments[i].offset;
+      size_t done = 0;
+
+      if (offset < layout->data_start)
+        return -EINVAL;
+
+      while (done < segments[i].size)
+        {
+          off_t rel = offset + done - layout->data_start;
+          size_t block_offset = rel % layout->block_size;
+          size_t size = layout->block_size - block_offset;
+          if (size > segments[i].size - done)
+            size = segments[i].size - done;
+
+          int res = func(rel / layout->block_size + 1, block_offset,
+                         (uint8_t *)segments[i].buf + done, size, data);
+          if (res < 0)
+            return res;
+
+          done += size;
+        }
+    }
+
+  return 0;
+}
+
+static int
+wfs_bcache_copy_out(uint16_t block, size_t block_offset, uint8_t *buf,
+                    size_t size, void *data)
+{
+  wfs_image_t *image = data;
+  wfs_cached_block_t *cb = wfs_bcache_lookup(image, block);
+
+  if (cb)
+    {
+      memcpy(buf, cb->data + block_offset, size);
+      WFS_STATS_ADD(image, n_bcache_hits, 1);
+    }
+  else
+    WFS_STATS_ADD(image, n_bcache_misses, 1);
+
+  return 0;
+}
+
+static int
+wfs_bcache_copy_in(uint16_t block, size_t block_offset, uint8_t *buf,
+                   size_t size, void *data)
+{
+  wfs_image_t *image = data;
+  wfs_cached_block_t *cb = wfs_bcache_lookup(image, block);
+
+  if (cb)
+    {
+      wfs_bcache_lru_remove(image, cb);
+      WFS_STATS_ADD(image, n_bcache_hits, 1);
+    }
+  else
+    {
+      WFS_STATS_ADD(image, n_bcache_misses, 1);
+      cb = wfs_bcache_get_unused(image);
+      if (!cb)
+        return -EIO;
+
+      /* A partial write of a block that is not cached needs the rest of
+       * its contents.
+       */
+      const uint32_t block_size = image->layout.block_size;
+      if (size < block_size
+          && wfs_image_pread(image, cb->data, block_size,
+                             wfs_get_block_offset(&image->layout, block - 1))
+             != block_size)
+        {
+          cb->hash_next = image->bcache_unused;
+          image->bcache_unused = cb;
+          return -EIO;
+        }
+
+      cb->block = block;
+      cb->dirty = false;
+      cb->hash_next = *wfs_bcache_bucket(image, block);
+      *wfs_bcache_bucket(image, block) = cb;
+    }
+
+  memcpy(cb->data + block_offset, buf, size);
+  if (!cb->dirty)
+    {
+      cb->dirty = true;
+      image->bcache_n_dirty++;
+    }
+
+  wfs_bcache_lru_insert(image, cb);
+
+  return 0;
+}
+
+static int
+wfs_bcache_check_dirty(uint16_t block, size_t block_offset, uint8_t *buf,
+                       size_t size, void *data)
+{
+  wfs_cached_block_t *cb = wfs_bcache_lookup((wfs_image_t *)data, block);
+
+  return cb && cb->dirty ? -EAGAIN : 0;
+}
+
+/* Returns true if the cache holds a dirty block within the segments, so
+ * that the image itself does not contain the current data. Dirty blocks
+ * are only marked clean after they have been written back.
+ */
+bool
+wfs_bcache_is_dirty(wfs_image_t *image, const wfs_io_segment_t *segments,
+                    int n_segments)
+{
+  if (!image->bcache)
+    return false;
+
+  pthread_mutex_lock(&image->bcache_lock);
+  bool dirty = image->bcache_n_dirty > 0
+      && wfs_bcache_foreach_block(&image->layout, segments, n_segments,
+                                  wfs_bcache_check_dirty, image) < 0;
+  pthread_mutex_unlock(&image->bcache_lock);
+
+  return dirty;
+}
+
+/* A read of the image that bypasses the cache is bracketed by these. The
+ * value returned by wfs_bcache_begin_read() must be passed to
+ * wfs_bcache_end_read(), which copies blocks held by the cache over the
+ * data that was read. It returns false if the read must be retried,
+ * because dirty blocks were written back in the meantime.
+ */
+unsigned int
+wfs_bcache_begin_read(wfs_image_t *image)
+{
+  pthread_mutex_lock(&image->bcache_lock);
+  unsigned int seq = image->bcache_seq;
+  pthread_mutex_unlock(&image->bcache_lock);
+
+  return seq;
+}
+
+bool
+wfs_bcache_end_read(wfs_image_t *image, wfs_io_segment_t *segments,
+                    int n_segments, unsigned int seq)
+{
+  bool done = true;
+
+  pthread_mutex_lock(&image->bcache_lock);
+
+  if (image->bcache_seq != seq)
+    done = false;
+  else if (image->bcache_lru_head)
+    wfs_bcache_foreach_block(&image->layout, segments, n_segments,
+                             wfs_bcache_copy_out, image);
+
+  pthread_mutex_unlock(&image->bcache_lock);
+
+  return done;
+}
+
+/* Stores the data of all segments in the cache. Returns 0 on success,
+ * error code otherwise.
+ */
+int
+wfs_bcache_write_segments(wfs_image_t *image,
+                          const wfs_io_segment_t *segments, int n_segments)
+{
+  pthread_mutex_lock(&image->bcache_lock);
+  int res = wfs_bcache_foreach_block(&image->layout, segments, n_segments,
+                                     wfs_bcache_copy_in, image);
+  pthread_mutex_unlock(&image->bcache_lock);
+
+  return res;
+}
+
+/* Writes back dirty blocks every WFS_BCACHE_FLUSH_INTERVAL seconds. */
+static void *
+wfs_bcache_flusher(void *data)
+{
+  wfs_image_t *image = data;
+
+  pthread_mutex_lock(&image->bcache_lock);
+
+  while (!image->bcache_stop)
+    {
+      struct timespec deadline;
+      clock_gettime(CLOCK_REALTIME, &deadline);
+      deadline.tv_sec += WFS_BCACHE_FLUSH_INTERVAL;
+
+      pthread_cond_timedwait(&image->bcache_cond, &image->bcache_lock,
+                             &deadline);
+
+      if (!image->bcache_stop && wfs_bcache_flush_locked(image) < 0)
+        fprintf(stderr, "error: could not write back cached blocks of '%s'\n",
+                image->filename);
+    }
+
+  pthread_mutex_unlock(&image->bcache_lock);
+
+  return NULL;
+}
+
+static void
+wfs_bcache_free(wfs_image_t *image)
+{
+  free(image->bcache);
+  free(image->bcache_data);
+  free(image->bcache_dirty);
+  free(image->bcache_flush_buf);
+  image->bcache = NULL;
+  image->bcache_data = NULL;
+  image->bcache_dirty = NULL;
+  image->bcache_flush_buf = NULL;
+}
+
+/* Sets up the block cache. Dirty blocks are only written back when the
+ * image is synced until wfs_bcache_start() is called. Returns 0 on
+ * success, -1 on failure.
+ */
+int
+wfs_bcache_init(wfs_image_t *image)
+{
+  const int n_blocks = WFS_BCACHE_SIZE / image->layout.block_size;
+
+  image->bcache_n_blocks = n_blocks;
+  image->bcache = calloc(n_blocks, sizeof(wfs_cached_block_t));
+  image->bcache_data = malloc(WFS_BCACHE_SIZE);
+  image->bcache_dirty = malloc(n_blocks * sizeof(wfs_cached_block_t *));
+  image->bcache_flush_buf = malloc(WFS_BCACHE_SIZE);
+  if (!image->bcache || !image->bcache_data || !image->bcache_dirty
+      || !image->bcache_flush_buf)
+    {
+      fprintf(stderr, "error: could not allocate block cache\n");
+      wfs_bcache_free(image);
+      return -1;
+    }
+
+  for (int i = 0; i < n_blocks; i++)
+    {
+      image->bcache[i].data = image->bcache_data
+          + i * image->layout.block_size;
+      image->bcache[i].hash_next = i + 1 < n_blocks
+          ? &image->bcache[i + 1] : NULL;
+    }
+
+  image->bcache_unused = image->bcache;
+  image->bcache_stop = false;
+  image->bcache_flusher_started = false;
+
+  return 0;
+}
+
+/* Starts the thread that writes back dirty blocks periodically, if the
+ * image has a block cache. Must be called after forking, as the thread
+ * would not survive it. Returns 0 on success, -1 on failure.
+ */
+int
+wfs_bcache_start(wfs_image_t *image)
+{
+  if (!image->bcache || image->bcache_flusher_started)
+    return 0;
+
+  if (pthread_create(&image->bcache_flusher, NULL, wfs_bcache_flusher,
+                     image) != 0)
+    {
+      fprintf(stderr, "error: could not start block cache flusher\n");
+      return -1;
+    }
+
+  image->bcache_flusher_started = true;
+
+  return 0;
+}
+
+/* Stops the flusher thread, if it was started, writes back all dirty
+ * blocks and releases the cache.
+ */
+void
+wfs_bcache_fini(wfs_image_t *image)
+{
+  if (!image->bcache)
+    return;
+
+  if (image->bcache_flusher_started)
+    {
+      pthread_mutex_lock(&image->bcache_lock);
+      image->bcache_stop = true;
+      pthread_cond_signal(&image->bcache_cond);
+      pthread_mutex_unlock(&image->bcache_lock);
+
+      pthread_join(image->bcache_flusher, NULL);
+      image->bcache_flusher_started = false;
+    }
+
+  if (wfs_bcache_flush(image) < 0)
+    fprintf(stderr, "error: could not write back cached blocks of '%s'\n",
+            image->filename);
+
+  wfs_bcache_free(image);
+}
@@ -0,0 +1,461 @@
+/* wfsbench -- Benchmark of the WFS file system routines.
+ *
+ * Copyright (C) 2017  Leiden University, The Netherlands.
+ *
+ * Exercises the routines behind the FUSE operations directly on a
+ * synthetic image, without mounting it, and reports throughput and
+ * latency percentiles for every benchmark.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <unistd.h>
+#include <time.h>
+
+#include "wfsimage.h"
+
+
+#define BENCH_BIG_SIZE (4 * 1024 * 1024)
+#define BENCH_FRAG_SIZE (1024 * 1024)
+#define BENCH_WRITE_SIZE (1024 * 1024)
+#define BENCH_DEPTH 7
+#define BENCH_N_SMALL 48
+#define BENCH_SEQ_CHUNK (128 * 1024)
+#define BENCH_RAND_CHUNK 4096
+
+typedef struct
+{
+  const char *name;
+  double *samples;
+  int n_samples;
+  int n_allocated;
+  double total;
+} bench_t;
+
+static double
+now(void)
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void
+bench_init(bench_t *bench, const char *name)
+{
+  memset(bench, 0, sizeof(bench_t));
+  bench->name = name;
+}
+
+static void
+bench_add(bench_t *bench, double start)
+{
+  double elapsed = now() - start;
+
+  if (bench->n_samples == bench->n_allocated)
+    {
+      bench->n_allocated = bench->n_allocated ? bench->n_allocated * 2 : 1024;
+      bench->samples = realloc(bench->samples,
+                               bench->n_allocated * sizeof(double));
+      if (!bench->samples)
+        {
+          fprintf(stderr, "error: out of memory\n");
+          exit(1);
+        }
+    }
+
+  bench->samples[bench->n_samples++] = elapsed;
+  bench->total += elapsed;
+}
+
+static int
+compare_double(const void *a, const void *b)
+{
+  double da = *(const double *)a, db = *(const double *)b;
+
+  return da < db ? -1 : da > db;
+}
+
+static void
+bench_report(bench_t *bench)
+{
+  if (bench->n_samples == 0)
+    return;
+
+  qsort(bench->samples, bench->n_samples, sizeof(double), compare_double);
+
+  double p50 = bench->samples[bench->n_samples / 2];
+  double p99 = bench->samples[(int)(bench->n_samples * 0.99)];
+
+  printf("%-16s %8d ops %12.0f ops/s   p50 %9.2f us   p99 %9.2f us\n",
+         bench->name, bench->n_samples, bench->n_samples / bench->total,
+         p50 * 1e6, p99 * 1e6);
+
+  free(bench->samples);
+}
+
+static void
+die(const char *what, int res)
+{
+  fprintf(stderr, "error: %s: %s\n", what, strerror(-res));
+  exit(1);
+}
+
+/* Creates a file and fills it with "size" bytes of pseudo-random data,
+ * written in chunks of "chunk" bytes.
+ */
+static wfs_ino_t
+create_file(wfs_image_t *image, wfs_ino_t parent, const char *name,
+            size_t size, size_t chunk)
+{
+  wfs_file_entry_t entry;
+  wfs_ino_t ino;
+
+  int res = wfs_image_create(image, parent, name, false, &entry, &ino);
+  if (res < 0)
+    die(name, res);
+
+  char *buf = malloc(chunk);
+  for (size_t i = 0; i < chunk; i++)
+    buf[i] = rand();
+
+  for (size_t off = 0; off < size; off += chunk)
+    {
+      size_t len = size - off < chunk ? size - off : chunk;
+      ssize_t written = wfs_file_write(image, ino, NULL, buf, len, off);
+      if (written < 0)
+        die(name, written);
+    }
+
+  free(buf);
+
+  return ino;
+}
+
+static wfs_ino_t
+create_dir(wfs_image_t *image, wfs_ino_t parent, const char *name)
+{
+  wfs_file_entry_t entry;
+  wfs_ino_t ino;
+
+  int res = wfs_image_create(image, parent, name, true, &entry, &ino);
+  if (res < 0)
+    die(name, res);
+
+  return ino;
+}
+
+/* Populates a freshly formatted image:
+ *
+ *  /big            a contiguous 4 Mb file,
+ *  /frag1, /frag2  two 1 Mb files written in alternating 4 Kb chunks,
+ *  /d0/.../d6/leaf a nested directory hierarchy,
+ *  /full/f0..f7    a full sub directory,
+ *  /s00../s47      small files filling up the root directory.
+ */
+static void
+generate_image(wfs_image_t *image)
+{
+  char name[WFS_FILENAME_SIZE];
+
+  create_file(image, WFS_ROOT_INO, "big", BENCH_BIG_SIZE, 64 * 1024);
+
+  wfs_ino_t frag1 = create_file(image, WFS_ROOT_INO, "frag1", 0, 1);
+  wfs_ino_t frag2 = create_file(image, WFS_ROOT_INO, "frag2", 0, 1);
+  char buf[BENCH_RAND_CHUNK];
+  memset(buf, 'x', sizeof(buf));
+  for (off_t off = 0; off < BENCH_FRAG_SIZE; off += sizeof(buf))
+    {
+      if (wfs_file_write(image, frag1, NULL, buf, sizeof(buf), off) < 0
+          || wfs_file_write(image, frag2, NULL, buf, sizeof(buf), off) < 0)
+        die("frag", -ENOSPC);
+    }
+
+  wfs_ino_t dir = WFS_ROOT_INO;
+  for (int i = 0; i < BENCH_DEPTH; i++)
+    {
+      snprintf(name, sizeof(name), "d%d", i);
+      dir = create_dir(image, dir, name);
+    }
+  create_file(image, dir, "leaf", 100, 100);
+
+  dir = create_dir(image, WFS_ROOT_INO, "full");
+  for (int i = 0; i < image->layout.n_dir_files; i++)
+    {
+      snprintf(name, sizeof(name), "f%d", i);
+      create_file(image, dir, name, 600, 600);
+    }
+
+  for (int i = 0; i < BENCH_N_SMALL; i++)
+    {
+      snprintf(name, sizeof(name), "s%02d", i);
+      create_file(image, WFS_ROOT_INO, name, 1000, 1000);
+    }
+
+  wfs_image_sync(image, true);
+}
+
+static void
+lookup_path(wfs_image_t *image, const char *path, wfs_file_entry_t *entry)
+{
+  if (!wfs_find_entry(image, path, entry))
+    die(path, -ENOENT);
+}
+
+static void
+bench_seq_read(wfs_image_t *image, const char *path, int iterations,
+               const char *name)
+{
+  wfs_file_entry_t entry;
+  wfs_file_handle_t fh;
+  bench_t bench;
+  char *buf = malloc(BENCH_SEQ_CHUNK);
+
+  lookup_path(image, path, &entry);
+  bench_init(&bench, name);
+
+  for (int it = 0; it < iterations; it++)
+    {
+      wfs_file_handle_init(&fh, &entry);
+
+      for (off_t off = 0; off < wfs_file_entry_get_size(&entry);
+           off += BENCH_SEQ_CHUNK)
+        {
+          double start = now();
+          ssize_t res = wfs_file_read(image, &entry, &fh, buf,
+                                      BENCH_SEQ_CHUNK, off);
+          bench_add(&bench, start);
+          if (res < 0)
+            die(name, res);
+        }
+
+      wfs_file_handle_fini(&fh);
+    }
+
+  bench_report(&bench);
+  free(buf);
+}
+
+static void
+bench_rand_read(wfs_image_t *image, int n_ops)
+{
+  wfs_file_entry_t entry;
+  wfs_file_handle_t fh;
+  bench_t bench;
+  char buf[BENCH_RAND_CHUNK];
+
+  lookup_path(image, "/big", &entry);
+  wfs_file_handle_init(&fh, &entry);
+  bench_init(&bench, "rand-read");
+
+  int n_chunks = wfs_file_entry_get_size(&entry) / BENCH_RAND_CHUNK;
+  for (int i = 0; i < n_ops; i++)
+    {
+      off_t off = (off_t)(rand() % n_chunks) * BENCH_RAND_CHUNK;
+
+      double start = now();
+      ssize_t res = wfs_file_read(image, &entry, &fh, buf, sizeof(buf), off);
+      bench_add(&bench, start);
+      if (res < 0)
+        die("rand-read", res);
+    }
+
+  wfs_file_handle_fini(&fh);
+  bench_report(&bench);
+}
+
+static void
+bench_getattr(wfs_image_t *image, int n_ops)
+{
+  char path[BENCH_DEPTH * 4 + 8];
+  wfs_file_entry_t entry;
+  bench_t bench;
+  int len = 0;
+
+  for (int i = 0; i < BENCH_DEPTH; i++)
+    len += snprintf(path + len, sizeof(path) - len, "/d%d", i);
+  snprintf(path + len, sizeof(path) - len, "/leaf");
+
+  bench_init(&bench, "deep-getattr");
+
+  for (int i = 0; i < n_ops; i++)
+    {
+      double start = now();
+      bool found = wfs_find_entry(image, path, &entry);
+      bench_add(&bench, start);
+      if (!found)
+        die(path, -ENOENT);
+    }
+
+  bench_report(&bench);
+}
+
+static void
+count_callback(wfs_file_entry_t *entry, int slot, void *data)
+{
+  (*(int *)data)++;
+}
+
+static void
+bench_readdir(wfs_image_t *image, const char *path, int n_ops,
+              const char *name)
+{
+  wfs_file_entry_t dir;
+  bench_t bench;
+
+  lookup_path(image, path, &dir);
+  bench_init(&bench, name);
+
+  for (int i = 0; i < n_ops; i++)
+    {
+      int count = 0;
+
+      double start = now();
+      int res = wfs_file_entry_operation(image, &dir,
+                                         WFS_FILE_ENTRY_OP_CALLBACK, NULL,
+                                         count_callback, &count);
+      bench_add(&bench, start);
+      if (res < 0)
+        die(name, res);
+    }
+
+  bench_report(&bench);
+}
+
+static void
+bench_write(wfs_image_t *image, int iterations)
+{
+  char buf[BENCH_RAND_CHUNK];
+  bench_t seq, rnd;
+
+  memset(buf, 'w', sizeof(buf));
+  bench_init(&seq, "seq-write");
+  bench_init(&rnd, "rand-write");
+
+  wfs_ino_t ino = create_file(image, WFS_ROOT_INO, "write", 0, 1);
+  wfs_file_entry_t entry;
+  wfs_image_get_entry(image, ino, &entry);
+
+  wfs_file_handle_t fh;
+  wfs_file_handle_init(&fh, &entry);
+
+  for (int it = 0; it < iterations; it++)
+    {
+      int res = wfs_file_truncate(image, ino, &fh, 0);
+      if (res < 0)
+        die("truncate", res);
+
+      for (off_t off = 0; off < BENCH_WRITE_SIZE; off += sizeof(buf))
+        {
+          double start = now();
+          ssize_t written = wfs_file_write(image, ino, &fh, buf, sizeof(buf),
+                                           off);
+          bench_add(&seq, start);
+          if (written < 0)
+            die("seq-write", written);
+        }
+
+      for (int i = 0; i < BENCH_WRITE_SIZE / (int)sizeof(buf); i++)
+        {
+          /* Unaligned, to include partial block updates. */
+          off_t off = rand() % (BENCH_WRITE_SIZE - sizeof(buf));
+
+          double start = now();
+          ssize_t written = wfs_file_write(image, ino, &fh, buf, sizeof(buf),
+                                           off);
+          bench_add(&rnd, start);
+          if (written < 0)
+            die("rand-write", written);
+        }
+
+      wfs_image_sync(image, false);
+    }
+
+  wfs_file_handle_fini(&fh);
+  bench_report(&seq);
+  bench_report(&rnd);
+}
+
+static void
+usage(const char *progname)
+{
+  fprintf(stderr,
+          "usage: %s [-m pread|mmap|uring] [-n iterations] [-b block_size] "
+          "[image]\n\n"
+          "Creates a synthetic WFS image (default: wfsbench.img), which is\n"
+          "overwritten, and runs the benchmarks on it.\n", progname);
+}
+
+int
+main(int argc, char *argv[])
+{
+  wfs_io_mode_t io_mode = WFS_IO_PREAD;
+  int iterations = 10;
+  int block_size = WFS_BLOCK_SIZE;
+  int opt;
+
+  while ((opt = getopt(argc, argv, "m:n:b:h")) != -1)
+    {
+      switch (opt)
+        {
+          case 'm':
+            if (!strcmp(optarg, "pread"))
+              io_mode = WFS_IO_PREAD;
+            else if (!strcmp(optarg, "mmap"))
+              io_mode = WFS_IO_MMAP;
+            else if (!strcmp(optarg, "uring"))
+              io_mode = WFS_IO_URING;
+            else
+              {
+                usage(argv[0]);
+                return 1;
+              }
+            break;
+
+          case 'n':
+            iterations = atoi(optarg);
+            if (iterations <= 0)
+              {
+                usage(argv[0]);
+                return 1;
+              }
+            break;
+
+          case 'b':
+            block_size = atoi(optarg);
+            break;
+
+          default:
+            usage(argv[0]);
+            return opt == 'h' ? 0 : 1;
+        }
+    }
+
+  const char *filename = optind < argc ? argv[optind] : "wfsbench.img";
+
+  if (wfs_image_format(filename, block_size, WFS_N_BLOCKS) < 0)
+    return 1;
+
+  wfs_image_t *image = wfs_image_open(filename, io_mode);
+  if (!image || wfs_bcache_start(image) < 0)
+    return 1;
+
+  srand(1);
+  generate_image(image);
+
+  bench_seq_read(image, "/big", iterations, "seq-read");
+  bench_seq_read(image, "/frag1", iterations, "seq-read-frag");
+  bench_rand_read(image, iterations * 1000);
+  bench_getattr(image, iterations * 1000);
+  bench_readdir(image, "/", iterations * 1000, "readdir-root");
+  bench_readdir(image, "/full", iterations * 1000, "readdir-full");
+  bench_write(image, iterations);
+
+  wfs_image_close(image);
+
+  return 0;
+}
@@ -0,0 +1,424 @@
+/* wfsck -- Check the consistency of a WFS image.
+ *
+ * Copyright (C) 2017  Leiden University, The Netherlands.
+ *
+ * The image is opened read-only and is not modified, so that it may be
+ * checked while it is mounted or after a crash. Its journal is not
+ * replayed; records that are pending are reported, as the image is
+ * checked as it was before them. The block table is scanned
+ * for entries that are out of range first. The directory tree is then
+ * walked once, following the chain of every entry and recording the
+ * file owning every block, which finds chains that run into free
+ * blocks, chains that are cross-linked with another one and chains that
+ * loop back onto themselves, all in a single pass over the blocks.
+ * Finally, blocks that are allocated but not owned by any file are
+ * counted; these remain after a crash and are harmless.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <limits.h>
+
+#include "wfsimage.h"
+
+
+/* Number of problems of the same kind that are reported individually. */
+#define WFSCK_MAX_REPORTS 20
+
+typedef struct
+{
+  wfs_image_t *image;
+
+  /* For every block, one more than the index of the path of the file
+   * owning it in "paths", or 0.
+   */
+  uint32_t *owners;
+  char **paths;
+  int n_paths;
+  int n_allocated;
+
+  int n_files;
+  int n_dirs;
+  int n_inline;
+  int n_errors;
+  int n_warnings;
+} wfsck_t;
+
+/* A directory still to be checked. */
+typedef struct
+{
+  uint16_t dir_block;
+  int path;
+} wfsck_dir_t;
+
+/* Records "path" and returns its index, or -1 if memory is exhausted. */
+static int
+wfsck_add_path(wfsck_t *ck, const char *path)
+{
+  if (ck->n_paths == ck->n_allocated)
+    {
+      int n_allocated = ck->n_allocated ? ck->n_allocated * 2 : 256;
+      char **paths = realloc(ck->paths, n_allocated * sizeof(char *));
+      if (!paths)
+        return -1;
+
+      ck->paths = paths;
+      ck->n_allocated = n_allocated;
+    }
+
+  ck->paths[ck->n_paths] = strdup(path);
+  if (!ck->paths[ck->n_paths])
+    return -1;
+
+  return ck->n_paths++;
+}
+
+/* Checks the block table entries that refer beyond the last block, 32
+ * entries at a time.
+ */
+static void
+wfsck_check_table(wfsck_t *ck)
+{
+  const uint16_t *table = ck->image->block_table;
+  const int n_blocks = ck->image->layout.n_blocks;
+  int n_invalid = 0;
+
+  for (int i = 0; i < n_blocks; i += 32)
+    {
+      uint32_t mask;
+
+      if (i + 32 <= n_blocks)
+        mask = wfs_block_table_invalid32(table + i, n_blocks);
+      else
+        {
+          mask = 0;
+          for (int j = i; j < n_blocks; j++)
+            if (table[j] > n_blocks && table[j] != WFS_BLOCK_EOF)
+              mask |= 1u << (j - i);
+        }
+
+      for (; mask; mask &= mask - 1)
+        {
+          int idx = i + __builtin_ctz(mask);
+
+          if (n_invalid++ < WFSCK_MAX_REPORTS)
+            fprintf(stderr, "error: block %d links to block %u, beyond the "
+                    "last block\n", idx + 1, table[idx]);
+        }
+    }
+
+  ck->n_errors += n_invalid;
+}
+
+/* Follows the chain of the entry of "path_idx" starting at "block" and
+ * claims its blocks. Returns the number of blocks in the chain, or -1 if
+ * it is broken.
+ */
+static int
+wfsck_check_chain(wfsck_t *ck, uint16_t block, int path_idx)
+{
+  wfs_image_t *image = ck->image;
+  const char *path = ck->paths[path_idx];
+  int n = 0;
+
+  while (block != WFS_BLOCK_EOF)
+    {
+      if (block == WFS_BLOCK_FREE || block > image->layout.n_blocks)
+        {
+          fprintf(stderr, "error: '%s' refers to invalid block %u\n",
+                  path, block);
+          ck->n_errors++;
+          return -1;
+        }
+
+      uint32_t owner = ck->owners[block - 1];
+      if (owner == path_idx + 1)
+        {
+          fprintf(stderr, "error: chain of '%s' loops back to block %u\n",
+                  path, block);
+          ck->n_errors++;
+          return -1;
+        }
+      if (owner)
+        {
+          fprintf(stderr, "error: '%s' is cross-linked with '%s' at block "
+                  "%u\n", path, ck->paths[owner - 1], block);
+          ck->n_errors++;
+          return -1;
+        }
+
+      uint16_t next = image->block_table[block - 1];
+      if (next == WFS_BLOCK_FREE)
+        {
+          fprintf(stderr, "error: '%s' refers to free block %u\n",
+                  path, block);
+          ck->n_errors++;
+          return -1;
+        }
+
+      ck->owners[block - 1] = path_idx + 1;
+      n++;
+      block = next;
+    }
+
+  return n;
+}
+
+/* Checks the inline entry of "path". */
+static void
+wfsck_check_inline(wfsck_t *ck, const wfs_file_entry_t *entry,
+                   const char *path)
+{
+  const uint32_t size = wfs_file_entry_get_size(entry);
+  const uint32_t capacity = wfs_file_entry_get_inline_capacity(entry);
+
+  ck->n_inline++;
+
+  if (!(ck->image->features & WFS_FEATURE_INLINE))
+    {
+      fprintf(stderr, "error: '%s' is stored inline, which the image does "
+              "not support\n", path);
+      ck->n_errors++;
+    }
+  else if (entry->start_block != WFS_BLOCK_EOF || size > capacity)
+    {
+      fprintf(stderr, "error: inline file '%s' has an invalid entry\n",
+              path);
+      ck->n_errors++;
+    }
+  else
+    {
+      const char *data = wfs_file_entry_get_inline_data(entry);
+      for (uint32_t i = size; i < capacity; i++)
+        {
+          if (data[i])
+            {
+              fprintf(stderr, "warning: inline file '%s' has data beyond "
+                      "its end\n", path);
+              ck->n_warnings++;
+              break;
+            }
+        }
+    }
+}
+
+/* Checks the entries of the directory "dir" and appends its
+ * subdirectories to "dirs". Returns -1 if memory is exhausted.
+ */
+static int
+wfsck_check_dir(wfsck_t *ck, const wfsck_dir_t *dir, wfsck_dir_t **dirs,
+                int *n_dirs)
+{
+  wfs_image_t *image = ck->image;
+  const uint32_t block_size = image->layout.block_size;
+  const int n_entries = wfs_dir_get_n_entries(&image->layout,
+                                              dir->dir_block);
+  const size_t size = n_entries * sizeof(wfs_file_entry_t);
+
+  wfs_file_entry_t *entries = malloc(size);
+  if (!entries)
+    return -1;
+
+  if (wfs_image_pread(image, entries, size,
+                      wfs_dir_get_entry_offset(&image->layout,
+                                               dir->dir_block, 0)) != size)
+    {
+      fprintf(stderr, "error: could not read directory '%s'\n",
+              ck->paths[dir->path]);
+      ck->n_errors++;
+      free(entries);
+      return 0;
+    }
+
+  for (int i = 0; i < n_entries; i++)
+    {
+      const wfs_file_entry_t *entry = &entries[i];
+      char path[PATH_MAX];
+
+      if (wfs_file_entry_is_empty(entry))
+        continue;
+
+      int len = strnlen(entry->filename, WFS_FILENAME_SIZE);
+      snprintf(path, sizeof(path), "%s/%.*s",
+               dir->dir_block ? ck->paths[dir->path] : "", len,
+               entry->filename);
+
+      if (len == WFS_FILENAME_SIZE)
+        {
+          fprintf(stderr, "error: name of '%s' is not terminated\n", path);
+          ck->n_errors++;
+          continue;
+        }
+
+      if (wfs_file_entry_is_inline(entry))
+        {
+          ck->n_files++;
+          if (wfs_file_entry_is_directory(entry))
+            {
+              fprintf(stderr, "error: directory '%s' is marked inline\n",
+                      path);
+              ck->n_errors++;
+            }
+          else
+            wfsck_check_inline(ck, entry, path);
+          continue;
+        }
+
+      int path_idx = wfsck_add_path(ck, path);
+      if (path_idx < 0)
+        {
+          free(entries);
+          return -1;
+        }
+
+      int n = wfsck_check_chain(ck, entry->start_block, path_idx);
+
+      if (wfs_file_entry_is_directory(entry))
+        {
+          ck->n_dirs++;
+          if (n == 1)
+            {
+              wfsck_dir_t *new_dirs = realloc(*dirs, (*n_dirs + 1)
+                                              * sizeof(wfsck_dir_t));
+              if (!new_dirs)
+                {
+                  free(entries);
+                  return -1;
+                }
+
+              *dirs = new_dirs;
+              (*dirs)[(*n_dirs)++] = (wfsck_dir_t){ entry->start_block,
+                                                    path_idx };
+            }
+          else if (n > 1)
+            {
+              fprintf(stderr, "error: directory '%s' has %d blocks\n",
+                      path, n);
+              ck->n_errors++;
+            }
+          continue;
+        }
+
+      ck->n_files++;
+      if (n < 0)
+        continue;
+
+      /* A file always occupies at least one block. A crash while a file
+       * is truncated may leave blocks beyond its end.
+       */
+      int needed = (wfs_file_entry_get_size(entry) + block_size - 1)
+          / block_size;
+      if (needed == 0)
+        needed = 1;
+
+      if (n < needed)
+        {
+          fprintf(stderr, "error: '%s' has %d blocks, but its size requires "
+                  "%d\n", path, n, needed);
+          ck->n_errors++;
+        }
+      else if (n > needed)
+        {
+          fprintf(stderr, "warning: '%s' has %d blocks beyond its end\n",
+                  path, n - needed);
+          ck->n_warnings++;
+        }
+    }
+
+  free(entries);
+
+  return 0;
+}
+
+int
+main(int argc, char *argv[])
+{
+  if (argc < 2)
+    {
+      fprintf(stderr, "usage: %s <image> [stripe]...\n\n"
+              "Checks the consistency of WFS image <image>, of which the "
+              "data blocks may be\nstriped over the files [stripe]. The "
+              "image is not modified.\nExits with status 1 if errors were "
+              "found.\n", argv[0]);
+      return 2;
+    }
+
+  wfsck_t ck = { NULL, };
+
+  ck.image = wfs_image_open_striped(argv[1], WFS_IO_PREAD,
+                                    WFS_OPEN_READ_ONLY, argv + 2, argc - 2);
+  if (!ck.image)
+    return 2;
+
+  int n_pending = wfs_journal_get_n_pending(ck.image);
+  if (n_pending < 0)
+    {
+      fprintf(stderr, "warning: could not read journal of '%s'\n", argv[1]);
+      ck.n_warnings++;
+    }
+  else if (n_pending > 0)
+    {
+      fprintf(stderr, "warning: image is in use or was not closed "
+              "cleanly, %d journal records\nare pending and not checked\n",
+              n_pending);
+      ck.n_warnings++;
+    }
+
+  const int n_blocks = ck.image->layout.n_blocks;
+  ck.owners = calloc(n_blocks, sizeof(uint32_t));
+  wfsck_dir_t *dirs = malloc(sizeof(wfsck_dir_t));
+  int n_dirs = 1, res = 0;
+
+  if (!ck.owners || !dirs || wfsck_add_path(&ck, "/") < 0)
+    res = -1;
+  else
+    {
+      dirs[0] = (wfsck_dir_t){ 0, 0 };
+      wfsck_check_table(&ck);
+    }
+
+  /* Directories are checked breadth first; a directory block owned by
+   * two entries is only followed from the first.
+   */
+  for (int i = 0; i < n_dirs && res == 0; i++)
+    {
+      wfsck_dir_t dir = dirs[i];
+      res = wfsck_check_dir(&ck, &dir, &dirs, &n_dirs);
+    }
+
+  if (res < 0)
+    {
+      fprintf(stderr, "error: out of memory\n");
+      wfs_image_close(ck.image);
+      return 2;
+    }
+
+  int n_used = n_blocks - wfs_block_table_count(ck.image->block_table,
+                                                n_blocks, WFS_BLOCK_FREE);
+  int n_leaked = 0;
+  for (int i = 0; i < n_blocks; i++)
+    if (ck.image->block_table[i] != WFS_BLOCK_FREE && !ck.owners[i])
+      n_leaked++;
+
+  if (n_leaked > 0)
+    {
+      fprintf(stderr, "warning: %d blocks are allocated, but not used by "
+              "any file\n", n_leaked);
+      ck.n_warnings++;
+    }
+
+  printf("%s: %d files (%d inline), %d directories, %d of %d blocks used, "
+         "%d errors, %d warnings\n", argv[1], ck.n_files, ck.n_inline,
+         ck.n_dirs, n_used, n_blocks, ck.n_errors, ck.n_warnings);
+
+  wfs_image_close(ck.image);
+
+  for (int i = 0; i < ck.n_paths; i++)
+    free(ck.paths[i]);
+  free(ck.paths);
+  free(ck.owners);
+  free(dirs);
+
+  return ck.n_errors > 0 ? 1 : 0;
+}
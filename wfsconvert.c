@@ -0,0 +1,159 @@
+/* wfsconvert -- Convert WFS images between the chain and extent formats.
+ *
+ * Copyright (C) 2017  Leiden University, The Netherlands.
+ *
+ * Only the magic and the block table differ between the formats, so the
+ * image is converted in place.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+
+#include "wfs.h"
+
+
+int
+main(int argc, char *argv[])
+{
+  if (argc != 3 || (strcmp(argv[2], "extents") && strcmp(argv[2], "chains")))
+    {
+      fprintf(stderr, "usage: %s <image> extents|chains\n\n"
+              "Converts WFS image <image> to the given format.\n", argv[0]);
+      return 1;
+    }
+
+  const char *filename = argv[1];
+  bool extents = !strcmp(argv[2], "extents");
+
+  int fd = open(filename, O_RDWR);
+  if (fd < 0)
+    {
+      fprintf(stderr, "error: could not open file '%s': %s\n",
+              filename, strerror(errno));
+      return 1;
+    }
+
+  uint32_t magic[WFS_MAGIC_SIZE / sizeof(uint32_t)];
+  wfs_superblock_t superblock =
+    {
+      .block_size = WFS_BLOCK_SIZE,
+      .n_blocks = WFS_N_BLOCKS
+    };
+
+  if (pread(fd, magic, sizeof(magic), 0) != sizeof(magic))
+    {
+      fprintf(stderr, "error: could not read '%s'\n", filename);
+      close(fd);
+      return 1;
+    }
+
+  if (magic[0] != WFS_MAGIC0
+      || (magic[1] & ~WFS_FEATURES) != WFS_MAGIC1
+      || magic[2] != WFS_MAGIC2 || magic[3] != WFS_MAGIC3)
+    {
+      fprintf(stderr, "error: image '%s' has incorrect magic number\n",
+              filename);
+      close(fd);
+      return 1;
+    }
+
+  wfs_layout_t layout;
+
+  if (((magic[1] & WFS_FEATURE_SUPERBLOCK)
+       && pread(fd, &superblock, sizeof(superblock), WFS_MAGIC_SIZE)
+          != sizeof(superblock))
+      || !wfs_layout_init(&layout, magic[1], superblock.block_size,
+                          superblock.n_blocks))
+    {
+      fprintf(stderr, "error: image '%s' has an invalid superblock\n",
+              filename);
+      close(fd);
+      return 1;
+    }
+
+  const int n_blocks = layout.n_blocks;
+  uint16_t *table = malloc(layout.block_table_size);
+  uint16_t *converted = malloc(layout.block_table_size);
+
+  if (!table || !converted)
+    {
+      fprintf(stderr, "error: out of memory\n");
+      close(fd);
+      return 1;
+    }
+
+  if (pread(fd, table, layout.block_table_size, layout.block_table_start)
+      != layout.block_table_size)
+    {
+      fprintf(stderr, "error: could not read '%s'\n", filename);
+      close(fd);
+      return 1;
+    }
+
+  if (((magic[1] & WFS_FEATURE_EXTENTS) != 0) == extents)
+    {
+      printf("%s: already in the %s format\n", filename, argv[2]);
+      close(fd);
+      return 0;
+    }
+
+  int n_extents = 0;
+
+  if (extents)
+    {
+      /* Make sure that corrupt chains cannot be mistaken for extents. */
+      for (int i = 0; i < n_blocks; i++)
+        {
+          if (wfs_block_is_extent(table[i]))
+            table[i] = WFS_BLOCK_EOF;
+        }
+
+      wfs_block_table_encode(table, n_blocks, 0, n_blocks, converted);
+      magic[1] |= WFS_FEATURE_EXTENTS;
+    }
+  else
+    {
+      memcpy(converted, table, layout.block_table_size);
+      wfs_block_table_decode(converted, n_blocks);
+      magic[1] &= ~WFS_FEATURE_EXTENTS;
+    }
+
+  for (int i = 0; i < n_blocks; i++)
+    {
+      uint16_t value = extents ? converted[i] : table[i];
+      if (wfs_block_is_extent(value))
+        n_extents++;
+    }
+
+  /* The table is written first: until the magic has been updated as
+   * well, the image is inconsistent.
+   */
+  if (pwrite(fd, converted, layout.block_table_size, layout.block_table_start)
+      != layout.block_table_size
+      || fsync(fd) < 0
+      || pwrite(fd, magic, sizeof(magic), 0) != sizeof(magic)
+      || fsync(fd) < 0)
+    {
+      fprintf(stderr, "error: could not write '%s': %s\n",
+              filename, strerror(errno));
+      close(fd);
+      return 1;
+    }
+
+  if (close(fd) < 0)
+    {
+      fprintf(stderr, "error: could not write '%s': %s\n",
+              filename, strerror(errno));
+      return 1;
+    }
+
+  printf("%s: converted to the %s format, %d extents of two or more "
+         "blocks\n", filename, argv[2], n_extents);
+
+  return 0;
+}
@@ -0,0 +1,383 @@
+/* wfsdefrag -- Background defragmentation of WFS images.
+ *
+ * Copyright (C) 2017  Leiden University, The Netherlands.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <errno.h>
+
+#include "wfsimage.h"
+
+
+/* The defragmenter is a single thread that repeatedly walks the
+ * directory tree, breadth first. For every regular file it determines
+ * the number of runs of physically adjacent blocks its chain consists
+ * of, and moves the blocks of a file with more than one run to a single
+ * run of free blocks; see wfs_file_relocate(). Afterwards, it has the
+ * chain of the file followed by coalesced reads and readahead with a
+ * single request.
+ *
+ * To leave the image to foreground requests, at most
+ * WFS_DEFRAG_BLOCKS_PER_SEC blocks are moved per second, files of more
+ * than WFS_DEFRAG_MAX_BLOCKS blocks are not moved, as the directory is
+ * locked while the data is copied, and a new walk starts
+ * WFS_DEFRAG_INTERVAL seconds after the previous one ended. The blocks
+ * a file was moved from are freed once the wait following the move is
+ * over, so that reads that started before have completed.
+ *
+ * The fragmentation score of a file is the percentage of the steps from
+ * one block to the next in its chain that are not to the adjacent
+ * block: 0 for a contiguous file, 100 if no two blocks are adjacent.
+ * The scores of the files found in the last completed walk, as they
+ * were left by it, are shown with the statistics.
+ */
+
+#define WFS_DEFRAG_BLOCKS_PER_SEC 2048
+#define WFS_DEFRAG_MAX_BLOCKS 1024
+#define WFS_DEFRAG_INTERVAL 60 /* Seconds between walks */
+#define WFS_DEFRAG_DELAY 10000 /* Microseconds to wait after a move */
+
+/* An entry found in the walk. */
+typedef struct
+{
+  wfs_ino_t ino;
+  wfs_file_entry_t entry;
+} wfs_defrag_file_t;
+
+typedef struct
+{
+  wfs_ino_t ino;
+  int score;
+} wfs_defrag_score_t;
+
+/* A growing array, of which the element size is passed on use. */
+typedef struct
+{
+  void *data;
+  int n;
+  int n_allocated;
+} wfs_defrag_array_t;
+
+struct wfs_defrag
+{
+  wfs_image_t *image;
+
+  pthread_mutex_t lock;
+  pthread_cond_t cond;
+  bool stop;
+
+  /* Scores of the last completed walk, protected by "lock". */
+  wfs_defrag_score_t *scores;
+  int n_scores;
+
+  pthread_t thread;
+};
+
+/* Appends an element to "array". Returns false if memory is exhausted. */
+static bool
+wfs_defrag_array_push(wfs_defrag_array_t *array, const void *element,
+                      size_t element_size)
+{
+  if (array->n == array->n_allocated)
+    {
+      int n_allocated = array->n_allocated ? array->n_allocated * 2 : 64;
+      void *data = realloc(array->data, n_allocated * element_size);
+      if (!data)
+        return false;
+
+      array->data = data;
+      array->n_allocated = n_allocated;
+    }
+
+  memcpy((char *)array->data + array->n * element_size, element,
+         element_size);
+  array->n++;
+
+  return true;
+}
+
+/* Waits for "usec" microseconds, or until the defragmenter is stopped.
+ * Returns false in the latter case. The caller must hold the lock.
+ */
+static bool
+wfs_defrag_wait(struct wfs_defrag *defrag, uint64_t usec)
+{
+  struct timespec deadline;
+  clock_gettime(CLOCK_REALTIME, &deadline);
+
+  uint64_t nsec = deadline.tv_nsec + (usec % 1000000) * 1000;
+  deadline.tv_sec += usec / 1000000 + nsec / 1000000000;
+  deadline.tv_nsec = nsec % 1000000000;
+
+  while (!defrag->stop)
+    {
+      if (pthread_cond_timedwait(&defrag->cond, &defrag->lock, &deadline)
+          == ETIMEDOUT)
+        break;
+    }
+
+  return !defrag->stop;
+}
+
+/* Returns the fragmentation score of the chain of "entry". Single block
+ * files, inline files and corrupt chains score -1.
+ */
+static int
+wfs_defrag_get_score(wfs_image_t *image, const wfs_file_entry_t *entry)
+{
+  if (wfs_file_entry_is_inline(entry))
+    return -1;
+
+  int n = 0, n_breaks = 0;
+
+  pthread_rwlock_rdlock(&image->table_lock);
+
+  uint16_t block = entry->start_block, prev = WFS_BLOCK_FREE;
+  while (block != WFS_BLOCK_FREE && block < WFS_BLOCK_EOF
+         && n < image->layout.n_blocks)
+    {
+      if (n > 0 && block != prev + 1)
+        n_breaks++;
+      n++;
+
+      prev = block;
+      block = wfs_get_next_block(image, block);
+    }
+
+  pthread_rwlock_unlock(&image->table_lock);
+
+  if (n < 2 || block != WFS_BLOCK_EOF)
+    return -1;
+
+  return n_breaks * 100 / (n - 1);
+}
+
+struct wfs_defrag_scan
+{
+  uint16_t dir_block;
+  wfs_defrag_array_t entries;
+};
+
+static void
+wfs_defrag_callback(wfs_file_entry_t *entry, int slot, void *data)
+{
+  struct wfs_defrag_scan *scan = data;
+  wfs_defrag_file_t file = { wfs_ino_make(scan->dir_block, slot), *entry };
+
+  wfs_defrag_array_push(&scan->entries, &file, sizeof(file));
+}
+
+/* Moves the blocks of "file" if it is fragmented and returns its score
+ * afterwards, or -1 if it has none. Returns -2 if the defragmenter was
+ * stopped while waiting.
+ */
+static int
+wfs_defrag_file(struct wfs_defrag *defrag, const wfs_defrag_file_t *file)
+{
+  wfs_image_t *image = defrag->image;
+
+  int score = wfs_defrag_get_score(image, &file->entry);
+  if (score <= 0)
+    return score;
+
+  uint16_t old_chain;
+  int res = wfs_file_relocate(image, file->ino, &file->entry,
+                              WFS_DEFRAG_MAX_BLOCKS, &old_chain);
+  if (res <= 0)
+    {
+      if (res < 0 && res != -ENOENT && res != -ENOSPC)
+        fprintf(stderr, "warning: could not defragment a file of '%s': "
+                "%s\n", image->filename, strerror(-res));
+      return res == -ENOENT ? -1 : score;
+    }
+
+  WFS_STATS_ADD(image, n_defrag_files, 1);
+  WFS_STATS_ADD(image, n_defrag_blocks, res);
+
+  pthread_mutex_lock(&defrag->lock);
+  bool running = wfs_defrag_wait(defrag, WFS_DEFRAG_DELAY + (uint64_t)res
+                                 * 1000000 / WFS_DEFRAG_BLOCKS_PER_SEC);
+  pthread_mutex_unlock(&defrag->lock);
+
+  pthread_rwlock_wrlock(&image->table_lock);
+  wfs_block_free_chain(image, old_chain);
+  pthread_rwlock_unlock(&image->table_lock);
+
+  return running ? 0 : -2;
+}
+
+/* Walks the directory tree once, defragmenting the files found. Returns
+ * false if the defragmenter was stopped.
+ */
+static bool
+wfs_defrag_walk(struct wfs_defrag *defrag)
+{
+  wfs_image_t *image = defrag->image;
+  wfs_defrag_array_t dirs = { NULL, 0, 0 };
+  wfs_defrag_array_t scores = { NULL, 0, 0 };
+  wfs_defrag_file_t root = { WFS_ROOT_INO, { { 0, }, } };
+  bool running = true;
+
+  wfs_defrag_array_push(&dirs, &root, sizeof(root));
+
+  for (int i = 0; i < dirs.n && running; i++)
+    {
+      wfs_defrag_file_t dir = ((wfs_defrag_file_t *)dirs.data)[i];
+      struct wfs_defrag_scan scan =
+        {
+          wfs_file_entry_get_dir_block(&dir.entry), { NULL, 0, 0 }
+        };
+
+      /* Directories removed since they were found are skipped. */
+      if (wfs_dir_preload(image, dir.ino, &dir.entry, wfs_defrag_callback,
+                          &scan) < 0)
+        {
+          free(scan.entries.data);
+          continue;
+        }
+
+      for (int j = 0; j < scan.entries.n && running; j++)
+        {
+          const wfs_defrag_file_t *file =
+              &((wfs_defrag_file_t *)scan.entries.data)[j];
+
+          if (wfs_file_entry_is_directory(&file->entry))
+            {
+              wfs_defrag_array_push(&dirs, file, sizeof(*file));
+              continue;
+            }
+
+          int score = wfs_defrag_file(defrag, file);
+          if (score == -2)
+            running = false;
+          else if (score >= 0)
+            {
+              wfs_defrag_score_t record = { file->ino, score };
+              wfs_defrag_array_push(&scores, &record, sizeof(record));
+            }
+        }
+
+      free(scan.entries.data);
+    }
+
+  free(dirs.data);
+
+  if (!running)
+    {
+      free(scores.data);
+      return false;
+    }
+
+  pthread_mutex_lock(&defrag->lock);
+  free(defrag->scores);
+  defrag->scores = scores.data;
+  defrag->n_scores = scores.n;
+  pthread_mutex_unlock(&defrag->lock);
+
+  WFS_STATS_ADD(image, n_defrag_walks, 1);
+
+  return true;
+}
+
+static void *
+wfs_defrag_thread(void *data)
+{
+  struct wfs_defrag *defrag = data;
+  bool running = true;
+
+  while (running && wfs_defrag_walk(defrag))
+    {
+      pthread_mutex_lock(&defrag->lock);
+      running = wfs_defrag_wait(defrag, WFS_DEFRAG_INTERVAL * 1000000ULL);
+      pthread_mutex_unlock(&defrag->lock);
+    }
+
+  return NULL;
+}
+
+/* Starts defragmenting "image" in the background. Must be called after
+ * forking, as the defragmenter runs in a separate thread. Returns 0 on
+ * success, -1 on failure.
+ */
+int
+wfs_defrag_start(wfs_image_t *image)
+{
+  if (image->read_only)
+    {
+      fprintf(stderr, "error: cannot defragment read-only image '%s'\n",
+              image->filename);
+      return -1;
+    }
+
+  struct wfs_defrag *defrag = calloc(1, sizeof(struct wfs_defrag));
+  if (!defrag)
+    {
+      fprintf(stderr, "error: could not allocate defragmenter state\n");
+      return -1;
+    }
+
+  defrag->image = image;
+  pthread_mutex_init(&defrag->lock, NULL);
+  pthread_cond_init(&defrag->cond, NULL);
+
+  if (pthread_create(&defrag->thread, NULL, wfs_defrag_thread, defrag) != 0)
+    {
+      fprintf(stderr, "error: could not start defragmenter thread\n");
+      pthread_mutex_destroy(&defrag->lock);
+      pthread_cond_destroy(&defrag->cond);
+      free(defrag);
+      return -1;
+    }
+
+  image->defrag = defrag;
+
+  return 0;
+}
+
+/* Stops the defragmenter, if it is running, and releases its state. A
+ * file being moved is completed first.
+ */
+void
+wfs_defrag_stop(wfs_image_t *image)
+{
+  struct wfs_defrag *defrag = image->defrag;
+  if (!defrag)
+    return;
+
+  pthread_mutex_lock(&defrag->lock);
+  defrag->stop = true;
+  pthread_cond_broadcast(&defrag->cond);
+  pthread_mutex_unlock(&defrag->lock);
+
+  pthread_join(defrag->thread, NULL);
+
+  pthread_mutex_destroy(&defrag->lock);
+  pthread_cond_destroy(&defrag->cond);
+  free(defrag->scores);
+  free(defrag);
+  image->defrag = NULL;
+}
+
+/* Writes the fragmentation scores of the last walk to "stream", in the
+ * format of wfs_stats_print(), named after the inode numbers of the
+ * files. Nothing is written if the defragmenter is not running.
+ */
+void
+wfs_defrag_print(wfs_image_t *image, FILE *stream)
+{
+  struct wfs_defrag *defrag = image->defrag;
+  if (!defrag)
+    return;
+
+  pthread_mutex_lock(&defrag->lock);
+
+  for (int i = 0; i < defrag->n_scores; i++)
+    fprintf(stream, "defrag.score.%llu %d\n",
+            (unsigned long long)defrag->scores[i].ino,
+            defrag->scores[i].score);
+
+  pthread_mutex_unlock(&defrag->lock);
+}
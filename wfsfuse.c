@@ -10,668 +10,1300 @@
  * COPYING and AUTHORS.
  */
 
-#define FUSE_USE_VERSION 26
+#define FUSE_USE_VERSION 31
 
-#include <fuse.h>
+#include <fuse_lowlevel.h>
 #include <stdio.h>
 #include <string.h>
 #include <stdlib.h>
 #include <errno.h>
 #include <unistd.h>
+#include <stddef.h>
 #include <fcntl.h>
-#include <limits.h>
+#include <signal.h>
 
 #include <stdbool.h>
 
-#include "wfs.h"
+#include "wfsimage.h"
 
 
-/*
- * WFS image management
+/* The image is only modified through this file system, and the kernel
+ * drops cached attributes and entries of its own modifications, so they
+ * can be cached for long.
+ */
+#define WFS_ATTR_TIMEOUT 60.0
+#define WFS_ENTRY_TIMEOUT 60.0
+
+/* The statistics of the image can be read from a pseudo file in the
+ * root directory, which hides a real file of the same name. Its inode
+ * number refers to a directory block that no image has.
  */
+#define WFS_STATS_NAME ".wfs_stats"
+#define WFS_STATS_INO (((fuse_ino_t)0xffff << 32) | 1)
 
-typedef struct
+/* Contents of the statistics pseudo file, captured when it is opened. */
+struct wfs_stats_file
 {
-  int fd;
-  const char *filename;
-} wfs_image_t;
+  char *data;
+  size_t size;
+};
 
+static inline bool
+wfs_is_stats_file(fuse_ino_t parent, const char *name)
+{
+  return parent == FUSE_ROOT_ID && !strcmp(name, WFS_STATS_NAME);
+}
+
+static inline wfs_image_t *
+get_wfs_image(fuse_req_t req)
+{
+  return (wfs_image_t *)fuse_req_userdata(req);
+}
+
+static inline wfs_file_handle_t *
+get_wfs_file_handle(struct fuse_file_info *fi)
+{
+  return fi ? (wfs_file_handle_t *)(uintptr_t)fi->fh : NULL;
+}
 
 static void
-wfs_image_close(wfs_image_t *img)
+wfs_fill_stat(fuse_ino_t ino, const wfs_file_entry_t *entry,
+              struct stat *stbuf)
 {
-  if (!img)
-    return;
+  memset(stbuf, 0, sizeof(struct stat));
+  stbuf->st_ino = ino;
 
-  if (img->fd >= 0)
-    close(img->fd);
+  if (ino == FUSE_ROOT_ID)
+    {
+      stbuf->st_mode = S_IFDIR | 0755;
+      stbuf->st_nlink = 2;
+      return;
+    }
 
-  free(img);
+  if (wfs_file_entry_is_directory(entry))
+    {
+      stbuf->st_mode = S_IFDIR | 0755;
+      stbuf->st_nlink = 2;
+    }
+  else
+    {
+      stbuf->st_mode = S_IFREG | 0644;
+      stbuf->st_nlink = 1;
+    }
+  stbuf->st_size = wfs_file_entry_get_size(entry);
 }
 
-/* Verifies whether an opened image is really an WFS file system image */
-static int
-wfs_check_image(wfs_image_t *img)
+static void
+wfs_fill_entry_param(fuse_ino_t ino, const wfs_file_entry_t *entry,
+                     struct fuse_entry_param *e)
+{
+  memset(e, 0, sizeof(struct fuse_entry_param));
+  e->ino = ino;
+  e->attr_timeout = WFS_ATTR_TIMEOUT;
+  e->entry_timeout = WFS_ENTRY_TIMEOUT;
+  wfs_fill_stat(ino, entry, &e->attr);
+}
+
+static void
+wfs_fill_stats_stat(struct stat *stbuf)
+{
+  memset(stbuf, 0, sizeof(struct stat));
+  stbuf->st_ino = WFS_STATS_INO;
+  stbuf->st_mode = S_IFREG | 0444;
+  stbuf->st_nlink = 1;
+}
+
+/* Replies with a new entry. The lookup count is only incremented if the
+ * reply reached the kernel.
+ */
+static void
+wfs_reply_entry(fuse_req_t req, wfs_ino_t ino, const wfs_file_entry_t *entry)
+{
+  wfs_image_t *image = get_wfs_image(req);
+  struct fuse_entry_param e;
+
+  wfs_fill_entry_param(ino, entry, &e);
+
+  wfs_inode_ref(image, ino);
+  if (fuse_reply_entry(req, &e) != 0)
+    wfs_inode_forget(image, ino, 1);
+}
+
+/*
+ * Kernel cache invalidation
+ */
+
+/* File contents and attributes are cached by the kernel, see WFS_*_TIMEOUT
+ * and wfs_do_open(). Where an operation changes more than the kernel
+ * accounts for by itself, the cached state is invalidated. Notifications
+ * must not be sent while handling the operation that causes them, as the
+ * kernel may hold locks that the invalidation needs, so they are queued
+ * and sent from a separate thread.
+ */
+struct wfs_notify
 {
-  struct stat buf;
-  uint32_t magic[WFS_MAGIC_SIZE / sizeof(uint32_t)];
+  struct wfs_notify *next;
+  fuse_ino_t ino;
+  char *name;   /* Entry of directory "ino" to drop, or NULL */
+};
 
-  if (fstat(img->fd, &buf) < 0)
+static struct
+{
+  struct fuse_session *se;
+  pthread_mutex_t lock;
+  pthread_cond_t cond;
+  struct wfs_notify *head;
+  struct wfs_notify *tail;
+  bool stop;
+  pthread_t thread;
+} wfs_notifier =
+  {
+    NULL, PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER,
+    NULL, NULL, false,
+  };
+
+/* Queues the invalidation of the attributes of "ino" and, if "name" is
+ * not NULL, of its directory entry "name". Does nothing unless the
+ * notifier runs.
+ */
+static void
+wfs_notify(fuse_ino_t ino, const char *name)
+{
+  pthread_mutex_lock(&wfs_notifier.lock);
+
+  /* Repeated writes to a file need only be reported once. */
+  struct wfs_notify *tail = wfs_notifier.tail;
+  if (!wfs_notifier.se
+      || (!name && tail && !tail->name && tail->ino == ino))
     {
-      fprintf(stderr, "error: file '%s': %s\n",
-              img->filename, strerror(errno));
-      return -1;
+      pthread_mutex_unlock(&wfs_notifier.lock);
+      return;
     }
 
-  /* We can't check the size of devices, otherwise check the
-   * size of the image file.
-   */
-  if (!S_ISBLK(buf.st_mode))
+  struct wfs_notify *notify = malloc(sizeof(struct wfs_notify));
+  if (notify)
     {
-      if (buf.st_size < wfs_get_size())
+      notify->next = NULL;
+      notify->ino = ino;
+      notify->name = name ? strdup(name) : NULL;
+      if (name && !notify->name)
         {
-          fprintf(stderr,
-                  "error: file '%s' too small to contain WFS file system\n",
-                  img->filename);
-          return -1;
+          free(notify);
+          notify = NULL;
         }
     }
 
-  pread(img->fd, &magic, sizeof(magic), 0);
-
-  if (magic[0] != WFS_MAGIC0 || magic[1] != WFS_MAGIC1
-      || magic[2] != WFS_MAGIC2 || magic[3] != WFS_MAGIC3)
+  if (notify)
     {
-      fprintf(stderr, "error: image '%s' has incorrect magic number\n",
-              img->filename);
-      return -1;
+      if (tail)
+        tail->next = notify;
+      else
+        wfs_notifier.head = notify;
+      wfs_notifier.tail = notify;
+      pthread_cond_signal(&wfs_notifier.cond);
     }
 
-  return 0;
+  pthread_mutex_unlock(&wfs_notifier.lock);
 }
 
-static wfs_image_t *
-wfs_image_open(const char *filename)
+static void *
+wfs_notifier_thread(void *data)
 {
-  wfs_image_t *img = malloc(sizeof(wfs_image_t));
+  pthread_mutex_lock(&wfs_notifier.lock);
 
-  img->filename = filename;
-  img->fd = open(img->filename, O_RDWR);
-  if (img->fd < 0)
+  while (!wfs_notifier.stop)
     {
-      fprintf(stderr, "error: could not open file '%s': %s\n",
-              img->filename, strerror(errno));
-      wfs_image_close(img);
-      return NULL;
+      struct wfs_notify *notify = wfs_notifier.head;
+      if (!notify)
+        {
+          pthread_cond_wait(&wfs_notifier.cond, &wfs_notifier.lock);
+          continue;
+        }
+
+      wfs_notifier.head = notify->next;
+      if (!wfs_notifier.head)
+        wfs_notifier.tail = NULL;
+      pthread_mutex_unlock(&wfs_notifier.lock);
+
+      /* Failures mean that the kernel has nothing cached. */
+      if (notify->name)
+        fuse_lowlevel_notify_inval_entry(wfs_notifier.se, notify->ino,
+                                         notify->name, strlen(notify->name));
+      fuse_lowlevel_notify_inval_inode(wfs_notifier.se, notify->ino, -1, 0);
+      free(notify->name);
+      free(notify);
+
+      pthread_mutex_lock(&wfs_notifier.lock);
     }
 
-  if (wfs_check_image(img) < 0)
+  pthread_mutex_unlock(&wfs_notifier.lock);
+
+  return NULL;
+}
+
+/* Starts sending invalidations to the kernel through "se". Returns 0 on
+ * success, -1 on failure.
+ */
+static int
+wfs_notifier_start(struct fuse_session *se)
+{
+  wfs_notifier.se = se;
+  if (pthread_create(&wfs_notifier.thread, NULL, wfs_notifier_thread,
+                     NULL) != 0)
     {
-      wfs_image_close(img);
-      return NULL;
+      wfs_notifier.se = NULL;
+      return -1;
     }
 
-  return img;
+  return 0;
 }
 
-static inline wfs_image_t *
-get_wfs_image(void)
+/* Stops the notifier. Invalidations still queued are dropped. */
+static void
+wfs_notifier_stop(void)
 {
-  return (wfs_image_t *)fuse_get_context()->private_data;
+  pthread_mutex_lock(&wfs_notifier.lock);
+  bool started = wfs_notifier.se != NULL;
+  wfs_notifier.stop = true;
+  wfs_notifier.se = NULL;
+  pthread_cond_signal(&wfs_notifier.cond);
+  pthread_mutex_unlock(&wfs_notifier.lock);
+
+  if (started)
+    pthread_join(wfs_notifier.thread, NULL);
+
+  while (wfs_notifier.head)
+    {
+      struct wfs_notify *notify = wfs_notifier.head;
+      wfs_notifier.head = notify->next;
+      free(notify->name);
+      free(notify);
+    }
+  wfs_notifier.tail = NULL;
 }
 
 /*
- * Low-level file system routines
+ * Implementation of necessary FUSE operations.
  */
 
-static inline uint16_t
-wfs_block_table_read(wfs_image_t *image, uint16_t idx)
+static void
+wfs_lookup(fuse_req_t req, fuse_ino_t parent, const char *name)
 {
-  uint16_t value = 0;
-  uint32_t offset = WFS_BLOCK_TABLE_START + (idx * sizeof(uint16_t));
+  wfs_image_t *image = get_wfs_image(req);
+  wfs_file_entry_t entry;
+  wfs_ino_t ino;
 
-  pread(image->fd, &value, sizeof(uint16_t), offset);
+  /* The pseudo file is not tracked in the inode table. */
+  if (wfs_is_stats_file(parent, name))
+    {
+      struct fuse_entry_param e;
+
+      memset(&e, 0, sizeof(struct fuse_entry_param));
+      e.ino = WFS_STATS_INO;
+      e.attr_timeout = WFS_ATTR_TIMEOUT;
+      e.entry_timeout = WFS_ENTRY_TIMEOUT;
+      wfs_fill_stats_stat(&e.attr);
+      fuse_reply_entry(req, &e);
+      return;
+    }
 
-  return value;
+  int res = wfs_image_lookup(image, parent, name, &entry, &ino);
+  if (res < 0)
+    fuse_reply_err(req, -res);
+  else
+    wfs_reply_entry(req, ino, &entry);
 }
 
-static uint16_t
-wfs_get_block(wfs_image_t *image, uint16_t current_block)
+static void
+wfs_forget(fuse_req_t req, fuse_ino_t ino, uint64_t nlookup)
 {
-  return wfs_block_table_read(image, current_block - 1);
+  wfs_inode_forget(get_wfs_image(req), ino, nlookup);
+  fuse_reply_none(req);
 }
 
-/* Given an offset within a file, return the block number in which
- * this offset is located and the corresponding position within that
- * block (block_position).
- */
-static uint16_t
-wfs_get_current_block(wfs_image_t *image, wfs_file_entry_t *entry,
-                      off_t off, uint16_t *block_position)
+static void
+wfs_forget_multi(fuse_req_t req, size_t count,
+                 struct fuse_forget_data *forgets)
 {
-  off_t o = 0;
-  uint16_t block = entry->start_block;
+  wfs_image_t *image = get_wfs_image(req);
 
-  if (block == WFS_BLOCK_EOF)
-    return block;
+  for (size_t i = 0; i < count; i++)
+    wfs_inode_forget(image, forgets[i].ino, forgets[i].nlookup);
 
-  while (off >= o + WFS_BLOCK_SIZE)
-    {
-      block = wfs_block_table_read(image, block - 1);
-      if (block == WFS_BLOCK_EOF)
-        return block;
+  fuse_reply_none(req);
+}
+
+static void
+wfs_do_getattr(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi)
+{
+  wfs_file_entry_t entry;
+  struct stat stbuf;
 
-      o += WFS_BLOCK_SIZE;
+  if (ino == WFS_STATS_INO)
+    {
+      wfs_fill_stats_stat(&stbuf);
+      fuse_reply_attr(req, &stbuf, WFS_ATTR_TIMEOUT);
+      return;
     }
 
-  if (block_position)
-    *block_position = off - o;
+  int res = wfs_image_get_entry(get_wfs_image(req), ino, &entry);
+  if (res < 0)
+    {
+      fuse_reply_err(req, -res);
+      return;
+    }
 
-  return block;
+  wfs_fill_stat(ino, &entry, &stbuf);
+  fuse_reply_attr(req, &stbuf, WFS_ATTR_TIMEOUT);
 }
 
-/* Read the block chain to determine the disk block that follows the
- * current block.
+/* Only changing the size is supported; WFS does not store the other
+ * attributes, requests to change them are ignored.
  */
-static uint16_t
-wfs_get_next_block(wfs_image_t *image, uint16_t current_block)
+static void
+wfs_setattr(fuse_req_t req, fuse_ino_t ino, struct stat *attr, int to_set,
+            struct fuse_file_info *fi)
 {
-  uint16_t block = 0;
+  wfs_image_t *image = get_wfs_image(req);
+  wfs_file_entry_t entry;
+  struct stat stbuf;
+  int res;
 
-  if (current_block == WFS_BLOCK_EOF)
-    return current_block;
+  if (ino == WFS_STATS_INO)
+    {
+      if (to_set & FUSE_SET_ATTR_SIZE)
+        fuse_reply_err(req, EACCES);
+      else
+        {
+          wfs_fill_stats_stat(&stbuf);
+          fuse_reply_attr(req, &stbuf, WFS_ATTR_TIMEOUT);
+        }
+      return;
+    }
 
-  if (current_block - 1 >= WFS_N_BLOCKS)
-    return WFS_BLOCK_EOF;
+  if (to_set & FUSE_SET_ATTR_SIZE)
+    {
+      res = wfs_file_truncate(image, ino, get_wfs_file_handle(fi),
+                              attr->st_size);
+      if (res < 0)
+        {
+          fuse_reply_err(req, -res);
+          return;
+        }
+    }
 
-  block = wfs_block_table_read(image, current_block - 1);
+  res = wfs_image_get_entry(image, ino, &entry);
+  if (res < 0)
+    {
+      fuse_reply_err(req, -res);
+      return;
+    }
 
-  return block;
+  wfs_fill_stat(ino, &entry, &stbuf);
+  fuse_reply_attr(req, &stbuf, WFS_ATTR_TIMEOUT);
 }
 
+struct wfs_readdir_data
+{
+  fuse_req_t req;
+  wfs_image_t *image;
+  uint16_t dir_block;
+  char *buf;
+  size_t size;
+  size_t pos;
+  off_t offset;
+  bool full;
+
+  /* For readdirplus, the inodes whose lookup count was incremented. */
+  bool plus;
+  wfs_ino_t *inos;
+  size_t n_inos;
+  size_t max_inos;
+};
 
-/*
- * Generic file entry operations
+/* Adds an entry to the readdir reply, unless it was already returned
+ * by a previous call. "index" is the position of the entry within the
+ * directory listing; the offset of the entry following it is passed to
+ * the kernel so that the listing can be resumed. For readdirplus, the
+ * kernel takes a lookup reference to every entry except "." and "..";
+ * "ref" tells whether it must be counted in the inode table.
  */
-
-typedef enum
+static void
+wfs_readdir_add(struct wfs_readdir_data *data, const char *name,
+                const struct stat *stbuf, bool ref, off_t index)
 {
-  WFS_FILE_ENTRY_OP_FIND,
-  WFS_FILE_ENTRY_OP_COUNT,
-  WFS_FILE_ENTRY_OP_CALLBACK,
-  WFS_FILE_ENTRY_OP_MKDIR,
-  WFS_FILE_ENTRY_OP_RMDIR
-} wfs_file_entry_op_t;
+  if (index < data->offset || data->full)
+    return;
 
-typedef void (* wfs_file_entry_op_callback_t) (wfs_file_entry_t *entry,
-                                               void             *data);
+  size_t len;
+  if (data->plus)
+    {
+      struct fuse_entry_param e;
 
-/* Performs the specified file entry operation within the directory
- * specified by "parent". "parent" must be a directory. If "parent" is
- * the empty entry, the root directory is used. The use of the "entry"
- * argument depends on the selected file entry operation.
- */
-static int
-wfs_file_entry_operation(wfs_file_entry_t             *parent,
-                         wfs_file_entry_op_t           op,
-                         wfs_file_entry_t             *entry,
-                         wfs_file_entry_op_callback_t  callback,
-                         void                         *callback_data)
-{
-  int count = 0;
-  int aantalfiles = 16, entrystart = WFS_ENTRIES_START;
-  wfs_image_t *image = get_wfs_image();
-  if (!parent)
-    return -EINVAL;
-
-  /* Can only read the root directory, so parent must be the empty entry */
-  if (!wfs_file_entry_is_empty(parent)){
-  	entrystart = wfs_get_block_offset(parent->start_block -1);
-	}
-	
-  /* Refuse to perform find operation if the filename is empty. */
-  if (op == WFS_FILE_ENTRY_OP_FIND && entry->filename[0] == 0)
-    return -EINVAL;
-	
-	//printf("files: %d , entries: %d\n", aantalfiles, entrystart);
-	
-  for (int i = 0; i < aantalfiles; i++)
-    {
-      wfs_file_entry_t tmp_entry;
-      pread(image->fd, &tmp_entry, sizeof(wfs_file_entry_t),
-            entrystart + (i * sizeof(wfs_file_entry_t)));
-
-      switch (op)
+      memset(&e, 0, sizeof(struct fuse_entry_param));
+      if (strcmp(name, ".") && strcmp(name, ".."))
         {
-          case WFS_FILE_ENTRY_OP_FIND:
-            {
-              if (wfs_file_entry_is_empty(&tmp_entry))
-                continue;
+          e.ino = stbuf->st_ino;
+          e.attr_timeout = WFS_ATTR_TIMEOUT;
+          e.entry_timeout = WFS_ENTRY_TIMEOUT;
+        }
+      e.attr = *stbuf;
 
-              if (!strncmp(tmp_entry.filename, entry->filename,
-                           WFS_FILENAME_SIZE))
-                {
-                  *entry = tmp_entry;
-                  return 1;
-                }
-            }
-          break;
+      if (ref && data->n_inos == data->max_inos)
+        {
+          data->full = true;
+          return;
+        }
 
-          case WFS_FILE_ENTRY_OP_COUNT:
-            if (!wfs_file_entry_is_empty(&tmp_entry))
-              count++;
-            break;
-
-          case WFS_FILE_ENTRY_OP_CALLBACK:
-            if (!wfs_file_entry_is_empty(&tmp_entry))
-              (* callback) (&tmp_entry, callback_data);
-            break;
-            
-          case WFS_FILE_ENTRY_OP_MKDIR:
-          	
+      len = fuse_add_direntry_plus(data->req, data->buf + data->pos,
+                                   data->size - data->pos, name, &e,
+                                   index + 1);
+      if (ref && len <= data->size - data->pos)
+        {
+          wfs_inode_ref(data->image, e.ino);
+          data->inos[data->n_inos++] = e.ino;
         }
     }
+  else
+    len = fuse_add_direntry(data->req, data->buf + data->pos,
+                            data->size - data->pos, name, stbuf, index + 1);
 
-  return count;
+  /* Once an entry does not fit, no further entries are added. */
+  if (len > data->size - data->pos)
+    data->full = true;
+  else
+    data->pos += len;
 }
 
-/* Searches the file system hierarchy to find the file entry for
- * the given path. Returns true if the operation succeeded.
+/* The attributes are taken from the entry at hand, so that listing a
+ * directory does not need a getattr or lookup per entry. This runs with
+ * the directory locked, so a referenced slot cannot be reused before
+ * its reference is taken.
  */
-static bool
-wfs_find_entry(const char *path, wfs_file_entry_t *entry)
+static void
+wfs_readdir_callback(wfs_file_entry_t *entry,
+                     int               slot,
+                     void             *data)
 {
-  if (strlen(path) == 0 || path[0] != '/')
-    return false;
-
-  wfs_file_entry_t current_entry = { { 0, }, };
-  while (path && (path = strchr(path, '/')))
-    {
-      wfs_file_entry_t parent_entry = current_entry;
+  struct wfs_readdir_data *readdir_data = (struct wfs_readdir_data *)data;
+  struct stat stbuf;
 
-      /* Ignore path separator */
-      while (*path == '/')
-        path++;
+  wfs_fill_stat(wfs_ino_make(readdir_data->dir_block, slot), entry, &stbuf);
+  wfs_readdir_add(readdir_data, entry->filename, &stbuf, true, slot + 2);
+}
 
-      /* Find end of new component */
-      char *end = strchr(path, '/');
-      if (!end)
-        {
-          int len = strnlen(path, PATH_MAX);
-          if (len > 0)
-            end = (char *)&path[len];
-          else
-            {
-              /* We are done: return current entry. */
-              *entry = current_entry;
-              return true;
-            }
-        }
+static void
+wfs_do_readdir(fuse_req_t req, fuse_ino_t ino, size_t size, off_t offset,
+               struct fuse_file_info *fi, bool plus)
+{
+  wfs_image_t *image = get_wfs_image(req);
+  wfs_file_entry_t entry;
 
-      /* Verify length of component is not larger than maximum allowed
-       * filename size.
-       */
-      int len = end-path+1;
-      if (len >= WFS_FILENAME_SIZE - 1)
-        return false;
+  int res = wfs_image_get_entry(image, ino, &entry);
+  if (res < 0)
+    {
+      fuse_reply_err(req, -res);
+      return;
+    }
 
-      memset(&current_entry, 0, sizeof(wfs_file_entry_t));
-      strncpy(current_entry.filename, path, len);
-      current_entry.filename[len-1] = 0;
+  /* Note that an empty entry represents the root directory. */
+  if (!wfs_file_entry_is_empty(&entry)
+      && !wfs_file_entry_is_directory(&entry))
+    {
+      fuse_reply_err(req, ENOTDIR);
+      return;
+    }
 
-      /* Find entry for this filename in parent_entry */
-      if (current_entry.filename[0] != 0)
-        {
-          if (wfs_file_entry_operation(&parent_entry,
-                                       WFS_FILE_ENTRY_OP_FIND,
-                                       &current_entry, NULL, NULL) <= 0)
-            return false;
-        }
+  /* The reply and the list of referenced inodes are taken from the
+   * arena; at most every slot of the directory is referenced.
+   */
+  const uint16_t dir_block = wfs_file_entry_get_dir_block(&entry);
+  const size_t max_inos = wfs_dir_get_n_entries(&image->layout, dir_block);
+  struct wfs_readdir_data data =
+    {
+      req, image, dir_block, wfs_arena_alloc(image, size), size,
+      0, offset, false, plus,
+      plus ? wfs_arena_alloc(image, max_inos * sizeof(wfs_ino_t)) : NULL,
+      0, plus ? max_inos : 0
+    };
+  if (!data.buf || (plus && !data.inos))
+    {
+      wfs_arena_reset(image);
+      fuse_reply_err(req, ENOMEM);
+      return;
+    }
 
-      path = end;
+  /* Directories do not record their parent; the kernel does not use the
+   * inode number reported for "..".
+   */
+  struct stat stbuf;
+  wfs_fill_stat(ino, &entry, &stbuf);
+  wfs_readdir_add(&data, ".", &stbuf, false, 0);
+  wfs_readdir_add(&data, "..", &stbuf, false, 1);
+  res = wfs_file_entry_operation(image, &entry, WFS_FILE_ENTRY_OP_CALLBACK,
+                                 NULL, wfs_readdir_callback, &data);
+  if (ino == FUSE_ROOT_ID)
+    {
+      /* The pseudo file is not tracked in the inode table. */
+      wfs_fill_stats_stat(&stbuf);
+      wfs_readdir_add(&data, WFS_STATS_NAME, &stbuf, false, WFS_N_FILES + 2);
     }
 
-  *entry = current_entry;
+  /* References are dropped again if the entries did not reach the
+   * kernel.
+   */
+  if (res < 0)
+    fuse_reply_err(req, -res);
+  if (res < 0 || fuse_reply_buf(req, data.buf, data.pos) != 0)
+    for (size_t i = 0; i < data.n_inos; i++)
+      wfs_inode_forget(image, data.inos[i], 1);
 
-  return true;
+  wfs_arena_reset(image);
 }
 
-static inline void
-drop_trailing_slashes(char *path_copy)
+static void
+wfs_mkdir(fuse_req_t req, fuse_ino_t parent, const char *name, mode_t mode)
 {
-  int len = strlen(path_copy);
-  while (len > 0 && path_copy[len-1] == '/')
+  wfs_file_entry_t entry;
+  wfs_ino_t ino;
+
+  if (wfs_is_stats_file(parent, name))
+    {
+      fuse_reply_err(req, EEXIST);
+      return;
+    }
+
+  int res = wfs_image_create(get_wfs_image(req), parent, name, true,
+                             &entry, &ino);
+  if (res < 0)
+    fuse_reply_err(req, -res);
+  else
     {
-      path_copy[len-1] = 0;
-      len--;
+      wfs_reply_entry(req, ino, &entry);
+      wfs_notify(parent, NULL);
     }
 }
 
-/* Return the parent entry, for the containing directory of the file or
- * directory specified in path. Returns 0 on success, error code otherwise.
+static void
+wfs_rmdir(fuse_req_t req, fuse_ino_t parent, const char *name)
+{
+  int res = wfs_image_rmdir(get_wfs_image(req), parent, name);
+
+  fuse_reply_err(req, -res);
+  if (res == 0)
+    wfs_notify(parent, name);
+}
+
+/* Captures the current statistics for a new handle of the pseudo file.
+ * The file has no size, so it is read with direct I/O until the end of
+ * the captured data is reached.
  */
-static int
-wfs_get_parent_entry(const char *path, wfs_file_entry_t *parent_entry)
+static void
+wfs_open_stats(fuse_req_t req, struct fuse_file_info *fi)
 {
-  int res;
-  char *path_copy = strdup(path);
+  if ((fi->flags & O_ACCMODE) != O_RDONLY)
+    {
+      fuse_reply_err(req, EACCES);
+      return;
+    }
+
+  struct wfs_stats_file *file = malloc(sizeof(struct wfs_stats_file));
+  if (!file)
+    {
+      fuse_reply_err(req, ENOMEM);
+      return;
+    }
 
-  drop_trailing_slashes(path_copy);
+  FILE *stream = open_memstream(&file->data, &file->size);
+  if (!stream)
+    {
+      free(file);
+      fuse_reply_err(req, ENOMEM);
+      return;
+    }
 
-  if (strlen(path_copy) == 0)
+  int res = wfs_stats_print(get_wfs_image(req), stream);
+  if (fclose(stream) != 0 || res < 0)
     {
-      res = -EINVAL;
-      goto out;
+      free(file->data);
+      free(file);
+      fuse_reply_err(req, ENOMEM);
+      return;
     }
 
-  /* Extract parent component */
-  char *sep = strrchr(path_copy, '/');
-  if (!sep)
+  fi->fh = (uintptr_t)file;
+  fi->direct_io = 1;
+
+  if (fuse_reply_open(req, fi) != 0)
     {
-      res = -EINVAL;
-      goto out;
+      free(file->data);
+      free(file);
     }
+}
+
+static void
+wfs_do_open(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi)
+{
+  wfs_file_entry_t entry;
 
-  if (path_copy == sep)
+  if (ino == WFS_STATS_INO)
     {
-      /* The parent is the root directory, return an empty entry. */
-      memset(parent_entry, 0, sizeof(wfs_file_entry_t));
-      res = 0;
-      goto out;
+      wfs_open_stats(req, fi);
+      return;
     }
 
-  *sep = 0;
-  char *dirname = path_copy;
+  int res = wfs_image_get_entry(get_wfs_image(req), ino, &entry);
+  if (res < 0)
+    {
+      fuse_reply_err(req, -res);
+      return;
+    }
 
-  if (!wfs_find_entry(dirname, parent_entry))
+  if (ino == FUSE_ROOT_ID || wfs_file_entry_is_directory(&entry))
     {
-      res = -ENOENT;
-      goto out;
+      fuse_reply_err(req, EISDIR);
+      return;
     }
 
-  /* Note that the entry may be empty in case the root directory was found. */
-  if (!wfs_file_entry_is_empty(parent_entry)
-      && !wfs_file_entry_is_directory(parent_entry))
+  wfs_file_handle_t *fh = malloc(sizeof(wfs_file_handle_t));
+  if (!fh)
     {
-      /* This is really not supposed to happen. */
-      res = -EIO;
-      goto out;
+      fuse_reply_err(req, ENOMEM);
+      return;
     }
 
-  res = 0;
+  wfs_file_handle_init(fh, &entry);
+  fi->fh = (uintptr_t)fh;
 
-out:
-  free(path_copy);
+  /* All changes to the file pass through the kernel, so its cached pages
+   * remain valid between opens.
+   */
+  fi->keep_cache = 1;
 
-  return res;
+  if (fuse_reply_open(req, fi) != 0)
+    {
+      wfs_file_handle_fini(fh);
+      free(fh);
+    }
 }
 
-/* Separates the basename (the actual name of the file) from the path.
- * The return value must be freed.
- */
-static char *
-wfs_get_basename(const char *path)
+static void
+wfs_release(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi)
 {
-  char *res = NULL;
-  char *path_copy = strdup(path);
+  if (ino == WFS_STATS_INO)
+    {
+      struct wfs_stats_file *file = (struct wfs_stats_file *)(uintptr_t)fi->fh;
+
+      free(file->data);
+      free(file);
+      fuse_reply_err(req, 0);
+      return;
+    }
 
-  drop_trailing_slashes(path_copy);
+  wfs_file_handle_t *fh = get_wfs_file_handle(fi);
 
-  if (strlen(path_copy) == 0)
+  if (fh)
     {
-      res = NULL;
-      goto out;
+      wfs_file_handle_fini(fh);
+      free(fh);
+      fi->fh = 0;
     }
 
-  /* Find beginning of basename. */
-  char *sep = strrchr(path_copy, '/');
-  if (!sep)
+  /* Data written through this handle is not kept in the cache any
+   * longer than necessary.
+   */
+  int res = wfs_bcache_flush(get_wfs_image(req));
+  fuse_reply_err(req, -res);
+}
+
+static void
+wfs_create(fuse_req_t req, fuse_ino_t parent, const char *name,
+           mode_t mode, struct fuse_file_info *fi)
+{
+  wfs_image_t *image = get_wfs_image(req);
+  wfs_file_entry_t entry;
+  wfs_ino_t ino;
+
+  if (wfs_is_stats_file(parent, name))
     {
-      res = NULL;
-      goto out;
+      fuse_reply_err(req, EEXIST);
+      return;
     }
 
-  res = strdup(sep + 1);
+  int res = wfs_image_create(image, parent, name, false, &entry, &ino);
+  if (res < 0)
+    {
+      fuse_reply_err(req, -res);
+      return;
+    }
 
-out:
-  free(path_copy);
+  wfs_file_handle_t *fh = malloc(sizeof(wfs_file_handle_t));
+  if (!fh)
+    {
+      fuse_reply_err(req, ENOMEM);
+      return;
+    }
 
-  return res;
-}
+  wfs_file_handle_init(fh, &entry);
+  fi->fh = (uintptr_t)fh;
 
-/*
- * Implementation of necessary FUSE operations.
- */
+  struct fuse_entry_param e;
+  wfs_fill_entry_param(ino, &entry, &e);
 
-struct wfs_readdir_data
-{
-  void *buf;
-  fuse_fill_dir_t filler;
-};
+  fi->keep_cache = 1;
 
-static void
-wfs_readdir_callback(wfs_file_entry_t *entry,
-                     void             *data)
-{
-  struct wfs_readdir_data *readdir_data = (struct wfs_readdir_data *)data;
-
-  readdir_data->filler(readdir_data->buf, entry->filename, NULL, 0);
+  wfs_inode_ref(image, ino);
+  if (fuse_reply_create(req, &e, fi) != 0)
+    {
+      wfs_inode_forget(image, ino, 1);
+      wfs_file_handle_fini(fh);
+      free(fh);
+    }
+  else
+    wfs_notify(parent, NULL);
 }
 
+/* Replies to a read with references to the image rather than a copy of
+ * the data: ranges of the image file, which libfuse can splice to the
+ * kernel, or ranges of the mapping in WFS_IO_MMAP mode. Returns 0 if a
+ * reply was sent, otherwise -EAGAIN if the data has to be copied
+ * instead, or another error code.
+ */
 static int
-wfs_readdir(const char *path, void *buf, fuse_fill_dir_t filler,
-            off_t offset, struct fuse_file_info *fi)
+wfs_reply_read_data(fuse_req_t req, const wfs_file_entry_t *entry,
+                    wfs_file_handle_t *fh, size_t size, off_t offset)
 {
-  struct wfs_readdir_data data = { buf, filler };
-  wfs_file_entry_t entry = { { 0, }, };
+  wfs_image_t *image = get_wfs_image(req);
 
-  if (!wfs_find_entry(path, &entry))
-    return -ENOENT;
+  /* Enough for a file that is not contiguous at all, and thus for the
+   * pieces of a striped image, which are at most a block each.
+   */
+  int max_segments = size / image->layout.block_size + 2;
+  wfs_io_segment_t *segments = wfs_arena_alloc(image, max_segments
+                                               * sizeof(wfs_io_segment_t));
+  struct fuse_bufvec *bufv =
+    wfs_arena_alloc(image, sizeof(struct fuse_bufvec)
+                    + max_segments * sizeof(struct fuse_buf));
+  int n_segments;
+  ssize_t res = -EAGAIN;
+
+  if (segments && bufv)
+    res = wfs_file_read_segments(image, entry, fh, size, offset, segments,
+                                 max_segments, &n_segments);
+
+  if (res == 0)
+    fuse_reply_buf(req, NULL, 0);
+  else if (res > 0)
+    {
+      memset(bufv, 0, sizeof(struct fuse_bufvec));
 
-  /* Note that an empty entry represents the root directory. */
-  if (!wfs_file_entry_is_empty(&entry)
-      && !wfs_file_entry_is_directory(&entry))
-    return -ENOTDIR;
+      for (int i = 0; i < n_segments; i++)
+        {
+          /* A segment of a striped image is split into the pieces
+           * stored on the various devices.
+           */
+          for (size_t done = 0; done < segments[i].size; )
+            {
+              struct fuse_buf *buf = &bufv->buf[bufv->count++];
+              size_t piece_size = segments[i].size - done;
 
-  filler(buf, ".", NULL, 0);
-  filler(buf, "..", NULL, 0);
-  wfs_file_entry_operation(&entry, WFS_FILE_ENTRY_OP_CALLBACK, NULL,
-                           wfs_readdir_callback, &data);
+              memset(buf, 0, sizeof(struct fuse_buf));
+              if (image->map)
+                buf->mem = image->map + segments[i].offset + done;
+              else
+                {
+                  off_t pos;
 
-  return 0;
-}
+                  buf->flags = FUSE_BUF_IS_FD | FUSE_BUF_FD_SEEK;
+                  buf->fd = wfs_image_locate(image, segments[i].offset + done,
+                                             &piece_size, &pos);
+                  buf->pos = pos;
+                }
+              buf->size = piece_size;
+              done += piece_size;
+            }
+        }
 
-static int
-wfs_mkdir(const char *path, mode_t mode)
-{
-	char * name = NULL;
-	wfs_file_entry_t * parent = (wfs_file_entry_t *) malloc(sizeof(wfs_file_entry_t));
-	name = wfs_get_basename(path);
-	int lengte = strlen(path) - strlen(name) - 1;
-	char path2[lengte];
-	strncpy(path2, path, lengte);
-	wfs_get_parent_entry(path, parent);
-  wfs_file_entry_t entry = { { 0, }, };
-	wfs_file_entry_operation(parent, WFS_FILE_ENTRY_OP_MKDIR,)
-	
-  return -ENOSYS;
-}
+      fuse_reply_data(req, bufv, FUSE_BUF_SPLICE_MOVE);
+    }
 
-static int
-wfs_rmdir(const char *path)
-{
-  return -ENOSYS;
+  if (segments)
+    wfs_arena_release(image, segments);
+  else
+    wfs_arena_release(image, bufv);
+
+  return res < 0 ? res : 0;
 }
 
-static int
-wfs_getattr(const char *path, struct stat *stbuf)
+static void
+wfs_do_read(fuse_req_t req, fuse_ino_t ino, size_t size, off_t offset,
+            struct fuse_file_info *fi)
 {
-  int res = 0;
+  wfs_image_t *image = get_wfs_image(req);
+  wfs_file_entry_t entry;
 
-  memset(stbuf, 0, sizeof(struct stat));
-  if (strcmp(path, "/") == 0)
+  if (ino == WFS_STATS_INO)
     {
-      stbuf->st_mode = S_IFDIR | 0755;
-      stbuf->st_nlink = 2;
-      return res;
+      struct wfs_stats_file *file = (struct wfs_stats_file *)(uintptr_t)fi->fh;
+
+      if (offset > file->size)
+        offset = file->size;
+      if (size > file->size - offset)
+        size = file->size - offset;
+
+      fuse_reply_buf(req, file->data + offset, size);
+      return;
     }
 
-  wfs_file_entry_t entry;
-  if (!wfs_find_entry(path, &entry))
-    res = -ENOENT;
-  else
+  /* A write to a file shared with the snapshot moves its first block,
+   * which ends the chain found through an entry read just before. The
+   * read is then repeated for as long as the entry keeps changing.
+   */
+  uint16_t start_block = WFS_BLOCK_FREE;
+  ssize_t res = 0;
+  while (true)
     {
-      if (wfs_file_entry_is_directory(&entry))
+      int ret = wfs_image_get_entry(image, ino, &entry);
+      if (ret < 0)
         {
-          stbuf->st_mode = S_IFDIR | 0444;
-          stbuf->st_nlink = 2;
+          res = ret;
+          break;
         }
-      else
+      if (res == -EIO && entry.start_block == start_block)
+        break;
+      start_block = entry.start_block;
+
+      res = wfs_reply_read_data(req, &entry, get_wfs_file_handle(fi), size,
+                                offset);
+      if (res == 0)
+        return;
+      if (res == -EAGAIN)
         {
-          stbuf->st_mode = S_IFREG | 0444;
-          stbuf->st_nlink = 1;
+          char *buf = wfs_arena_alloc(image, size);
+          if (!buf)
+            {
+              res = -ENOMEM;
+              break;
+            }
+
+          res = wfs_file_read(image, &entry, get_wfs_file_handle(fi), buf,
+                              size, offset);
+          if (res >= 0)
+            fuse_reply_buf(req, buf, res);
+          wfs_arena_reset(image);
+          if (res >= 0)
+            return;
         }
-      stbuf->st_size = wfs_file_entry_get_size(&entry);
+
+      if (res != -EIO)
+        break;
     }
 
-  return res;
+  fuse_reply_err(req, -res);
 }
 
-static int
-wfs_open(const char *path, struct fuse_file_info *fi)
+static void
+wfs_do_write(fuse_req_t req, fuse_ino_t ino, const char *buf, size_t size,
+             off_t offset, struct fuse_file_info *fi)
 {
-  wfs_file_entry_t entry;
-  if (!wfs_find_entry(path, &entry))
-    return -ENOENT;
-
-  if (wfs_file_entry_is_directory(&entry))
-    return -EISDIR;
+  if (ino == WFS_STATS_INO)
+    {
+      fuse_reply_err(req, EBADF);
+      return;
+    }
 
-  return 0;
+  ssize_t written = wfs_file_write(get_wfs_image(req), ino,
+                                   get_wfs_file_handle(fi), buf, size,
+                                   offset);
+  if (written < 0)
+    fuse_reply_err(req, -written);
+  else
+    {
+      fuse_reply_write(req, written);
+      wfs_notify(ino, NULL);
+    }
 }
 
-/* To keep things simple, we will not support creation of new files, only
- * modification of existing files.
+/* The latency of these operations is recorded, including the time taken
+ * to send the reply. The request is gone once it has been replied to, so
+ * the image is looked up beforehand.
  */
-static int
-wfs_create(const char *path, mode_t mode, struct fuse_file_info *fi)
+
+static void
+wfs_getattr(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi)
 {
-  return -ENOSYS;
+  wfs_image_t *image = get_wfs_image(req);
+  uint64_t start = wfs_stats_begin();
+
+  wfs_do_getattr(req, ino, fi);
+  wfs_stats_end(image, WFS_OP_GETATTR, start);
 }
 
-static int
-wfs_read(const char *path, char *buf, size_t size, off_t offset,
-         struct fuse_file_info *fi)
+static void
+wfs_readdir(fuse_req_t req, fuse_ino_t ino, size_t size, off_t offset,
+            struct fuse_file_info *fi)
 {
-  wfs_file_entry_t entry;
-  if (!wfs_find_entry(path, &entry))
-    return -ENOENT;
+  wfs_image_t *image = get_wfs_image(req);
+  uint64_t start = wfs_stats_begin();
+
+  wfs_do_readdir(req, ino, size, offset, fi, false);
+  wfs_stats_end(image, WFS_OP_READDIR, start);
+}
+
+static void
+wfs_readdirplus(fuse_req_t req, fuse_ino_t ino, size_t size, off_t offset,
+                struct fuse_file_info *fi)
+{
+  wfs_image_t *image = get_wfs_image(req);
+  uint64_t start = wfs_stats_begin();
+
+  wfs_do_readdir(req, ino, size, offset, fi, true);
+  wfs_stats_end(image, WFS_OP_READDIR, start);
+}
 
-  const size_t current_size = wfs_file_entry_get_size(&entry);
-  if (offset > current_size)
-    return -EINVAL;
+static void
+wfs_open(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi)
+{
+  wfs_image_t *image = get_wfs_image(req);
+  uint64_t start = wfs_stats_begin();
 
-  uint16_t block_position;
-  wfs_image_t *image = get_wfs_image();
-  int block = wfs_get_current_block(image, &entry, offset, &block_position);
+  wfs_do_open(req, ino, fi);
+  wfs_stats_end(image, WFS_OP_OPEN, start);
+}
 
-  if (block >= WFS_BLOCK_EOF)
-    return -EIO;
+static void
+wfs_read(fuse_req_t req, fuse_ino_t ino, size_t size, off_t offset,
+         struct fuse_file_info *fi)
+{
+  wfs_image_t *image = get_wfs_image(req);
+  uint64_t start = wfs_stats_begin();
 
-  if (offset + size > current_size)
-    size = current_size - offset;
+  wfs_do_read(req, ino, size, offset, fi);
+  wfs_stats_end(image, WFS_OP_READ, start);
+}
 
-  int read = 0;
-  while (size > 0 && block > WFS_BLOCK_FREE && block <= WFS_BLOCK_EOF)
-    {
-      off_t block_offset;
-      uint16_t transfer;
+static void
+wfs_write(fuse_req_t req, fuse_ino_t ino, const char *buf, size_t size,
+          off_t offset, struct fuse_file_info *fi)
+{
+  wfs_image_t *image = get_wfs_image(req);
+  uint64_t start = wfs_stats_begin();
 
-      block_offset = wfs_get_block_offset(block - 1);
+  wfs_do_write(req, ino, buf, size, offset, fi);
+  wfs_stats_end(image, WFS_OP_WRITE, start);
+}
 
-      if (block_position == 0)
-        transfer = WFS_BLOCK_SIZE;
-      else
-        transfer = WFS_BLOCK_SIZE - block_position;
+static void
+wfs_flush(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi)
+{
+  fuse_reply_err(req, -wfs_image_sync(get_wfs_image(req), false));
+}
 
-      if (transfer > size)
-        transfer = size;
+static void
+wfs_fsync(fuse_req_t req, fuse_ino_t ino, int datasync,
+          struct fuse_file_info *fi)
+{
+  fuse_reply_err(req, -wfs_image_sync(get_wfs_image(req), true));
+}
 
-      transfer = pread(image->fd, buf + read, transfer,
-                       block_offset + block_position);
+static void
+wfs_statfs(fuse_req_t req, fuse_ino_t ino)
+{
+  wfs_image_t *image = get_wfs_image(req);
+  struct statvfs st;
 
-      size -= transfer;
-      read += transfer;
-      offset += transfer;
+  memset(&st, 0, sizeof(struct statvfs));
+  st.f_bsize = image->layout.block_size;
+  st.f_frsize = image->layout.block_size;
+  st.f_blocks = image->layout.n_blocks;
+  st.f_namemax = WFS_FILENAME_SIZE - 1;
 
-      if (size > 0)
-        {
-          block = wfs_get_next_block(image, block);
-          block_position = 0;
+  pthread_rwlock_rdlock(&image->table_lock);
+  st.f_bfree = st.f_bavail = image->n_free_blocks;
+  pthread_rwlock_unlock(&image->table_lock);
 
-          if (block == WFS_BLOCK_FREE || block >= WFS_BLOCK_EOF)
-            return -EIO;
-        }
-    }
+  fuse_reply_statfs(req, &st);
+}
+
+/*
+ * FUSE setup
+ */
 
-  return read;
+static void
+wfs_init(void *userdata, struct fuse_conn_info *conn)
+{
+  /* Allow read replies to be spliced from the image, see
+   * wfs_reply_read_data().
+   */
+  if (conn->capable & FUSE_CAP_SPLICE_WRITE)
+    conn->want |= FUSE_CAP_SPLICE_WRITE;
+  if (conn->capable & FUSE_CAP_SPLICE_MOVE)
+    conn->want |= FUSE_CAP_SPLICE_MOVE;
+
+  /* Always list directories with readdirplus, which returns the
+   * attributes of all entries in the same scan, instead of letting the
+   * kernel decide per listing.
+   */
+  if (conn->capable & FUSE_CAP_READDIRPLUS)
+    conn->want |= FUSE_CAP_READDIRPLUS;
+  conn->want &= ~FUSE_CAP_READDIRPLUS_AUTO;
 }
 
+static const struct fuse_lowlevel_ops wfs_oper =
+{
+  .init         = wfs_init,
+  .lookup       = wfs_lookup,
+  .forget       = wfs_forget,
+  .forget_multi = wfs_forget_multi,
+  .readdir      = wfs_readdir,
+  .readdirplus  = wfs_readdirplus,
+  .mkdir        = wfs_mkdir,
+  .rmdir        = wfs_rmdir,
+  .getattr      = wfs_getattr,
+  .setattr      = wfs_setattr,
+  .open         = wfs_open,
+  .release      = wfs_release,
+  .create       = wfs_create,
+  .read         = wfs_read,
+  .write        = wfs_write,
+  .flush        = wfs_flush,
+  .fsync        = wfs_fsync,
+  .statfs       = wfs_statfs
+};
+
+struct wfs_options
+{
+  const char *filename;
+  int n_nonopts;
+  char *io;
+  int preload;
+  int snapshot;
+  int defrag;
+  char *stripes;
+};
+
+static const struct fuse_opt wfs_opts[] =
+{
+  { "io=%s", offsetof(struct wfs_options, io), 0 },
+  { "preload", offsetof(struct wfs_options, preload), 1 },
+  { "snapshot", offsetof(struct wfs_options, snapshot), 1 },
+  { "defrag", offsetof(struct wfs_options, defrag), 1 },
+  { "stripes=%s", offsetof(struct wfs_options, stripes), 0 },
+  FUSE_OPT_END
+};
 
+/* Takes the image filename, the first argument that is not an option,
+ * out of the argument list. Everything else is passed on to FUSE.
+ */
 static int
-wfs_write(const char *path, const char *buf, size_t size, off_t offset,
-          struct fuse_file_info *fi)
+wfs_opt_proc(void *data, const char *arg, int key, struct fuse_args *outargs)
 {
-  return -ENOSYS;
+  struct wfs_options *options = data;
+
+  if (key != FUSE_OPT_KEY_NONOPT)
+    return 1;
+
+  options->n_nonopts++;
+  if (!options->filename)
+    {
+      options->filename = arg;
+      return 0;
+    }
+
+  return 1;
 }
 
-/*
- * FUSE setup
+/* Prints the statistics to stderr whenever SIGUSR1 is received, and
+ * takes a snapshot of the image on SIGUSR2. The signals must be blocked
+ * in all threads.
  */
+static void *
+wfs_signal_thread(void *data)
+{
+  wfs_image_t *image = data;
+  sigset_t set;
+  int sig;
+
+  sigemptyset(&set);
+  sigaddset(&set, SIGUSR1);
+  sigaddset(&set, SIGUSR2);
+
+  while (true)
+    {
+      if (sigwait(&set, &sig) != 0)
+        continue;
+
+      /* A snapshot holds all directory locks while it is taken, so it
+       * must not be cancelled halfway.
+       */
+      if (sig == SIGUSR2)
+        {
+          pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, NULL);
+          if (wfs_snapshot_create(image) == 0)
+            fprintf(stderr, "snapshot %u taken\n",
+                    image->snapshot_generation);
+          pthread_setcancelstate(PTHREAD_CANCEL_ENABLE, NULL);
+        }
+      else
+        wfs_stats_print(image, stderr);
+      fflush(stderr);
+    }
+
+  return NULL;
+}
 
-static struct fuse_operations wfs_oper =
+static void
+wfs_usage(const char *progname)
 {
-  .readdir   = wfs_readdir,
-  .mkdir     = wfs_mkdir,
-  .rmdir     = wfs_rmdir,
-  .getattr   = wfs_getattr,
-  .open      = wfs_open,
-  .create    = wfs_create,
-  .read      = wfs_read,
-  .write     = wfs_write
-};
+  printf("usage: %s [options] <image> <mountpoint>\n\n", progname);
+  printf("WFS options:\n"
+         "    -o io=pread|mmap|uring how to access the image (default: pread)\n"
+         "    -o preload             read the directory tree in the background\n"
+         "    -o snapshot            mount the snapshot of the image read-only\n"
+         "    -o defrag              defragment files in the background\n"
+         "    -o stripes=FILE[:FILE] devices of a striped image, in order\n"
+         "\n"
+         "Statistics can be read from /" WFS_STATS_NAME ", or are printed to\n"
+         "stderr on SIGUSR1. SIGUSR2 takes a snapshot, replacing the previous\n"
+         "one, which must not be mounted at that time.\n"
+         "\n");
+}
 
 int
 main(int argc, char *argv[])
 {
-  /* Count number of arguments without hyphens; excluding execname */
-  int count = 0;
-  for (int i = 1; i < argc; ++i)
-    if (argv[i][0] != '-')
-      count++;
+  struct fuse_args args = FUSE_ARGS_INIT(argc, argv);
+  struct wfs_options options = { NULL, 0, NULL, 0, 0, 0, NULL };
+  struct fuse_cmdline_opts opts;
+  int ret = -1;
+
+  /* Expect the image filename, followed by the mountpoint. */
+  if (fuse_opt_parse(&args, &options, wfs_opts, wfs_opt_proc) < 0
+      || fuse_parse_cmdline(&args, &opts) != 0)
+    return -1;
+
+  if (opts.show_help)
+    {
+      wfs_usage(argv[0]);
+      fuse_cmdline_help();
+      fuse_lowlevel_help();
+      ret = 0;
+      goto out_args;
+    }
+  else if (opts.show_version)
+    {
+      printf("FUSE library version %s\n", fuse_pkgversion());
+      fuse_lowlevel_version();
+      ret = 0;
+      goto out_args;
+    }
 
-  if (count != 2)
+  if (options.n_nonopts != 2 || !opts.mountpoint)
     {
       fprintf(stderr, "error: file and mountpoint arguments required.\n");
-      return -1;
+      goto out_args;
     }
 
-  /* Extract filename argument; we expect this to be the
-   * penultimate argument.
-   */
-  const char *filename = argv[argc-2];
-  argv[argc-2] = argv[argc-1];
-  argv[argc-1] = NULL;
-  argc--;
+  wfs_io_mode_t io_mode = WFS_IO_PREAD;
+  if (options.io && !strcmp(options.io, "mmap"))
+    io_mode = WFS_IO_MMAP;
+  else if (options.io && !strcmp(options.io, "uring"))
+    io_mode = WFS_IO_URING;
+  else if (options.io && strcmp(options.io, "pread"))
+    {
+      fprintf(stderr, "error: unknown I/O mode '%s'.\n", options.io);
+      goto out_args;
+    }
+
+  /* The devices of a striped image are separated by colons. */
+  char *stripes[WFS_MAX_STRIPES];
+  int n_stripes = 0;
+  for (char *name = options.stripes ? strtok(options.stripes, ":") : NULL;
+       name; name = strtok(NULL, ":"))
+    {
+      if (n_stripes == WFS_MAX_STRIPES - 1)
+        {
+          fprintf(stderr, "error: too many stripes.\n");
+          goto out_args;
+        }
+      stripes[n_stripes++] = name;
+    }
 
   /* Try to open the file system */
-  wfs_image_t *img = wfs_image_open(filename);
+  wfs_image_t *img = wfs_image_open_striped(options.filename, io_mode,
+                                            options.snapshot
+                                            ? WFS_OPEN_SNAPSHOT : 0,
+                                            stripes, n_stripes);
+  if (options.snapshot && img && fuse_opt_add_arg(&args, "-oro") != 0)
+    goto out_image;
   if (!img)
-    return -1;
+    goto out_args;
+
+  struct fuse_session *se = fuse_session_new(&args, &wfs_oper,
+                                             sizeof(wfs_oper), img);
+  if (!se)
+    goto out_image;
+
+  if (fuse_set_signal_handlers(se) != 0)
+    goto out_session;
+
+  if (fuse_session_mount(se, opts.mountpoint) != 0)
+    goto out_signals;
+
+  fuse_daemonize(opts.foreground);
+
+  /* The threads started by FUSE inherit the signal mask, so that
+   * SIGUSR1 and SIGUSR2 are only handled by the signal thread.
+   */
+  sigset_t set;
+  pthread_t signal_thread;
+  sigemptyset(&set);
+  sigaddset(&set, SIGUSR1);
+  sigaddset(&set, SIGUSR2);
+  pthread_sigmask(SIG_BLOCK, &set, NULL);
+  bool signal_thread_started =
+    pthread_create(&signal_thread, NULL, wfs_signal_thread, img) == 0;
+
+  if (wfs_notifier_start(se) < 0)
+    fprintf(stderr, "warning: could not start invalidation thread\n");
+
+  /* Like the other background threads, the block cache flusher would
+   * not survive fuse_daemonize().
+   */
+  wfs_bcache_start(img);
+
+  /* Requests are served while the tree is walked. */
+  if (options.preload)
+    wfs_preload_start(img);
+  if (options.defrag)
+    wfs_defrag_start(img);
 
   /* Start fuse main loop */
-  int ret = fuse_main(argc, argv, &wfs_oper, img);
+  if (opts.singlethread)
+    ret = fuse_session_loop(se);
+  else
+    ret = fuse_session_loop_mt(se, opts.clone_fd);
+
+  wfs_notifier_stop();
+
+  if (signal_thread_started)
+    {
+      pthread_cancel(signal_thread);
+      pthread_join(signal_thread, NULL);
+    }
+
+  fuse_session_unmount(se);
+out_signals:
+  fuse_remove_signal_handlers(se);
+out_session:
+  fuse_session_destroy(se);
+out_image:
   wfs_image_close(img);
+out_args:
+  free(opts.mountpoint);
+  fuse_opt_free_args(&args);
+  free(options.io);
+  free(options.stripes);
 
   return ret;
 }
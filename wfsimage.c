@@ -0,0 +1,3907 @@
+/* wfsimage -- Access to WFS file system images.
+ *
+ * Copyright (C) 2017  Leiden University, The Netherlands.
+ *
+ * Based on code from:
+ *
+ * S.M.A.C.K - An operating system kernel
+ * Copyright (C) 2010,2011,2013 Mattias Holm and Kristian Rietveld
+ * For licensing and a full list of authors of the kernel, see the files
+ * COPYING and AUTHORS.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "wfsimage.h"
+
+
+static void wfs_inode_table_clear(wfs_image_t *image);
+static int wfs_image_read_entry(wfs_image_t *image, uint16_t dir_block,
+                                int slot, wfs_file_entry_t *entry);
+static int wfs_image_write_entry(wfs_image_t *image, uint16_t dir_block,
+                                 int slot, const wfs_file_entry_t *entry);
+static bool wfs_image_has_pending(wfs_image_t *image, uint16_t dir_block);
+static void wfs_image_apply_pending(wfs_image_t *image, uint16_t dir_block,
+                                    wfs_file_entry_t *entries,
+                                    int n_entries);
+static int wfs_image_write_back(wfs_image_t *image);
+static void wfs_image_discard_entries(wfs_image_t *image,
+                                      uint16_t dir_block);
+static void wfs_dcache_remove(wfs_image_t *image, uint16_t dir_block,
+                              const char *name);
+static int wfs_image_check_dir(wfs_image_t *image, wfs_ino_t ino,
+                               const wfs_file_entry_t *dir);
+static void wfs_dir_index_fini(wfs_image_t *image);
+
+/*
+ * WFS image management
+ */
+
+/* Returns the file descriptor of the device that stores the byte at
+ * "offset" of the image, and stores the offset of the byte on that
+ * device in "device_offset". "size" is reduced so that the range starting
+ * at "offset" does not extend onto another device; for striped images
+ * it thus ends with the block. Other images are stored on "fd" only.
+ */
+int
+wfs_image_locate(wfs_image_t *image, off_t offset, size_t *size,
+                 off_t *device_offset)
+{
+  const wfs_layout_t *layout = &image->layout;
+
+  *device_offset = offset;
+  if (layout->n_stripes == 1)
+    return image->fd;
+
+  if (offset < layout->data_start)
+    {
+      if (*size > layout->data_start - offset)
+        *size = layout->data_start - offset;
+      return image->fd;
+    }
+
+  int block = (offset - layout->data_start) / layout->block_size;
+  uint32_t block_position = (offset - layout->data_start)
+      % layout->block_size;
+
+  if (*size > layout->block_size - block_position)
+    *size = layout->block_size - block_position;
+
+  *device_offset = wfs_get_stripe_offset(layout, block) + block_position;
+
+  return image->stripe_fds[wfs_get_stripe(layout, block)];
+}
+
+/* Transfers "size" bytes at "offset" of the image with pread or pwrite,
+ * one device at a time. Stops at the first short transfer, so that the
+ * result has the semantics of a single pread/pwrite.
+ */
+static ssize_t
+wfs_image_transfer(wfs_image_t *image, void *buf, size_t size,
+                   off_t offset, bool write)
+{
+  size_t done = 0;
+
+  while (done < size)
+    {
+      size_t n = size - done;
+      off_t device_offset;
+      int fd = wfs_image_locate(image, offset + done, &n, &device_offset);
+
+      ssize_t res = write
+          ? pwrite(fd, (char *)buf + done, n, device_offset)
+          : pread(fd, (char *)buf + done, n, device_offset);
+      if (res < 0)
+        return done > 0 ? done : -1;
+
+      done += res;
+      if (res < n)
+        break;
+    }
+
+  return done;
+}
+
+/* Splits the segments of a striped image at block boundaries, so that
+ * every piece is stored on a single device, and stores them in
+ * "pieces". These are taken from the arena of the calling thread and
+ * must be released with wfs_arena_release() if they differ from
+ * "segments". For other images, "pieces" is set to "segments". Returns
+ * the number of pieces, or -ENOMEM.
+ */
+int
+wfs_image_split_segments(wfs_image_t *image, const wfs_io_segment_t *segments,
+                         int n_segments, wfs_io_segment_t **pieces)
+{
+  if (image->layout.n_stripes == 1)
+    {
+      *pieces = (wfs_io_segment_t *)segments;
+      return n_segments;
+    }
+
+  /* The pieces are counted in a first pass and stored in a second. */
+  wfs_io_segment_t *res = NULL;
+  int n = 0;
+
+  for (int pass = 0; pass < 2; pass++)
+    {
+      if (pass == 1)
+        {
+          res = wfs_arena_alloc(image, n * sizeof(wfs_io_segment_t));
+          if (!res)
+            return -ENOMEM;
+          n = 0;
+        }
+
+      for (int i = 0; i < n_segments; i++)
+        {
+          size_t done = 0;
+
+          while (done < segments[i].size)
+            {
+              size_t size = segments[i].size - done;
+              off_t device_offset;
+
+              wfs_image_locate(image, segments[i].offset + done, &size,
+                               &device_offset);
+              if (res)
+                res[n] = (wfs_io_segment_t)
+                  {
+                    (char *)segments[i].buf + done, size,
+                    segments[i].offset + done
+                  };
+              n++;
+              done += size;
+            }
+        }
+    }
+
+  *pieces = res;
+
+  return n;
+}
+
+/* Reads from / writes to the image at the given offset, using the I/O
+ * mode the image was opened with. These have the semantics of
+ * pread/pwrite.
+ */
+ssize_t
+wfs_image_pread(wfs_image_t *image, void *buf, size_t size, off_t offset)
+{
+  if (image->snapshot)
+    {
+      ssize_t res = wfs_snapshot_pread(image, buf, size, offset);
+      if (res >= 0)
+        return res;
+    }
+
+  if (!image->map)
+    {
+      WFS_STATS_ADD(image, n_reads, 1);
+
+      ssize_t res = wfs_image_transfer(image, buf, size, offset, false);
+      if (res > 0)
+        WFS_STATS_ADD(image, n_bytes_read, res);
+
+      return res;
+    }
+
+  if (offset >= image->map_size)
+    return 0;
+  if (offset + size > image->map_size)
+    size = image->map_size - offset;
+
+  memcpy(buf, image->map + offset, size);
+  WFS_STATS_ADD(image, n_bytes_read, size);
+
+  return size;
+}
+
+ssize_t
+wfs_image_pwrite(wfs_image_t *image, const void *buf, size_t size,
+                 off_t offset)
+{
+  if (!image->map)
+    return wfs_image_transfer(image, (void *)buf, size, offset, true);
+
+  if (offset >= image->map_size)
+    {
+      errno = ENOSPC;
+      return -1;
+    }
+  if (offset + size > image->map_size)
+    size = image->map_size - offset;
+
+  memcpy(image->map + offset, buf, size);
+
+  return size;
+}
+
+/* Reads all "n_segments" segments completely. Returns 0 on success,
+ * error code otherwise.
+ */
+int
+wfs_image_read_segments(wfs_image_t *image, wfs_io_segment_t *segments,
+                        int n_segments)
+{
+#ifdef WFS_HAVE_IO_URING
+  if (image->io_mode == WFS_IO_URING)
+    {
+      int res = wfs_uring_transfer_segments(image, segments, n_segments,
+                                            false);
+      if (res == 0)
+        {
+          WFS_STATS_ADD(image, n_reads, n_segments);
+          for (int i = 0; i < n_segments; i++)
+            WFS_STATS_ADD(image, n_bytes_read, segments[i].size);
+        }
+      if (res != -ENOSYS)
+        return res;
+    }
+#endif
+
+  for (int i = 0; i < n_segments; i++)
+    {
+      size_t done = 0;
+
+      while (done < segments[i].size)
+        {
+          ssize_t res = wfs_image_pread(image,
+                                        (char *)segments[i].buf + done,
+                                        segments[i].size - done,
+                                        segments[i].offset + done);
+          if (res < 0 && errno == EINTR)
+            continue;
+          if (res <= 0)
+            return -EIO;
+
+          done += res;
+        }
+    }
+
+  return 0;
+}
+
+/* Writes all "n_segments" segments completely. Returns 0 on success,
+ * error code otherwise.
+ */
+int
+wfs_image_write_segments(wfs_image_t *image,
+                         const wfs_io_segment_t *segments, int n_segments)
+{
+#ifdef WFS_HAVE_IO_URING
+  if (image->io_mode == WFS_IO_URING)
+    {
+      int res = wfs_uring_transfer_segments(image, segments, n_segments,
+                                            true);
+      if (res != -ENOSYS)
+        return res;
+    }
+#endif
+
+  for (int i = 0; i < n_segments; i++)
+    {
+      size_t done = 0;
+
+      while (done < segments[i].size)
+        {
+          ssize_t res = wfs_image_pwrite(image,
+                                         (char *)segments[i].buf + done,
+                                         segments[i].size - done,
+                                         segments[i].offset + done);
+          if (res < 0 && errno == EINTR)
+            continue;
+          if (res <= 0)
+            return -EIO;
+
+          done += res;
+        }
+    }
+
+  return 0;
+}
+
+/* Hints that the segments will be read soon, so that the kernel starts
+ * reading them in the background. The "buf" members are not used.
+ */
+void
+wfs_image_prefetch(wfs_image_t *image, const wfs_io_segment_t *segments,
+                   int n_segments)
+{
+  long page_size = sysconf(_SC_PAGESIZE);
+
+#ifdef WFS_HAVE_IO_URING
+  if (image->io_mode == WFS_IO_URING
+      && wfs_uring_prefetch(image, segments, n_segments) == 0)
+    return;
+#endif
+
+  for (int i = 0; i < n_segments; i++)
+    {
+      if (!image->map)
+        {
+          for (size_t done = 0; done < segments[i].size; )
+            {
+              size_t size = segments[i].size - done;
+              off_t device_offset;
+              int fd = wfs_image_locate(image, segments[i].offset + done,
+                                        &size, &device_offset);
+
+              posix_fadvise(fd, device_offset, size, POSIX_FADV_WILLNEED);
+              done += size;
+            }
+          continue;
+        }
+
+      off_t start = segments[i].offset & ~(off_t)(page_size - 1);
+      off_t end = segments[i].offset + segments[i].size;
+      if (end > image->map_size)
+        end = image->map_size;
+
+      if (start < end)
+        posix_madvise(image->map + start, end - start, POSIX_MADV_WILLNEED);
+    }
+}
+
+/* Writes back all pending modifications to the image. If "wait" is set,
+ * does not return before the data has reached the disk. Returns 0 on
+ * success, error code otherwise.
+ */
+int
+wfs_image_sync(wfs_image_t *image, bool wait)
+{
+  /* The block table in the image is only overwritten once the journal
+   * holds the modifications, so that replaying it completes a sync that
+   * was interrupted.
+   */
+  int res = wfs_journal_commit(image);
+  if (res < 0)
+    return res;
+
+  res = wfs_image_write_back(image);
+  if (res < 0)
+    return res;
+
+  res = wfs_bcache_flush(image);
+  if (res < 0)
+    return res;
+
+  res = wfs_block_table_flush(image);
+  if (res < 0)
+    return res;
+
+  if (image->map)
+    {
+      if (msync(image->map, image->map_size, wait ? MS_SYNC : MS_ASYNC) < 0)
+        return -errno;
+    }
+  else if (wait)
+    {
+      for (uint32_t i = 0; i < image->layout.n_stripes; i++)
+        if (fsync(image->stripe_fds[i]) < 0)
+          return -errno;
+    }
+
+  return 0;
+}
+
+/* Writes the modifications made so far to the journal, see wfsjournal.c,
+ * and empties the journal once it has grown large. If "wait" is set,
+ * waits until the records are on disk. Must be called without holding
+ * any lock. Returns 0 on success, error code otherwise.
+ */
+static int
+wfs_image_commit(wfs_image_t *image, bool wait)
+{
+  int res = wait ? wfs_journal_commit(image) : wfs_journal_write(image);
+  if (res >= 0)
+    res = wfs_image_write_back(image);
+  if (res < 0 || !wfs_journal_needs_checkpoint(image))
+    return res;
+
+  for (int i = 0; i < WFS_N_DIR_LOCKS; i++)
+    pthread_rwlock_wrlock(&image->dir_locks[i]);
+
+  /* The journal is only needed once the image is synced again. */
+  res = wfs_journal_checkpoint(image);
+  if (res < 0)
+    fprintf(stderr, "warning: could not empty journal of '%s': %s\n",
+            image->filename, strerror(-res));
+
+  for (int i = WFS_N_DIR_LOCKS - 1; i >= 0; i--)
+    pthread_rwlock_unlock(&image->dir_locks[i]);
+
+  return 0;
+}
+
+void
+wfs_image_close(wfs_image_t *img)
+{
+  if (!img)
+    return;
+
+  wfs_preload_stop(img);
+  wfs_defrag_stop(img);
+  wfs_bcache_fini(img);
+
+  if (img->block_table)
+    {
+      bool synced = wfs_image_sync(img, true) == 0;
+      wfs_journal_close(img, synced);
+      if (!img->read_only)
+        wfs_sidecar_save(img);
+      free(img->block_table);
+    }
+
+  free(img->free_map);
+  wfs_snapshot_fini(img);
+
+  /* Entries still queued are recorded in the journal, which is kept
+   * when the image could not be synced.
+   */
+  for (int i = 0; i < WFS_PENDING_HASH_SIZE; i++)
+    while (img->pending[i])
+      {
+        wfs_pending_entry_t *pending = img->pending[i];
+        img->pending[i] = pending->next;
+        free(pending);
+      }
+
+  wfs_dcache_invalidate(img);
+  wfs_dir_index_fini(img);
+  wfs_inode_table_clear(img);
+
+  pthread_rwlock_destroy(&img->table_lock);
+  for (int i = 0; i < WFS_N_DIR_LOCKS; i++)
+    pthread_rwlock_destroy(&img->dir_locks[i]);
+  for (int i = 0; i < WFS_N_FILE_LOCKS; i++)
+    pthread_mutex_destroy(&img->file_locks[i]);
+  pthread_mutex_destroy(&img->dcache_lock);
+  pthread_mutex_destroy(&img->inodes_lock);
+  pthread_mutex_destroy(&img->bcache_lock);
+  pthread_mutex_destroy(&img->pending_lock);
+  pthread_cond_destroy(&img->bcache_cond);
+
+#ifdef WFS_HAVE_IO_URING
+  if (img->io_mode == WFS_IO_URING && img->urings)
+    wfs_uring_fini(img);
+#endif
+  pthread_mutex_destroy(&img->uring_lock);
+  wfs_arena_fini(img);
+  pthread_mutex_destroy(&img->arena_lock);
+
+  if (img->map)
+    munmap(img->map, img->map_size);
+
+  for (int i = 1; i < WFS_MAX_STRIPES; i++)
+    if (img->stripe_fds[i] >= 0)
+      close(img->stripe_fds[i]);
+
+  if (img->fd >= 0)
+    close(img->fd);
+
+  free(img);
+}
+
+/* Verifies whether an opened image is really an WFS file system image */
+static int
+wfs_check_image(wfs_image_t *img)
+{
+  struct stat buf;
+  uint32_t magic[WFS_MAGIC_SIZE / sizeof(uint32_t)];
+
+  if (fstat(img->fd, &buf) < 0)
+    {
+      fprintf(stderr, "error: file '%s': %s\n",
+              img->filename, strerror(errno));
+      return -1;
+    }
+
+  if (pread(img->fd, &magic, sizeof(magic), 0) != sizeof(magic)
+      || magic[0] != WFS_MAGIC0
+      || (magic[1] & ~WFS_FEATURES) != WFS_MAGIC1
+      || magic[2] != WFS_MAGIC2 || magic[3] != WFS_MAGIC3)
+    {
+      fprintf(stderr, "error: image '%s' has incorrect magic number\n",
+              img->filename);
+      return -1;
+    }
+
+  img->features = magic[1] & WFS_FEATURES;
+
+  wfs_superblock_t superblock =
+    {
+      .block_size = WFS_BLOCK_SIZE,
+      .n_blocks = WFS_N_BLOCKS
+    };
+
+  if ((img->features & WFS_FEATURE_SUPERBLOCK)
+      && pread(img->fd, &superblock, sizeof(superblock), WFS_MAGIC_SIZE)
+         != sizeof(superblock))
+    {
+      fprintf(stderr, "error: could not read superblock of '%s'\n",
+              img->filename);
+      return -1;
+    }
+
+  if (!wfs_layout_init(&img->layout, img->features,
+                       superblock.block_size, superblock.n_blocks))
+    {
+      fprintf(stderr, "error: image '%s' has unsupported geometry: "
+              "%u blocks of %u bytes\n", img->filename,
+              superblock.n_blocks, superblock.block_size);
+      return -1;
+    }
+
+  if (img->features & WFS_FEATURE_STRIPED)
+    {
+      if (!(img->features & WFS_FEATURE_SUPERBLOCK)
+          || superblock.n_stripes < 1
+          || superblock.n_stripes > WFS_MAX_STRIPES)
+        {
+          fprintf(stderr, "error: image '%s' has unsupported number of "
+                  "stripes\n", img->filename);
+          return -1;
+        }
+
+      img->layout.n_stripes = superblock.n_stripes;
+    }
+
+  img->image_id = superblock.image_id;
+
+  /* We can't check the size of devices, otherwise check the
+   * size of the image file.
+   */
+  if (!S_ISBLK(buf.st_mode))
+    {
+      if ((uint64_t)buf.st_size < wfs_get_size(&img->layout))
+        {
+          fprintf(stderr,
+                  "error: file '%s' too small to contain WFS file system\n",
+                  img->filename);
+          return -1;
+        }
+    }
+
+  return 0;
+}
+
+/* Reads the complete block table into memory, so that walking a block
+ * chain does not require any I/O.
+ */
+static int
+wfs_block_table_load(wfs_image_t *img)
+{
+  const wfs_layout_t *layout = &img->layout;
+
+  img->block_table = malloc(layout->block_table_size);
+  if (!img->block_table)
+    {
+      fprintf(stderr, "error: could not allocate block table\n");
+      return -1;
+    }
+
+  img->block_table_dirty_start = layout->n_blocks;
+  img->block_table_dirty_end = 0;
+
+  if (wfs_image_pread(img, img->block_table, layout->block_table_size,
+                      layout->block_table_start) != layout->block_table_size)
+    {
+      fprintf(stderr, "error: could not read block table of '%s'\n",
+              img->filename);
+      return -1;
+    }
+
+  if (img->features & WFS_FEATURE_EXTENTS)
+    wfs_block_table_decode(img->block_table, layout->n_blocks);
+
+  /* Such entries end the chain when it is walked; see wfsck for a full
+   * check of the chains.
+   */
+  int invalid = wfs_block_table_find_invalid(img->block_table,
+                                             layout->n_blocks);
+  if (invalid >= 0)
+    fprintf(stderr, "warning: block table of '%s' is corrupt, block %d "
+            "links to block %u\n", img->filename, invalid + 1,
+            img->block_table[invalid]);
+
+  return 0;
+}
+
+static inline bool
+wfs_free_map_test(wfs_image_t *image, int idx)
+{
+  return image->free_map[idx / WFS_FREE_MAP_WORD_BITS]
+      & (1u << (idx % WFS_FREE_MAP_WORD_BITS));
+}
+
+static inline void
+wfs_free_map_set(wfs_image_t *image, int idx, bool free)
+{
+  uint32_t bit = 1u << (idx % WFS_FREE_MAP_WORD_BITS);
+
+  if (free)
+    image->free_map[idx / WFS_FREE_MAP_WORD_BITS] |= bit;
+  else
+    image->free_map[idx / WFS_FREE_MAP_WORD_BITS] &= ~bit;
+}
+
+/* Builds the free space bitmap from the in-memory block table, a word
+ * at a time. Blocks used by the snapshot are not free, even if the table
+ * says so.
+ */
+static int
+wfs_free_map_build(wfs_image_t *img)
+{
+  img->free_map = calloc(wfs_free_map_get_n_words(img), sizeof(uint32_t));
+  if (!img->free_map)
+    {
+      fprintf(stderr, "error: could not allocate free space bitmap\n");
+      return -1;
+    }
+
+  img->n_free_blocks = 0;
+  img->alloc_hint = 0;
+
+  const int n_blocks = img->layout.n_blocks;
+  int i = 0;
+
+  for (; i + WFS_FREE_MAP_WORD_BITS <= n_blocks; i += WFS_FREE_MAP_WORD_BITS)
+    {
+      uint32_t word = wfs_block_table_match32(img->block_table + i,
+                                              WFS_BLOCK_FREE);
+      if (img->snapshot_map)
+        word &= ~img->snapshot_map[i / WFS_FREE_MAP_WORD_BITS];
+
+      img->free_map[i / WFS_FREE_MAP_WORD_BITS] = word;
+      img->n_free_blocks += __builtin_popcount(word);
+    }
+
+  for (; i < n_blocks; i++)
+    {
+      if (img->block_table[i] == WFS_BLOCK_FREE
+          && !wfs_snapshot_is_shared(img, i))
+        {
+          wfs_free_map_set(img, i, true);
+          img->n_free_blocks++;
+        }
+    }
+
+  return 0;
+}
+
+/* Maps the file system area of the image into memory. */
+static int
+wfs_image_map(wfs_image_t *img)
+{
+  img->map_size = wfs_get_size(&img->layout);
+  img->map = mmap(NULL, img->map_size,
+                  img->read_only ? PROT_READ : PROT_READ | PROT_WRITE,
+                  MAP_SHARED, img->fd, 0);
+  if (img->map == MAP_FAILED)
+    {
+      img->map = NULL;
+      fprintf(stderr, "error: could not map file '%s': %s\n",
+              img->filename, strerror(errno));
+      return -1;
+    }
+
+  return 0;
+}
+
+/* Returns an id for an image that is being created, which differs from
+ * that of an image created at another time or by another process.
+ */
+static uint32_t
+wfs_image_make_id(void)
+{
+  struct timespec now;
+
+  clock_gettime(CLOCK_REALTIME, &now);
+  uint32_t id = (uint32_t)now.tv_sec * 1000003u ^ (uint32_t)now.tv_nsec
+      ^ (uint32_t)getpid() << 16;
+
+  return id ? id : 1;
+}
+
+/* Creates an empty file system image "filename" of "n_blocks" blocks of
+ * "block_size" bytes, overwriting an existing file. A superblock is only
+ * written if the geometry differs from the original one. Returns 0 on
+ * success, -1 on failure.
+ */
+int
+wfs_image_format(const char *filename, uint32_t block_size,
+                 uint32_t n_blocks)
+{
+  uint32_t magic[WFS_MAGIC_SIZE / sizeof(uint32_t)] =
+    {
+      WFS_MAGIC0, WFS_MAGIC1, WFS_MAGIC2, WFS_MAGIC3
+    };
+  const wfs_superblock_t superblock =
+    {
+      .block_size = block_size,
+      .n_blocks = n_blocks,
+      .image_id = wfs_image_make_id()
+    };
+
+  if (block_size != WFS_BLOCK_SIZE || n_blocks != WFS_N_BLOCKS)
+    magic[1] |= WFS_FEATURE_SUPERBLOCK;
+
+  wfs_layout_t layout;
+  if (!wfs_layout_init(&layout, magic[1], block_size, n_blocks))
+    {
+      fprintf(stderr, "error: unsupported geometry: %u blocks of %u bytes\n",
+              n_blocks, block_size);
+      return -1;
+    }
+
+  int fd = open(filename, O_RDWR | O_CREAT | O_TRUNC, 0644);
+  if (fd < 0)
+    {
+      fprintf(stderr, "error: could not create file '%s': %s\n",
+              filename, strerror(errno));
+      return -1;
+    }
+
+  /* The entries and the block table are all zero, which marks every
+   * entry as empty and every block as free.
+   */
+  if (pwrite(fd, magic, sizeof(magic), 0) != sizeof(magic)
+      || ((magic[1] & WFS_FEATURE_SUPERBLOCK)
+          && pwrite(fd, &superblock, sizeof(superblock), WFS_MAGIC_SIZE)
+             != sizeof(superblock))
+      || ftruncate(fd, wfs_get_size(&layout)) < 0)
+    {
+      fprintf(stderr, "error: could not write file '%s': %s\n",
+              filename, strerror(errno));
+      close(fd);
+      return -1;
+    }
+
+  close(fd);
+
+  /* The journal, index file and snapshot of an image previously stored
+   * there no longer apply.
+   */
+  wfs_journal_remove(filename);
+  wfs_sidecar_remove(filename);
+  wfs_snapshot_remove(filename);
+
+  return 0;
+}
+
+/* Opens the devices "stripes" that hold the data blocks of a striped
+ * image, other than the image itself, in the order in which the image
+ * was created with them. Returns 0 on success, -1 on failure.
+ */
+static int
+wfs_image_open_stripes(wfs_image_t *img, char * const *stripes,
+                       int n_stripes)
+{
+  const wfs_layout_t *layout = &img->layout;
+
+  if (n_stripes != layout->n_stripes - 1)
+    {
+      fprintf(stderr, "error: image '%s' is striped over %u devices, "
+              "not %d\n", img->filename, layout->n_stripes, n_stripes + 1);
+      return -1;
+    }
+
+  if (n_stripes > 0 && img->io_mode == WFS_IO_MMAP)
+    {
+      fprintf(stderr, "error: striped image '%s' cannot be mapped\n",
+              img->filename);
+      return -1;
+    }
+
+  for (int i = 1; i <= n_stripes; i++)
+    {
+      const char *filename = stripes[i - 1];
+      struct stat buf;
+
+      img->stripe_fds[i] = open(filename, img->read_only ? O_RDONLY : O_RDWR);
+      if (img->stripe_fds[i] < 0 || fstat(img->stripe_fds[i], &buf) < 0)
+        {
+          fprintf(stderr, "error: could not open file '%s': %s\n",
+                  filename, strerror(errno));
+          return -1;
+        }
+
+      if (!S_ISBLK(buf.st_mode)
+          && (uint64_t)buf.st_size < wfs_get_stripe_size(layout, i))
+        {
+          fprintf(stderr, "error: file '%s' too small to contain stripe %d "
+                  "of '%s'\n", filename, i, img->filename);
+          return -1;
+        }
+    }
+
+  return 0;
+}
+
+/* Opens the image "filename", of which the data blocks are striped over
+ * the image and the devices "stripes", as specified by "flags".
+ */
+static wfs_image_t *
+wfs_image_open_common(const char *filename, wfs_io_mode_t io_mode,
+                      int flags, char * const *stripes, int n_stripes)
+{
+  const bool snapshot = flags & WFS_OPEN_SNAPSHOT;
+  const bool read_only = snapshot || (flags & WFS_OPEN_READ_ONLY);
+  wfs_image_t *img = malloc(sizeof(wfs_image_t));
+
+  pthread_rwlock_init(&img->table_lock, NULL);
+  for (int i = 0; i < WFS_N_DIR_LOCKS; i++)
+    pthread_rwlock_init(&img->dir_locks[i], NULL);
+  for (int i = 0; i < WFS_N_FILE_LOCKS; i++)
+    pthread_mutex_init(&img->file_locks[i], NULL);
+  pthread_mutex_init(&img->dcache_lock, NULL);
+  pthread_mutex_init(&img->inodes_lock, NULL);
+  pthread_mutex_init(&img->bcache_lock, NULL);
+  pthread_cond_init(&img->bcache_cond, NULL);
+  pthread_mutex_init(&img->pending_lock, NULL);
+  pthread_mutex_init(&img->uring_lock, NULL);
+  pthread_mutex_init(&img->arena_lock, NULL);
+
+  memset(img->dcache, 0, sizeof(img->dcache));
+  img->dcache_n_entries = 0;
+  memset(img->inodes, 0, sizeof(img->inodes));
+  memset(img->bcache_hash, 0, sizeof(img->bcache_hash));
+  img->bcache = NULL;
+  img->bcache_flusher_started = false;
+  img->bcache_lru_head = img->bcache_lru_tail = NULL;
+  img->bcache_unused = NULL;
+  img->bcache_n_dirty = 0;
+  img->bcache_seq = 0;
+  img->bcache_flush_buf = NULL;
+  img->urings = NULL;
+  img->arena_key_created = false;
+  img->arenas = NULL;
+  img->block_table = NULL;
+  memset(img->chain_generations, 0, sizeof(img->chain_generations));
+  img->free_map = NULL;
+  img->dir_index = NULL;
+  img->preload = NULL;
+  img->defrag = NULL;
+  img->snapshot_map = NULL;
+  img->snapshot_generation = 0;
+  img->snapshot = NULL;
+  img->read_only = read_only;
+  img->journal = NULL;
+  memset(img->pending, 0, sizeof(img->pending));
+  img->n_pending = 0;
+  memset(img->pending_dirs, 0, sizeof(img->pending_dirs));
+  img->features = 0;
+  memset(&img->stats, 0, sizeof(img->stats));
+  img->io_mode = io_mode;
+  img->map = NULL;
+  img->filename = filename;
+  for (int i = 0; i < WFS_MAX_STRIPES; i++)
+    img->stripe_fds[i] = -1;
+  img->fd = open(img->filename, read_only ? O_RDONLY : O_RDWR);
+  img->stripe_fds[0] = img->fd;
+  if (img->fd < 0)
+    {
+      fprintf(stderr, "error: could not open file '%s': %s\n",
+              img->filename, strerror(errno));
+      wfs_image_close(img);
+      return NULL;
+    }
+
+#ifndef WFS_HAVE_IO_URING
+  if (io_mode == WFS_IO_URING)
+    {
+      fprintf(stderr, "error: io_uring support is not available\n");
+      wfs_image_close(img);
+      return NULL;
+    }
+#endif
+
+  /* The index file describes the image itself, never its snapshot. The
+   * journal of an image that is opened read-only is not replayed.
+   */
+  if (wfs_check_image(img) < 0
+      || wfs_image_open_stripes(img, stripes, n_stripes) < 0
+      || wfs_arena_init(img) < 0
+      || (snapshot && wfs_snapshot_open(img) < 0)
+      || (io_mode == WFS_IO_MMAP && wfs_image_map(img) < 0)
+#ifdef WFS_HAVE_IO_URING
+      || (io_mode == WFS_IO_URING && wfs_uring_init(img) < 0)
+#endif
+      || wfs_block_table_load(img) < 0
+      || (!read_only && wfs_journal_open(img) < 0)
+      || (!snapshot && wfs_snapshot_init(img) < 0)
+      || ((snapshot || !wfs_sidecar_load(img))
+          && (wfs_free_map_build(img) < 0 || wfs_dir_index_init(img) < 0))
+      || (io_mode != WFS_IO_MMAP && wfs_bcache_init(img) < 0))
+    {
+      wfs_image_close(img);
+      return NULL;
+    }
+
+  return img;
+}
+
+wfs_image_t *
+wfs_image_open(const char *filename, wfs_io_mode_t io_mode)
+{
+  return wfs_image_open_common(filename, io_mode, 0, NULL, 0);
+}
+
+/* Opens the snapshot of the image "filename" read-only, see
+ * wfssnapshot.c. The image may be in use at the same time.
+ */
+wfs_image_t *
+wfs_image_open_snapshot(const char *filename, wfs_io_mode_t io_mode)
+{
+  return wfs_image_open_common(filename, io_mode, WFS_OPEN_SNAPSHOT, NULL,
+                               0);
+}
+
+/* Opens the image "filename", of which the data blocks are striped over
+ * the image and the "n_stripes" devices "stripes"; see wfs.h. With
+ * WFS_OPEN_SNAPSHOT in "flags" its snapshot is opened instead. With
+ * WFS_OPEN_READ_ONLY the image is opened read-only and neither its
+ * journal nor its index file is modified; the journal is not replayed,
+ * see wfs_journal_get_n_pending().
+ */
+wfs_image_t *
+wfs_image_open_striped(const char *filename, wfs_io_mode_t io_mode,
+                       int flags, char * const *stripes, int n_stripes)
+{
+  return wfs_image_open_common(filename, io_mode, flags, stripes,
+                               n_stripes);
+}
+
+/*
+ * Low-level file system routines
+ */
+
+void
+wfs_block_table_write(wfs_image_t *image, uint16_t idx, uint16_t value)
+{
+  if (idx >= image->layout.n_blocks)
+    return;
+
+  if (image->journal)
+    {
+      wfs_journal_log_table(image, idx, value);
+
+      /* Queued entries of a directory that is removed must not reach
+       * the block once it is reused.
+       */
+      if (value == WFS_BLOCK_FREE)
+        wfs_image_discard_entries(image, idx + 1);
+    }
+
+  /* Blocks used by the snapshot stay allocated when they are freed. The
+   * free map does not exist yet while the journal is replayed.
+   */
+  if ((image->block_table[idx] == WFS_BLOCK_FREE) != (value == WFS_BLOCK_FREE)
+      && image->free_map && !wfs_snapshot_is_shared(image, idx))
+    {
+      wfs_free_map_set(image, idx, value == WFS_BLOCK_FREE);
+      image->n_free_blocks += value == WFS_BLOCK_FREE ? 1 : -1;
+    }
+
+  image->block_table[idx] = value;
+
+  if (idx < image->block_table_dirty_start)
+    image->block_table_dirty_start = idx;
+  if (idx + 1 > image->block_table_dirty_end)
+    image->block_table_dirty_end = idx + 1;
+}
+
+/* Writes the dirty range of the in-memory block table back to the
+ * image. Unlike the other block table functions, this takes table_lock
+ * itself. Returns 0 on success, error code otherwise.
+ */
+int
+wfs_block_table_flush(wfs_image_t *image)
+{
+  int res = 0;
+
+  pthread_rwlock_wrlock(&image->table_lock);
+
+  uint16_t *table = image->block_table;
+  int start = image->block_table_dirty_start;
+  int end = image->block_table_dirty_end;
+  uint16_t *encoded = NULL;
+
+  /* In extent images, a modification may change the extent that covers
+   * it, so the runs around the dirty range are encoded again. The entry
+   * following the range may have become the start of an extent as well.
+   */
+  if (start < end && (image->features & WFS_FEATURE_EXTENTS))
+    {
+      while (start > 0 && table[start - 1] == start + 1)
+        start--;
+      while (end < image->layout.n_blocks && table[end - 1] == end + 1)
+        end++;
+      if (end < image->layout.n_blocks)
+        end++;
+
+      encoded = malloc((end - start) * sizeof(uint16_t));
+      if (!encoded)
+        res = -ENOMEM;
+      else
+        wfs_block_table_encode(table, image->layout.n_blocks, start, end,
+                               encoded);
+    }
+
+  if (start < end && res == 0)
+    {
+      size_t len = (end - start) * sizeof(uint16_t);
+      if (wfs_image_pwrite(image, encoded ? encoded : &table[start], len,
+                           image->layout.block_table_start
+                           + start * sizeof(uint16_t))
+          != len)
+        res = -EIO;
+      else
+        {
+          image->block_table_dirty_start = image->layout.n_blocks;
+          image->block_table_dirty_end = 0;
+        }
+    }
+
+  pthread_rwlock_unlock(&image->table_lock);
+
+  free(encoded);
+
+  return res;
+}
+
+/* Read the block chain to determine the disk block that follows the
+ * current block.
+ */
+uint16_t
+wfs_get_next_block(wfs_image_t *image, uint16_t current_block)
+{
+  uint16_t block = 0;
+
+  if (current_block == WFS_BLOCK_EOF)
+    return current_block;
+
+  if (current_block - 1 >= image->layout.n_blocks)
+    return WFS_BLOCK_EOF;
+
+  WFS_STATS_ADD(image, n_table_lookups, 1);
+  block = wfs_block_table_read(image, current_block - 1);
+
+  return block;
+}
+
+/* Returns the index of the first free block in [idx, end), or -1. The
+ * bitmap is scanned a word at a time using find-first-set.
+ */
+static int
+wfs_free_map_find(wfs_image_t *image, int idx, int end)
+{
+  for (int w = idx / WFS_FREE_MAP_WORD_BITS;
+       w * WFS_FREE_MAP_WORD_BITS < end; w++)
+    {
+      uint32_t word = image->free_map[w];
+      if (w == idx / WFS_FREE_MAP_WORD_BITS)
+        word &= ~0u << (idx % WFS_FREE_MAP_WORD_BITS);
+
+      if (word)
+        {
+          int found = w * WFS_FREE_MAP_WORD_BITS
+              + __builtin_ffs((int)word) - 1;
+          return found < end ? found : -1;
+        }
+    }
+
+  return -1;
+}
+
+/* Returns the number of consecutive free blocks starting at index
+ * "idx", up to "max".
+ */
+static int
+wfs_free_map_run_length(wfs_image_t *image, int idx, int max)
+{
+  int len = 0;
+
+  while (len < max && idx + len < image->layout.n_blocks)
+    {
+      int i = idx + len;
+      uint32_t used = ~image->free_map[i / WFS_FREE_MAP_WORD_BITS]
+          >> (i % WFS_FREE_MAP_WORD_BITS);
+
+      if (used)
+        {
+          len += __builtin_ffs((int)used) - 1;
+          break;
+        }
+
+      len += WFS_FREE_MAP_WORD_BITS - i % WFS_FREE_MAP_WORD_BITS;
+    }
+
+  if (len > max)
+    len = max;
+  if (idx + len > image->layout.n_blocks)
+    len = image->layout.n_blocks - idx;
+
+  return len;
+}
+
+/* Allocates up to "n" physically adjacent blocks, chained in order and
+ * terminated with WFS_BLOCK_EOF. The run directly following block
+ * "goal" is preferred, so that a file that is extended stays
+ * contiguous; otherwise the first run of "n" free blocks after the
+ * previous allocation is used, or the longest run found if there is
+ * none. The first block is stored in "first". Returns the number of
+ * blocks allocated, 0 if the file system is full. The caller must hold
+ * table_lock exclusively.
+ */
+int
+wfs_block_alloc_run(wfs_image_t *image, uint16_t goal, int n,
+                    uint16_t *first)
+{
+  int start = -1, len = 0;
+
+  if (n <= 0 || image->n_free_blocks == 0)
+    return 0;
+
+  /* Block "goal" has index goal - 1, so the one following it has index
+   * "goal".
+   */
+  if (goal != WFS_BLOCK_FREE && goal < image->layout.n_blocks
+      && wfs_free_map_test(image, goal))
+    {
+      start = goal;
+      len = wfs_free_map_run_length(image, goal, n);
+    }
+
+  int pos = image->alloc_hint;
+  int scanned = 0;
+
+  while (len < n && scanned < image->layout.n_blocks)
+    {
+      if (pos >= image->layout.n_blocks)
+        pos = 0;
+
+      int idx = wfs_free_map_find(image, pos, image->layout.n_blocks);
+      if (idx < 0)
+        {
+          scanned += image->layout.n_blocks - pos;
+          pos = 0;
+          continue;
+        }
+
+      int run = wfs_free_map_run_length(image, idx, n);
+      if (run > len)
+        {
+          start = idx;
+          len = run;
+        }
+
+      scanned += idx - pos + run;
+      pos = idx + run;
+    }
+
+  if (start < 0)
+    return 0;
+
+  for (int i = start; i < start + len; i++)
+    wfs_block_table_write(image, i,
+                          i + 1 < start + len ? i + 2 : WFS_BLOCK_EOF);
+
+  image->alloc_hint = (start + len) % image->layout.n_blocks;
+  *first = start + 1;
+
+  return len;
+}
+
+/* Allocates a single block, terminated with WFS_BLOCK_EOF. Returns
+ * WFS_BLOCK_FREE if the file system is full.
+ */
+uint16_t
+wfs_block_alloc(wfs_image_t *image, uint16_t goal)
+{
+  uint16_t block;
+
+  if (wfs_block_alloc_run(image, goal, 1, &block) != 1)
+    return WFS_BLOCK_FREE;
+
+  return block;
+}
+
+/* Returns the generation of the chain starting at "start_block", which
+ * the caller increments after modifying the chain. The caller must hold
+ * table_lock, exclusively for the modification.
+ */
+static unsigned int *
+wfs_chain_generation(wfs_image_t *image, uint16_t start_block)
+{
+  return &image->chain_generations[start_block % WFS_N_CHAIN_GENERATIONS];
+}
+
+/* Frees all blocks of the chain starting at "block". The caller must
+ * hold table_lock exclusively.
+ */
+void
+wfs_block_free_chain(wfs_image_t *image, uint16_t block)
+{
+  if (block != WFS_BLOCK_FREE && block < WFS_BLOCK_EOF)
+    (*wfs_chain_generation(image, block))++;
+
+  for (int i = 0; i < image->layout.n_blocks; i++)
+    {
+      if (block == WFS_BLOCK_FREE || block >= WFS_BLOCK_EOF)
+        break;
+
+      uint16_t next = wfs_get_next_block(image, block);
+      wfs_block_table_write(image, block - 1, WFS_BLOCK_FREE);
+      wfs_bcache_discard(image, block);
+      block = next;
+    }
+}
+
+
+/*
+ * Open file handles
+ */
+
+void
+wfs_file_handle_init(wfs_file_handle_t *fh, const wfs_file_entry_t *entry)
+{
+  memset(fh, 0, sizeof(wfs_file_handle_t));
+  pthread_mutex_init(&fh->lock, NULL);
+  fh->start_block = entry->start_block;
+}
+
+void
+wfs_file_handle_fini(wfs_file_handle_t *fh)
+{
+  pthread_mutex_destroy(&fh->lock);
+  free(fh->blocks);
+  fh->blocks = NULL;
+  fh->n_blocks = fh->n_allocated = 0;
+}
+
+/* Makes sure the cached chain of "fh" is still valid for "entry". This
+ * and the mapping functions below require the caller to hold the lock
+ * of "fh" and table_lock.
+ */
+void
+wfs_file_handle_validate(wfs_image_t *image, wfs_file_handle_t *fh,
+                         const wfs_file_entry_t *entry)
+{
+  unsigned int generation = *wfs_chain_generation(image, entry->start_block);
+  if (fh->generation == generation && fh->start_block == entry->start_block)
+    return;
+
+  fh->start_block = entry->start_block;
+  fh->generation = generation;
+  fh->n_blocks = 0;
+  fh->complete = false;
+}
+
+/* Appends "block" to the cached chain of "fh". Returns false if memory
+ * is exhausted.
+ */
+static bool
+wfs_file_handle_push(wfs_file_handle_t *fh, uint16_t block)
+{
+  if (fh->n_blocks == fh->n_allocated)
+    {
+      int n_allocated = fh->n_allocated ? fh->n_allocated * 2 : 16;
+      uint16_t *blocks = realloc(fh->blocks, n_allocated * sizeof(uint16_t));
+      if (!blocks)
+        return false;
+
+      fh->blocks = blocks;
+      fh->n_allocated = n_allocated;
+    }
+
+  fh->blocks[fh->n_blocks++] = block;
+
+  return true;
+}
+
+/* Returns the physical block number of logical block "n" of the file,
+ * or WFS_BLOCK_EOF if the chain ends before that block. The chain is
+ * only walked beyond the part that was visited before.
+ */
+uint16_t
+wfs_file_handle_map(wfs_image_t *image, wfs_file_handle_t *fh, int n)
+{
+  if (n < fh->n_blocks)
+    return fh->blocks[n];
+
+  if (fh->complete)
+    return WFS_BLOCK_EOF;
+
+  uint16_t block;
+  if (fh->n_blocks == 0)
+    block = fh->start_block;
+  else
+    block = wfs_get_next_block(image, fh->blocks[fh->n_blocks - 1]);
+
+  while (fh->n_blocks <= n)
+    {
+      if (block == WFS_BLOCK_FREE || block >= WFS_BLOCK_EOF
+          || fh->n_blocks >= image->layout.n_blocks)
+        {
+          fh->complete = true;
+          return WFS_BLOCK_EOF;
+        }
+
+      if (!wfs_file_handle_push(fh, block))
+        return WFS_BLOCK_EOF;
+
+      WFS_STATS_ADD(image, n_chain_hops, 1);
+
+      if (fh->n_blocks <= n)
+        block = wfs_get_next_block(image, block);
+    }
+
+  return fh->blocks[n];
+}
+
+/* Given an offset within a file, return the block number in which
+ * this offset is located and the corresponding position within that
+ * block (block_position).
+ */
+uint16_t
+wfs_get_current_block(wfs_image_t *image, wfs_file_handle_t *fh,
+                      off_t off, uint16_t *block_position)
+{
+  uint16_t block = wfs_file_handle_map(image, fh,
+                                       off / image->layout.block_size);
+
+  if (block_position)
+    *block_position = off % image->layout.block_size;
+
+  return block;
+}
+
+/* Makes the chain of the file referenced by "fh" at least "n" blocks
+ * long, allocating the new blocks as contiguous runs directly after the
+ * current last block where possible. The new blocks are added to the
+ * cached chain. The caller must hold the lock of "fh" and table_lock
+ * exclusively. Returns 0 on success, error code otherwise.
+ */
+static int
+wfs_file_handle_extend(wfs_image_t *image, wfs_file_handle_t *fh, int n)
+{
+  if (n <= 0 || wfs_file_handle_map(image, fh, n - 1) != WFS_BLOCK_EOF)
+    return 0;
+
+  /* Either the chain has been walked completely, or memory ran out. */
+  if (fh->n_blocks == 0)
+    return -EIO;
+  if (!fh->complete)
+    return -ENOMEM;
+
+  while (fh->n_blocks < n)
+    {
+      uint16_t last = fh->blocks[fh->n_blocks - 1];
+      uint16_t first;
+
+      int len = wfs_block_alloc_run(image, last, n - fh->n_blocks, &first);
+      if (len == 0)
+        return -ENOSPC;
+
+      wfs_block_table_write(image, last - 1, first);
+      (*wfs_chain_generation(image, fh->start_block))++;
+      for (int i = 0; i < len; i++)
+        {
+          if (!wfs_file_handle_push(fh, first + i))
+            {
+              fh->n_blocks = 0;
+              fh->complete = false;
+              return -ENOMEM;
+            }
+        }
+    }
+
+  /* The handle already reflects the modifications. */
+  fh->generation = *wfs_chain_generation(image, fh->start_block);
+
+  return 0;
+}
+
+/* Transfers file data through the block cache, if enabled. */
+static int
+wfs_file_transfer_segments(wfs_image_t *image, wfs_io_segment_t *segments,
+                           int n_segments, bool write)
+{
+  if (write)
+    {
+      if (image->bcache)
+        return wfs_bcache_write_segments(image, segments, n_segments);
+
+      return wfs_image_write_segments(image, segments, n_segments);
+    }
+
+  if (!image->bcache)
+    return wfs_image_read_segments(image, segments, n_segments);
+
+  unsigned int seq;
+  do
+    {
+      seq = wfs_bcache_begin_read(image);
+
+      int res = wfs_image_read_segments(image, segments, n_segments);
+      if (res < 0)
+        return res;
+    }
+  while (!wfs_bcache_end_read(image, segments, n_segments, seq));
+
+  return 0;
+}
+
+/* Transfers "size" bytes between "buf" and the file referenced by "fh",
+ * starting at "offset". The caller must hold the lock of "fh" and must
+ * have made sure the chain covers the range. Physically adjacent blocks
+ * are merged into a single segment, so that a contiguous file is
+ * transferred with one request per run.
+ */
+static int
+wfs_file_transfer(wfs_image_t *image, const wfs_file_entry_t *entry,
+                  wfs_file_handle_t *fh, char *buf, size_t size,
+                  off_t offset, bool write)
+{
+  uint16_t block_position;
+
+  pthread_rwlock_rdlock(&image->table_lock);
+  wfs_file_handle_validate(image, fh, entry);
+
+  int n = offset / image->layout.block_size;
+  uint16_t block = wfs_get_current_block(image, fh, offset, &block_position);
+
+  wfs_io_segment_t segments[WFS_MAX_SEGMENTS];
+  int n_segments = 0;
+  uint16_t prev_block = WFS_BLOCK_FREE;
+  size_t remaining = size;
+  int res = 0;
+
+  while (remaining > 0)
+    {
+      if (block == WFS_BLOCK_FREE || block >= WFS_BLOCK_EOF)
+        {
+          res = -EIO;
+          break;
+        }
+
+      size_t transfer = image->layout.block_size - block_position;
+      if (transfer > remaining)
+        transfer = remaining;
+
+      if (n_segments > 0 && block == prev_block + 1)
+        segments[n_segments - 1].size += transfer;
+      else
+        {
+          if (n_segments == WFS_MAX_SEGMENTS)
+            {
+              /* Do not hold table_lock while waiting for I/O. */
+              pthread_rwlock_unlock(&image->table_lock);
+              res = wfs_file_transfer_segments(image, segments, n_segments,
+                                               write);
+              pthread_rwlock_rdlock(&image->table_lock);
+              if (res < 0)
+                break;
+
+              wfs_file_handle_validate(image, fh, entry);
+              n_segments = 0;
+            }
+
+          segments[n_segments].buf = buf + (size - remaining);
+          segments[n_segments].size = transfer;
+          segments[n_segments].offset =
+              wfs_get_block_offset(&image->layout, block - 1)
+              + block_position;
+          n_segments++;
+        }
+
+      remaining -= transfer;
+      prev_block = block;
+      block_position = 0;
+
+      if (remaining > 0)
+        block = wfs_file_handle_map(image, fh, ++n);
+    }
+
+  pthread_rwlock_unlock(&image->table_lock);
+
+  if (res == 0 && n_segments > 0)
+    res = wfs_file_transfer_segments(image, segments, n_segments, write);
+
+  return res;
+}
+
+/* Writes "size" zero bytes at "offset", used to fill holes. */
+static int
+wfs_file_zero(wfs_image_t *image, const wfs_file_entry_t *entry,
+              wfs_file_handle_t *fh, size_t size, off_t offset)
+{
+  if (size == 0)
+    return 0;
+
+  char *zeroes = calloc(1, size);
+  if (!zeroes)
+    return -ENOMEM;
+
+  int res = wfs_file_transfer(image, entry, fh, zeroes, size, offset, true);
+  free(zeroes);
+
+  return res;
+}
+
+/* Replaces the blocks of the file identified by "ino" holding the "size"
+ * bytes at "offset" that are used by the snapshot with copies, so that
+ * they can be written; see wfssnapshot.c. A copy is linked into the
+ * chain in place of the original only once it holds the data, so that
+ * concurrent readers see either block. The entry is updated if the
+ * first block is replaced. The caller must hold the lock of "fh" and
+ * the lock of the directory exclusively, and must have made sure the
+ * chain covers the range. Returns 0 on success, error code otherwise.
+ */
+static int
+wfs_file_unshare(wfs_image_t *image, wfs_ino_t ino, wfs_file_handle_t *fh,
+                 wfs_file_entry_t *entry, size_t size, off_t offset)
+{
+  const uint32_t block_size = image->layout.block_size;
+
+  if (!image->snapshot_map || size == 0)
+    return 0;
+
+  int first = offset / block_size;
+  int last = (offset + size - 1) / block_size;
+  uint16_t goal = WFS_BLOCK_FREE;
+  uint8_t *buf = NULL;
+  int res = 0;
+
+  for (int n = first; n <= last && res == 0; n++)
+    {
+      pthread_rwlock_wrlock(&image->table_lock);
+      wfs_file_handle_validate(image, fh, entry);
+
+      uint16_t block = wfs_file_handle_map(image, fh, n);
+      uint16_t copy = WFS_BLOCK_FREE;
+      if (block == WFS_BLOCK_FREE || block >= WFS_BLOCK_EOF)
+        res = -EIO;
+      else if (wfs_snapshot_is_shared(image, block - 1))
+        {
+          if (goal == WFS_BLOCK_FREE && n > 0)
+            goal = wfs_file_handle_map(image, fh, n - 1);
+          copy = wfs_block_alloc(image, goal);
+          if (copy == WFS_BLOCK_FREE)
+            res = -ENOSPC;
+        }
+
+      pthread_rwlock_unlock(&image->table_lock);
+
+      if (copy == WFS_BLOCK_FREE)
+        continue;
+
+      if (!buf && !(buf = malloc(block_size)))
+        res = -ENOMEM;
+
+      /* Only this thread writes to the file, so the shared block does
+       * not change until the copy replaces it.
+       */
+      wfs_io_segment_t segment =
+        {
+          buf, block_size,
+          wfs_get_block_offset(&image->layout, block - 1)
+        };
+      if (res == 0)
+        res = wfs_file_transfer_segments(image, &segment, 1, false);
+      segment.offset = wfs_get_block_offset(&image->layout, copy - 1);
+      if (res == 0)
+        res = wfs_file_transfer_segments(image, &segment, 1, true);
+
+      pthread_rwlock_wrlock(&image->table_lock);
+      if (res < 0)
+        {
+          wfs_block_table_write(image, copy - 1, WFS_BLOCK_FREE);
+          wfs_bcache_discard(image, copy);
+        }
+      else
+        {
+          wfs_block_table_write(image, copy - 1,
+                                wfs_get_next_block(image, block));
+          if (n > 0)
+            wfs_block_table_write(image, wfs_file_handle_map(image, fh, n - 1)
+                                  - 1, copy);
+          (*wfs_chain_generation(image, fh->start_block))++;
+        }
+      pthread_rwlock_unlock(&image->table_lock);
+
+      /* The first block is referenced by the entry instead, which must
+       * be updated before the original block leaves the chain.
+       */
+      if (res == 0 && n == 0)
+        {
+          entry->start_block = copy;
+          res = wfs_image_write_entry(image, wfs_ino_get_dir_block(ino),
+                                      wfs_ino_get_slot(ino), entry);
+          if (res == 0)
+            wfs_dcache_remove(image, wfs_ino_get_dir_block(ino),
+                              entry->filename);
+          else
+            {
+              entry->start_block = block;
+              pthread_rwlock_wrlock(&image->table_lock);
+              wfs_block_table_write(image, copy - 1, WFS_BLOCK_FREE);
+              wfs_bcache_discard(image, copy);
+              pthread_rwlock_unlock(&image->table_lock);
+            }
+        }
+
+      if (res < 0)
+        continue;
+
+      pthread_rwlock_wrlock(&image->table_lock);
+      wfs_block_table_write(image, block - 1, WFS_BLOCK_FREE);
+      wfs_bcache_discard(image, block);
+      pthread_rwlock_unlock(&image->table_lock);
+
+      WFS_STATS_ADD(image, n_snapshot_copies, 1);
+      goal = copy;
+    }
+
+  free(buf);
+
+  return res;
+}
+
+/* Detects sequential reads through "fh" and has the blocks that are
+ * likely to be read next fetched in the background, while the reply to
+ * the current read is on its way. The window is doubled with every
+ * sequential read. The caller must hold the lock of "fh".
+ */
+static void
+wfs_file_readahead(wfs_image_t *image, const wfs_file_entry_t *entry,
+                   wfs_file_handle_t *fh, off_t offset, size_t size)
+{
+  bool sequential = offset == fh->ra_next;
+
+  fh->ra_next = offset + size;
+  if (!sequential)
+    {
+      fh->ra_window = 0;
+      fh->ra_end = 0;
+      return;
+    }
+
+  fh->ra_window = fh->ra_window ? fh->ra_window * 2 : WFS_READAHEAD_MIN;
+  if (fh->ra_window > WFS_READAHEAD_MAX)
+    fh->ra_window = WFS_READAHEAD_MAX;
+
+  int current = (offset + size) / image->layout.block_size;
+  int n_file_blocks = (wfs_file_entry_get_size(entry)
+                       + image->layout.block_size - 1)
+      / image->layout.block_size;
+
+  /* Readahead is only issued again once half of the window has been
+   * consumed, so that it happens in large batches.
+   */
+  if (fh->ra_end - current > fh->ra_window / 2)
+    return;
+
+  int start = current > fh->ra_end ? current : fh->ra_end;
+  int end = current + fh->ra_window;
+  if (end > n_file_blocks)
+    end = n_file_blocks;
+  if (start >= end)
+    return;
+
+  /* The blocks are looked up in the cached chain, no I/O is done. */
+  wfs_io_segment_t segments[WFS_MAX_SEGMENTS];
+  int n_segments = 0;
+  uint16_t prev_block = WFS_BLOCK_FREE;
+
+  pthread_rwlock_rdlock(&image->table_lock);
+  wfs_file_handle_validate(image, fh, entry);
+
+  int n;
+  for (n = start; n < end; n++)
+    {
+      uint16_t block = wfs_file_handle_map(image, fh, n);
+      if (block == WFS_BLOCK_FREE || block >= WFS_BLOCK_EOF)
+        break;
+
+      if (n_segments > 0 && block == prev_block + 1)
+        segments[n_segments - 1].size += image->layout.block_size;
+      else if (n_segments == WFS_MAX_SEGMENTS)
+        break;
+      else
+        {
+          segments[n_segments].buf = NULL;
+          segments[n_segments].size = image->layout.block_size;
+          segments[n_segments].offset =
+              wfs_get_block_offset(&image->layout, block - 1);
+          n_segments++;
+        }
+
+      prev_block = block;
+    }
+
+  pthread_rwlock_unlock(&image->table_lock);
+
+  fh->ra_end = n;
+  wfs_image_prefetch(image, segments, n_segments);
+}
+
+/* Reads up to "size" bytes at "offset" from the file described by
+ * "entry". "fh" may be NULL, in which case the chain is walked without
+ * being cached. Returns the number of bytes read, or an error code.
+ */
+ssize_t
+wfs_file_read(wfs_image_t *image, const wfs_file_entry_t *entry,
+              wfs_file_handle_t *fh, char *buf, size_t size, off_t offset)
+{
+  const size_t current_size = wfs_file_entry_get_size(entry);
+  if (offset > current_size)
+    return -EINVAL;
+
+  if (offset + size > current_size)
+    size = current_size - offset;
+
+  if (size == 0)
+    return 0;
+
+  /* The data of an inline file was read along with its entry. */
+  if (wfs_file_entry_is_inline(entry))
+    {
+      memcpy(buf, wfs_file_entry_get_inline_data(entry) + offset, size);
+      return size;
+    }
+
+  wfs_file_handle_t local_fh;
+  if (!fh)
+    {
+      fh = &local_fh;
+      wfs_file_handle_init(fh, entry);
+    }
+
+  pthread_mutex_lock(&fh->lock);
+  int res = wfs_file_transfer(image, entry, fh, buf, size, offset, false);
+  if (res == 0 && fh != &local_fh)
+    wfs_file_readahead(image, entry, fh, offset, size);
+  pthread_mutex_unlock(&fh->lock);
+
+  if (fh == &local_fh)
+    wfs_file_handle_fini(fh);
+
+  if (res < 0)
+    return res;
+
+  return size;
+}
+
+/* Stores the extents of the image holding "size" bytes at "offset" of
+ * the file referenced by "fh" in "segments", without transferring any
+ * data. The caller must hold the lock of "fh". Returns -EAGAIN if more
+ * than "max_segments" extents are needed.
+ */
+static int
+wfs_file_map_segments(wfs_image_t *image, const wfs_file_entry_t *entry,
+                      wfs_file_handle_t *fh, size_t size, off_t offset,
+                      wfs_io_segment_t *segments, int max_segments,
+                      int *n_segments)
+{
+  uint16_t block_position;
+
+  pthread_rwlock_rdlock(&image->table_lock);
+  wfs_file_handle_validate(image, fh, entry);
+
+  int n = offset / image->layout.block_size;
+  uint16_t block = wfs_get_current_block(image, fh, offset, &block_position);
+  uint16_t prev_block = WFS_BLOCK_FREE;
+  size_t remaining = size;
+  int res = 0;
+
+  *n_segments = 0;
+  while (remaining > 0)
+    {
+      if (block == WFS_BLOCK_FREE || block >= WFS_BLOCK_EOF)
+        {
+          res = -EIO;
+          break;
+        }
+
+      size_t transfer = image->layout.block_size - block_position;
+      if (transfer > remaining)
+        transfer = remaining;
+
+      if (*n_segments > 0 && block == prev_block + 1)
+        segments[*n_segments - 1].size += transfer;
+      else if (*n_segments == max_segments)
+        {
+          res = -EAGAIN;
+          break;
+        }
+      else
+        {
+          segments[*n_segments].buf = NULL;
+          segments[*n_segments].size = transfer;
+          segments[*n_segments].offset =
+              wfs_get_block_offset(&image->layout, block - 1)
+              + block_position;
+          (*n_segments)++;
+        }
+
+      remaining -= transfer;
+      prev_block = block;
+      block_position = 0;
+
+      if (remaining > 0)
+        block = wfs_file_handle_map(image, fh, ++n);
+    }
+
+  pthread_rwlock_unlock(&image->table_lock);
+
+  return res;
+}
+
+/* Like wfs_file_read(), but instead of reading the data, stores up to
+ * "max_segments" extents of the image that hold it in "segments", so
+ * that the caller can have it transferred without copying. The number
+ * of extents is stored in "n_segments". Returns the number of bytes
+ * covered, -EAGAIN if the data has to be read with wfs_file_read()
+ * because the image does not contain all of it, it is stored in the
+ * entry or more extents are needed, or another error code.
+ */
+ssize_t
+wfs_file_read_segments(wfs_image_t *image, const wfs_file_entry_t *entry,
+                       wfs_file_handle_t *fh, size_t size, off_t offset,
+                       wfs_io_segment_t *segments, int max_segments,
+                       int *n_segments)
+{
+  const size_t current_size = wfs_file_entry_get_size(entry);
+  if (offset > current_size)
+    return -EINVAL;
+
+  if (offset + size > current_size)
+    size = current_size - offset;
+
+  *n_segments = 0;
+  if (size == 0)
+    return 0;
+
+  if (wfs_file_entry_is_inline(entry))
+    return -EAGAIN;
+
+  wfs_file_handle_t local_fh;
+  if (!fh)
+    {
+      fh = &local_fh;
+      wfs_file_handle_init(fh, entry);
+    }
+
+  pthread_mutex_lock(&fh->lock);
+  int res = wfs_file_map_segments(image, entry, fh, size, offset, segments,
+                                  max_segments, n_segments);
+  if (res == 0 && wfs_bcache_is_dirty(image, segments, *n_segments))
+    res = -EAGAIN;
+  if (res == 0 && fh != &local_fh)
+    wfs_file_readahead(image, entry, fh, offset, size);
+  pthread_mutex_unlock(&fh->lock);
+
+  if (fh == &local_fh)
+    wfs_file_handle_fini(fh);
+
+  if (res < 0)
+    return res;
+
+  WFS_STATS_ADD(image, n_reads, *n_segments);
+  WFS_STATS_ADD(image, n_bytes_read, size);
+
+  return size;
+}
+
+/* Moves the data of the inline file identified by "ino" to a newly
+ * allocated block, so that the file can grow beyond the entry. The
+ * block holds the data before the entry refers to it. The caller must
+ * hold the lock of "fh" and the lock of the directory exclusively.
+ * Returns 0 on success, error code otherwise.
+ */
+static int
+wfs_file_uninline(wfs_image_t *image, wfs_ino_t ino, wfs_file_handle_t *fh,
+                  wfs_file_entry_t *entry)
+{
+  const wfs_file_entry_t inline_entry = *entry;
+  const size_t size = wfs_file_entry_get_size(entry);
+
+  pthread_rwlock_wrlock(&image->table_lock);
+  uint16_t block = wfs_block_alloc(image, WFS_BLOCK_FREE);
+  pthread_rwlock_unlock(&image->table_lock);
+
+  if (block == WFS_BLOCK_FREE)
+    return -ENOSPC;
+
+  wfs_io_segment_t segment =
+    {
+      wfs_file_entry_get_inline_data(&inline_entry), size,
+      wfs_get_block_offset(&image->layout, block - 1)
+    };
+  int res = 0;
+  if (size > 0)
+    res = wfs_file_transfer_segments(image, &segment, 1, true);
+
+  if (res == 0)
+    {
+      memset(wfs_file_entry_get_inline_data(entry), 0,
+             wfs_file_entry_get_inline_capacity(entry));
+      entry->start_block = block;
+      entry->size &= ~WFS_SIZE_IS_INLINE;
+      res = wfs_image_write_entry(image, wfs_ino_get_dir_block(ino),
+                                  wfs_ino_get_slot(ino), entry);
+    }
+
+  if (res < 0)
+    {
+      *entry = inline_entry;
+      pthread_rwlock_wrlock(&image->table_lock);
+      wfs_block_table_write(image, block - 1, WFS_BLOCK_FREE);
+      wfs_bcache_discard(image, block);
+      pthread_rwlock_unlock(&image->table_lock);
+    }
+
+  return res;
+}
+
+/* Resizes the regular file identified by "ino" to "size" bytes, while
+ * the caller holds the lock of "fh". Blocks are allocated or freed as
+ * required and the area between the old and the new end of the file is
+ * zeroed; "zero_end" limits zeroing when the caller overwrites part of
+ * that area itself. The file entry is stored in "entry".
+ */
+static int
+wfs_file_resize(wfs_image_t *image, wfs_ino_t ino, wfs_file_handle_t *fh,
+                size_t size, size_t zero_end, wfs_file_entry_t *entry)
+{
+  uint16_t dir_block = wfs_ino_get_dir_block(ino);
+  int slot = wfs_ino_get_slot(ino);
+
+  int res = wfs_image_read_entry(image, dir_block, slot, entry);
+  if (res < 0)
+    return res;
+
+  if (wfs_file_entry_is_directory(entry))
+    return -EISDIR;
+
+  const size_t current_size = wfs_file_entry_get_size(entry);
+  if (size == current_size)
+    return 0;
+
+  /* An inline file stays inline for as long as its data fits. */
+  if (wfs_file_entry_is_inline(entry))
+    {
+      if (size > wfs_file_entry_get_inline_capacity(entry))
+        res = wfs_file_uninline(image, ino, fh, entry);
+      else
+        {
+          if (size < current_size)
+            memset(wfs_file_entry_get_inline_data(entry) + size, 0,
+                   current_size - size);
+
+          entry->size = (entry->size & ~WFS_SIZE_MASK) | size;
+          res = wfs_image_write_entry(image, dir_block, slot, entry);
+          if (res == 0)
+            wfs_dcache_remove(image, dir_block, entry->filename);
+
+          return res;
+        }
+
+      if (res < 0)
+        return res;
+    }
+
+  /* A file always occupies at least one block, as an entry without a
+   * start block is considered empty.
+   */
+  int n = (size + image->layout.block_size - 1) / image->layout.block_size;
+  if (n == 0)
+    n = 1;
+
+  if (size > current_size)
+    {
+      pthread_rwlock_wrlock(&image->table_lock);
+      wfs_file_handle_validate(image, fh, entry);
+      res = wfs_file_handle_extend(image, fh, n);
+      pthread_rwlock_unlock(&image->table_lock);
+
+      if (res < 0)
+        return res;
+    }
+
+  if (zero_end > current_size)
+    {
+      if (zero_end > size)
+        zero_end = size;
+
+      res = wfs_file_unshare(image, ino, fh, entry, zero_end - current_size,
+                             current_size);
+      if (res == 0)
+        res = wfs_file_zero(image, entry, fh, zero_end - current_size,
+                            current_size);
+      if (res < 0)
+        return res;
+    }
+
+  /* A file that shrinks is updated before its blocks are freed, so that
+   * the entry never refers to free blocks, also not after a crash.
+   */
+  entry->size = (entry->size & ~WFS_SIZE_MASK) | size;
+  res = wfs_image_write_entry(image, dir_block, slot, entry);
+  if (res < 0)
+    return res;
+
+  if (size < current_size)
+    {
+      pthread_rwlock_wrlock(&image->table_lock);
+      wfs_file_handle_validate(image, fh, entry);
+
+      uint16_t last = wfs_file_handle_map(image, fh, n - 1);
+      if (last != WFS_BLOCK_EOF)
+        {
+          uint16_t next = wfs_get_next_block(image, last);
+          wfs_block_table_write(image, last - 1, WFS_BLOCK_EOF);
+          wfs_block_free_chain(image, next);
+
+          fh->n_blocks = n;
+          fh->complete = true;
+          fh->generation = ++*wfs_chain_generation(image, fh->start_block);
+        }
+
+      pthread_rwlock_unlock(&image->table_lock);
+    }
+
+  wfs_dcache_remove(image, dir_block, entry->filename);
+
+  return 0;
+}
+
+/* Prepares a write of "size" bytes at "offset" to the file identified by
+ * "ino", while the caller holds the lock of "fh", the lock of the file
+ * and the lock of the directory exclusively. The block chain is extended
+ * to cover the write, the area between the end of the file and "offset"
+ * is zeroed and the blocks that are written are unshared; the size of
+ * the file is left alone. A file stored inline is written right away.
+ * The file entry is stored in "entry". Returns 1 if the data has been
+ * written, 0 if it remains to be transferred, or an error code.
+ */
+static int
+wfs_file_prepare_write(wfs_image_t *image, wfs_ino_t ino,
+                       wfs_file_handle_t *fh, wfs_file_entry_t *entry,
+                       const char *buf, size_t size, off_t offset)
+{
+  uint16_t dir_block = wfs_ino_get_dir_block(ino);
+  int slot = wfs_ino_get_slot(ino);
+
+  int res = wfs_image_read_entry(image, dir_block, slot, entry);
+  if (res == 0 && wfs_file_entry_is_inline(entry)
+      && offset + size > wfs_file_entry_get_inline_capacity(entry))
+    res = wfs_file_uninline(image, ino, fh, entry);
+  if (res < 0)
+    return res;
+
+  if (wfs_file_entry_is_inline(entry))
+    {
+      /* The bytes beyond the end of the file are zero already. */
+      memcpy(wfs_file_entry_get_inline_data(entry) + offset, buf, size);
+      if (offset + size > wfs_file_entry_get_size(entry))
+        entry->size = (entry->size & ~WFS_SIZE_MASK) | (offset + size);
+
+      res = wfs_image_write_entry(image, dir_block, slot, entry);
+      if (res < 0)
+        return res;
+
+      wfs_dcache_remove(image, dir_block, entry->filename);
+      return 1;
+    }
+
+  if (wfs_file_entry_is_directory(entry))
+    return -EISDIR;
+
+  const size_t current_size = wfs_file_entry_get_size(entry);
+  if (offset + size > current_size)
+    {
+      const uint32_t block_size = image->layout.block_size;
+
+      pthread_rwlock_wrlock(&image->table_lock);
+      wfs_file_handle_validate(image, fh, entry);
+      res = wfs_file_handle_extend(image, fh, (offset + size + block_size - 1)
+                                   / block_size);
+      pthread_rwlock_unlock(&image->table_lock);
+
+      if (res == 0 && offset > current_size)
+        res = wfs_file_unshare(image, ino, fh, entry, offset - current_size,
+                               current_size);
+      if (res == 0 && offset > current_size)
+        res = wfs_file_zero(image, entry, fh, offset - current_size,
+                            current_size);
+      if (res < 0)
+        return res;
+    }
+
+  return wfs_file_unshare(image, ino, fh, entry, size, offset);
+}
+
+/* Checks whether "slot" of the directory stored at "dir_block" still
+ * holds the file of which "entry" was read earlier, while the caller
+ * holds the lock of the directory. Returns 0 if it does, and stores the
+ * current entry in "entry", error code otherwise.
+ */
+static int
+wfs_file_check_entry(wfs_image_t *image, uint16_t dir_block, int slot,
+                     wfs_file_entry_t *entry)
+{
+  wfs_file_entry_t current;
+
+  int res = wfs_image_read_entry(image, dir_block, slot, &current);
+  if (res < 0)
+    return res;
+
+  if (current.start_block != entry->start_block
+      || strncmp(current.filename, entry->filename, WFS_FILENAME_SIZE))
+    return -ENOENT;
+
+  *entry = current;
+
+  return 0;
+}
+
+/* Writes "size" bytes at "offset" to the regular file identified by
+ * "ino", extending the file as necessary. "fh" may be NULL. Returns the
+ * number of bytes written, or an error code.
+ */
+ssize_t
+wfs_file_write(wfs_image_t *image, wfs_ino_t ino, wfs_file_handle_t *fh,
+               const char *buf, size_t size, off_t offset)
+{
+  if (ino == WFS_ROOT_INO)
+    return -EISDIR;
+
+  if (image->read_only)
+    return -EROFS;
+
+  if (offset < 0)
+    return -EINVAL;
+
+  if (offset + size > wfs_get_max_file_size(&image->layout))
+    return -EFBIG;
+
+  if (size == 0)
+    return 0;
+
+  uint16_t dir_block = wfs_ino_get_dir_block(ino);
+  int slot = wfs_ino_get_slot(ino);
+  pthread_rwlock_t *lock = wfs_image_get_dir_lock(image, dir_block);
+  pthread_mutex_t *file_lock = wfs_image_get_file_lock(image, ino);
+  wfs_file_entry_t entry;
+  wfs_file_handle_t local_fh;
+  int res;
+
+  if (!fh)
+    {
+      memset(&entry, 0, sizeof(wfs_file_entry_t));
+      fh = &local_fh;
+      wfs_file_handle_init(fh, &entry);
+    }
+
+  /* The file lock serializes writers of the same file. The directory
+   * lock is only held exclusively while blocks are allocated and while
+   * the entry is updated; during the data transfer it is held shared,
+   * which keeps truncation and snapshots away without blocking lookups
+   * or writers of other files in the directory.
+   */
+  pthread_mutex_lock(&fh->lock);
+  pthread_mutex_lock(file_lock);
+
+  for (;;)
+    {
+      pthread_rwlock_wrlock(lock);
+      res = wfs_file_prepare_write(image, ino, fh, &entry, buf, size, offset);
+      const uint32_t generation = image->snapshot_generation;
+      pthread_rwlock_unlock(lock);
+
+      if (res != 0)
+        break;
+
+      /* The file may have been removed in between, or a snapshot taken
+       * that shares the blocks again.
+       */
+      pthread_rwlock_rdlock(lock);
+      res = wfs_file_check_entry(image, dir_block, slot, &entry);
+      if (res == 0 && image->snapshot_generation == generation)
+        {
+          res = wfs_file_transfer(image, &entry, fh, (char *)buf, size,
+                                  offset, true);
+          if (res == 0)
+            res = 1;
+        }
+      pthread_rwlock_unlock(lock);
+
+      if (res != 0)
+        break;
+    }
+
+  /* The new size is only stored once the data is there, so that readers
+   * never find what the blocks held before.
+   */
+  if (res > 0 && !wfs_file_entry_is_inline(&entry)
+      && offset + size > wfs_file_entry_get_size(&entry))
+    {
+      pthread_rwlock_wrlock(lock);
+      res = wfs_file_check_entry(image, dir_block, slot, &entry);
+      if (res == 0)
+        {
+          entry.size = (entry.size & ~WFS_SIZE_MASK) | (offset + size);
+          res = wfs_image_write_entry(image, dir_block, slot, &entry);
+        }
+      if (res == 0)
+        wfs_dcache_remove(image, dir_block, entry.filename);
+      pthread_rwlock_unlock(lock);
+    }
+
+  pthread_mutex_unlock(file_lock);
+  pthread_mutex_unlock(&fh->lock);
+
+  if (fh == &local_fh)
+    wfs_file_handle_fini(fh);
+
+  /* Like the data, the new size only has to be durable once the file is
+   * synced.
+   */
+  if (res >= 0)
+    res = wfs_image_commit(image, false);
+  if (res < 0)
+    return res;
+
+  return size;
+}
+
+/* Truncates or extends the regular file identified by "ino" to "size"
+ * bytes. "fh" may be NULL. Returns 0 on success, error code otherwise.
+ */
+int
+wfs_file_truncate(wfs_image_t *image, wfs_ino_t ino, wfs_file_handle_t *fh,
+                  off_t size)
+{
+  if (ino == WFS_ROOT_INO)
+    return -EISDIR;
+
+  if (image->read_only)
+    return -EROFS;
+
+  if (size < 0)
+    return -EINVAL;
+
+  if (size > wfs_get_max_file_size(&image->layout))
+    return -EFBIG;
+
+  uint16_t dir_block = wfs_ino_get_dir_block(ino);
+  pthread_rwlock_t *lock = wfs_image_get_dir_lock(image, dir_block);
+  pthread_mutex_t *file_lock = wfs_image_get_file_lock(image, ino);
+  wfs_file_entry_t entry;
+  wfs_file_handle_t local_fh;
+
+  if (!fh)
+    {
+      memset(&entry, 0, sizeof(wfs_file_entry_t));
+      fh = &local_fh;
+      wfs_file_handle_init(fh, &entry);
+    }
+
+  pthread_mutex_lock(&fh->lock);
+  pthread_mutex_lock(file_lock);
+  pthread_rwlock_wrlock(lock);
+
+  int res = wfs_file_resize(image, ino, fh, size, size, &entry);
+
+  pthread_rwlock_unlock(lock);
+  pthread_mutex_unlock(file_lock);
+  pthread_mutex_unlock(&fh->lock);
+
+  if (fh == &local_fh)
+    wfs_file_handle_fini(fh);
+
+  if (res == 0)
+    res = wfs_image_commit(image, true);
+
+  return res;
+}
+
+/* Copies the "n" blocks listed in "blocks" to the run starting at block
+ * "first". At most WFS_MAX_SEGMENTS blocks are copied at a time.
+ */
+static int
+wfs_file_copy_blocks(wfs_image_t *image, const uint16_t *blocks, int n,
+                     uint16_t first)
+{
+  const uint32_t block_size = image->layout.block_size;
+  uint8_t *buf = malloc(WFS_MAX_SEGMENTS * block_size);
+  int res = 0;
+
+  if (!buf)
+    return -ENOMEM;
+
+  for (int i = 0; i < n && res == 0; i += WFS_MAX_SEGMENTS)
+    {
+      wfs_io_segment_t segments[WFS_MAX_SEGMENTS];
+      int n_segments = 0;
+      int len = n - i < WFS_MAX_SEGMENTS ? n - i : WFS_MAX_SEGMENTS;
+
+      for (int j = 0; j < len; j++)
+        {
+          if (n_segments > 0 && blocks[i + j] == blocks[i + j - 1] + 1)
+            segments[n_segments - 1].size += block_size;
+          else
+            {
+              segments[n_segments].buf = buf + j * block_size;
+              segments[n_segments].size = block_size;
+              segments[n_segments].offset =
+                  wfs_get_block_offset(&image->layout, blocks[i + j] - 1);
+              n_segments++;
+            }
+        }
+
+      wfs_io_segment_t run =
+        {
+          buf, (size_t)len * block_size,
+          wfs_get_block_offset(&image->layout, first - 1 + i)
+        };
+
+      res = wfs_file_transfer_segments(image, segments, n_segments, false);
+      if (res == 0)
+        res = wfs_file_transfer_segments(image, &run, 1, true);
+    }
+
+  free(buf);
+
+  return res;
+}
+
+/* Moves the blocks of the regular file identified by "ino", of which
+ * "entry" is the entry found by the caller, to a single run of free
+ * blocks if they are spread over several runs. The file is left alone
+ * if it has been replaced since, or if it has more than "max_blocks"
+ * blocks. The lock of the file and the lock of the directory are held
+ * while the data is copied, which keeps writers of the file away. The
+ * new chain then replaces the old one with an update of the entry, so
+ * that concurrent readers find either one, also after a crash.
+ *
+ * Readers may still be using the old chain, found through the entry
+ * read just before; it is therefore not freed, but stored in
+ * "old_chain" for the caller to free with wfs_block_free_chain() a
+ * while later. Returns the number of blocks moved, 0 if the file is
+ * contiguous or not eligible, or an error code.
+ */
+int
+wfs_file_relocate(wfs_image_t *image, wfs_ino_t ino,
+                  const wfs_file_entry_t *entry, int max_blocks,
+                  uint16_t *old_chain)
+{
+  if (ino == WFS_ROOT_INO)
+    return -EISDIR;
+
+  if (image->read_only)
+    return -EROFS;
+
+  uint16_t dir_block = wfs_ino_get_dir_block(ino);
+  int slot = wfs_ino_get_slot(ino);
+  pthread_rwlock_t *lock = wfs_image_get_dir_lock(image, dir_block);
+  pthread_mutex_t *file_lock = wfs_image_get_file_lock(image, ino);
+  wfs_file_entry_t current = *entry;
+  wfs_file_handle_t fh;
+
+  pthread_mutex_lock(file_lock);
+  pthread_rwlock_wrlock(lock);
+
+  int res = wfs_file_check_entry(image, dir_block, slot, &current);
+  if (res < 0 || wfs_file_entry_is_directory(&current)
+      || wfs_file_entry_is_inline(&current))
+    {
+      pthread_rwlock_unlock(lock);
+      pthread_mutex_unlock(file_lock);
+      return res;
+    }
+
+  wfs_file_handle_init(&fh, &current);
+
+  /* Map the complete chain and count its runs. */
+  pthread_rwlock_wrlock(&image->table_lock);
+
+  int n = 0, n_runs = 0;
+  while (n <= max_blocks && wfs_file_handle_map(image, &fh, n)
+         != WFS_BLOCK_EOF)
+    {
+      if (n == 0 || fh.blocks[n] != fh.blocks[n - 1] + 1)
+        n_runs++;
+      n++;
+    }
+
+  uint16_t first = WFS_BLOCK_FREE;
+  if (n > max_blocks || n_runs <= 1)
+    res = 0;
+  else if (!fh.complete)
+    res = -ENOMEM;
+  else
+    {
+      int len = wfs_block_alloc_run(image, WFS_BLOCK_FREE, n, &first);
+      if (len < n)
+        {
+          if (len > 0)
+            wfs_block_free_chain(image, first);
+          first = WFS_BLOCK_FREE;
+          res = -ENOSPC;
+        }
+    }
+
+  pthread_rwlock_unlock(&image->table_lock);
+
+  if (first != WFS_BLOCK_FREE)
+    {
+      res = wfs_file_copy_blocks(image, fh.blocks, n, first);
+      if (res == 0)
+        {
+          current.start_block = first;
+          res = wfs_image_write_entry(image, dir_block, slot, &current);
+        }
+
+      if (res < 0)
+        {
+          pthread_rwlock_wrlock(&image->table_lock);
+          wfs_block_free_chain(image, first);
+          pthread_rwlock_unlock(&image->table_lock);
+        }
+      else
+        {
+          wfs_dcache_remove(image, dir_block, current.filename);
+          *old_chain = entry->start_block;
+          res = n;
+        }
+    }
+
+  pthread_rwlock_unlock(lock);
+  pthread_mutex_unlock(file_lock);
+  wfs_file_handle_fini(&fh);
+
+  if (res > 0)
+    {
+      int ret = wfs_image_commit(image, true);
+      if (ret < 0)
+        return ret;
+    }
+
+  return res;
+}
+
+
+/*
+ * Dentry cache
+ */
+
+/* Stores "name" in the name field "dest" of an entry or a dentry and
+ * clears the rest of the field, like strncpy() would. Names are checked
+ * to be shorter than the field; a longer one is cut off, so that the
+ * stored name is always terminated.
+ */
+static void
+wfs_copy_filename(char *dest, const char *name)
+{
+  size_t len = strnlen(name, WFS_FILENAME_SIZE - 1);
+
+  memcpy(dest, name, len);
+  memset(dest + len, 0, WFS_FILENAME_SIZE - len);
+}
+
+static inline uint32_t
+wfs_hash_name(const char *name, uint16_t dir_block)
+{
+  /* FNV-1a, seeded with the directory block */
+  uint32_t hash = 2166136261u ^ dir_block;
+
+  for (int i = 0; i < WFS_FILENAME_SIZE && name[i]; i++)
+    {
+      hash ^= (uint8_t)name[i];
+      hash *= 16777619u;
+    }
+
+  return hash;
+}
+
+/* Looks up "name" within the directory stored at "dir_block" in the
+ * dentry cache and copies the dentry to "result". Returns false if the
+ * name is not cached.
+ */
+static bool
+wfs_dcache_lookup(wfs_image_t *image, uint16_t dir_block, const char *name,
+                  wfs_dentry_t *result)
+{
+  uint32_t hash = wfs_hash_name(name, dir_block);
+  bool found = false;
+
+  pthread_mutex_lock(&image->dcache_lock);
+
+  for (wfs_dentry_t *dentry = image->dcache[hash & (WFS_DCACHE_SIZE - 1)];
+       dentry; dentry = dentry->next)
+    {
+      if (dentry->hash == hash && dentry->dir_block == dir_block
+          && !strncmp(dentry->name, name, WFS_FILENAME_SIZE))
+        {
+          *result = *dentry;
+          found = true;
+          break;
+        }
+    }
+
+  pthread_mutex_unlock(&image->dcache_lock);
+
+  return found;
+}
+
+static void
+wfs_dcache_clear(wfs_image_t *image)
+{
+  for (int i = 0; i < WFS_DCACHE_SIZE; i++)
+    {
+      wfs_dentry_t *dentry = image->dcache[i];
+      while (dentry)
+        {
+          wfs_dentry_t *next = dentry->next;
+          free(dentry);
+          dentry = next;
+        }
+      image->dcache[i] = NULL;
+    }
+
+  image->dcache_n_entries = 0;
+}
+
+/* Caches the entry found for "name" within the directory stored at
+ * "dir_block". If "entry" is NULL, a negative dentry is added. The
+ * caller must hold the lock of the directory, so that the dentry cannot
+ * race with an invalidation.
+ */
+static void
+wfs_dcache_insert(wfs_image_t *image, uint16_t dir_block, const char *name,
+                  int slot, const wfs_file_entry_t *entry)
+{
+  wfs_dentry_t *dentry = malloc(sizeof(wfs_dentry_t));
+  if (!dentry)
+    return;
+
+  dentry->hash = wfs_hash_name(name, dir_block);
+  dentry->dir_block = dir_block;
+  dentry->negative = !entry;
+  dentry->slot = slot;
+  if (entry)
+    dentry->entry = *entry;
+  wfs_copy_filename(dentry->name, name);
+
+  pthread_mutex_lock(&image->dcache_lock);
+
+  /* Concurrent lookups of the same name may both miss; keep a single
+   * dentry, so that wfs_dcache_remove() drops all of them.
+   */
+  wfs_dentry_t **bucket = &image->dcache[dentry->hash & (WFS_DCACHE_SIZE - 1)];
+  for (wfs_dentry_t *other = *bucket; other; other = other->next)
+    {
+      if (other->hash == dentry->hash && other->dir_block == dir_block
+          && !strncmp(other->name, name, WFS_FILENAME_SIZE))
+        {
+          pthread_mutex_unlock(&image->dcache_lock);
+          free(dentry);
+          return;
+        }
+    }
+
+  if (image->dcache_n_entries >= WFS_DCACHE_MAX_ENTRIES)
+    wfs_dcache_clear(image);
+
+  dentry->next = *bucket;
+  *bucket = dentry;
+  image->dcache_n_entries++;
+
+  pthread_mutex_unlock(&image->dcache_lock);
+}
+
+/* Drops the dentry of "name" within the directory stored at
+ * "dir_block". Must be called, while still holding the lock of the
+ * directory, by every operation that adds, removes or modifies the file
+ * entry of "name".
+ */
+static void
+wfs_dcache_remove(wfs_image_t *image, uint16_t dir_block, const char *name)
+{
+  uint32_t hash = wfs_hash_name(name, dir_block);
+
+  pthread_mutex_lock(&image->dcache_lock);
+
+  for (wfs_dentry_t **dentry = &image->dcache[hash & (WFS_DCACHE_SIZE - 1)];
+       *dentry; dentry = &(*dentry)->next)
+    {
+      if ((*dentry)->hash == hash && (*dentry)->dir_block == dir_block
+          && !strncmp((*dentry)->name, name, WFS_FILENAME_SIZE))
+        {
+          wfs_dentry_t *dead = *dentry;
+          *dentry = dead->next;
+          free(dead);
+          image->dcache_n_entries--;
+          break;
+        }
+    }
+
+  pthread_mutex_unlock(&image->dcache_lock);
+}
+
+/* Returns true if a dentry can be inserted without clearing the
+ * cache.
+ */
+static bool
+wfs_dcache_has_room(wfs_image_t *image)
+{
+  pthread_mutex_lock(&image->dcache_lock);
+  bool has_room = image->dcache_n_entries < WFS_DCACHE_MAX_ENTRIES;
+  pthread_mutex_unlock(&image->dcache_lock);
+
+  return has_room;
+}
+
+/* Drops all cached dentries, for instance when a directory block is
+ * released and may be reused. Must be called while still holding the
+ * lock of the modified directory.
+ */
+void
+wfs_dcache_invalidate(wfs_image_t *image)
+{
+  pthread_mutex_lock(&image->dcache_lock);
+  wfs_dcache_clear(image);
+  pthread_mutex_unlock(&image->dcache_lock);
+}
+
+
+/*
+ * Directory index
+ */
+
+int
+wfs_dir_index_init(wfs_image_t *image)
+{
+  image->dir_index = calloc(image->layout.n_blocks + 1, sizeof(uint32_t *));
+  if (!image->dir_index)
+    {
+      fprintf(stderr, "error: could not allocate directory index\n");
+      return -1;
+    }
+
+  return 0;
+}
+
+static void
+wfs_dir_index_fini(wfs_image_t *image)
+{
+  if (!image->dir_index)
+    return;
+
+  for (uint32_t i = 0; i <= image->layout.n_blocks; i++)
+    free(image->dir_index[i]);
+  free(image->dir_index);
+  image->dir_index = NULL;
+}
+
+/* Returns the index hash of "name", which is never 0. */
+static inline uint32_t
+wfs_dir_index_hash(const char *name)
+{
+  uint32_t hash = wfs_hash_name(name, 0);
+
+  return hash ? hash : 1;
+}
+
+static inline uint32_t
+wfs_dir_index_entry_hash(const wfs_file_entry_t *entry)
+{
+  return wfs_file_entry_is_empty(entry) ? 0
+      : wfs_dir_index_hash(entry->filename);
+}
+
+/* Returns the index of the directory stored at "dir_block", or NULL if
+ * it has not been built yet. The caller must hold the directory lock.
+ */
+static inline uint32_t *
+wfs_dir_index_get(wfs_image_t *image, uint16_t dir_block)
+{
+  return __atomic_load_n(&image->dir_index[dir_block], __ATOMIC_ACQUIRE);
+}
+
+/* Builds the index of the directory stored at "dir_block" from its
+ * "n_entries" entries "entries". Multiple readers may race to build it,
+ * only the first index is kept. Returns NULL if out of memory.
+ */
+static uint32_t *
+wfs_dir_index_build(wfs_image_t *image, uint16_t dir_block,
+                    const wfs_file_entry_t *entries, int n_entries)
+{
+  uint32_t *index = malloc(n_entries * sizeof(uint32_t));
+  if (!index)
+    return NULL;
+
+  for (int i = 0; i < n_entries; i++)
+    index[i] = wfs_dir_index_entry_hash(&entries[i]);
+
+  uint32_t *expected = NULL;
+  if (!__atomic_compare_exchange_n(&image->dir_index[dir_block], &expected,
+                                   index, false, __ATOMIC_ACQ_REL,
+                                   __ATOMIC_ACQUIRE))
+    {
+      free(index);
+      index = expected;
+    }
+
+  return index;
+}
+
+/* Records that "slot" of the directory stored at "dir_block" now holds
+ * "entry". The caller must hold the directory lock exclusively.
+ */
+static void
+wfs_dir_index_update(wfs_image_t *image, uint16_t dir_block, int slot,
+                     const wfs_file_entry_t *entry)
+{
+  uint32_t *index = wfs_dir_index_get(image, dir_block);
+
+  if (index)
+    index[slot] = wfs_dir_index_entry_hash(entry);
+}
+
+/* Drops the index of the directory stored at "dir_block", which is
+ * being released. The caller must hold the directory lock exclusively.
+ */
+static void
+wfs_dir_index_drop(wfs_image_t *image, uint16_t dir_block)
+{
+  uint32_t *index = __atomic_exchange_n(&image->dir_index[dir_block], NULL,
+                                        __ATOMIC_ACQ_REL);
+  free(index);
+}
+
+/* Looks up the name of "entry" in the directory stored at "dir_block"
+ * using its index. Only entries with a matching hash are compared; they
+ * are taken from "entries" if not NULL, and read from the image
+ * otherwise. Returns the slot of the entry, error code otherwise.
+ */
+static int
+wfs_dir_index_find(wfs_image_t *image, uint16_t dir_block,
+                   const uint32_t *index, const wfs_file_entry_t *entries,
+                   int n_entries, wfs_file_entry_t *entry)
+{
+  uint32_t hash = wfs_dir_index_hash(entry->filename);
+
+  for (int i = 0; i < n_entries; i++)
+    {
+      if (index[i] != hash)
+        continue;
+
+      wfs_file_entry_t tmp_entry;
+      if (entries)
+        tmp_entry = entries[i];
+      else
+        {
+          int res = wfs_image_read_entry(image, dir_block, i, &tmp_entry);
+          if (res == -ENOENT)
+            continue;
+          if (res < 0)
+            return res;
+        }
+
+      if (!wfs_file_entry_is_empty(&tmp_entry)
+          && !strncmp(tmp_entry.filename, entry->filename,
+                      WFS_FILENAME_SIZE))
+        {
+          *entry = tmp_entry;
+          return i;
+        }
+    }
+
+  return -ENOENT;
+}
+
+
+/*
+ * Generic file entry operations
+ */
+
+/* Performs file entry operation "op" on the "n_entries" entries
+ * "entries" of the directory stored at "dir_block"; see
+ * wfs_file_entry_operation_locked().
+ */
+static int
+wfs_dir_scan_locked(wfs_image_t                  *image,
+                    uint16_t                      dir_block,
+                    const wfs_file_entry_t       *entries,
+                    int                           n_entries,
+                    wfs_file_entry_op_t           op,
+                    wfs_file_entry_t             *entry,
+                    wfs_file_entry_op_callback_t  callback,
+                    void                         *callback_data)
+{
+  int count = 0;
+
+  for (int i = 0; i < n_entries; i++)
+    {
+      wfs_file_entry_t tmp_entry = entries[i];
+
+      switch (op)
+        {
+          case WFS_FILE_ENTRY_OP_FIND:
+            {
+              if (wfs_file_entry_is_empty(&tmp_entry))
+                continue;
+
+              if (!strncmp(tmp_entry.filename, entry->filename,
+                           WFS_FILENAME_SIZE))
+                {
+                  *entry = tmp_entry;
+                  return i;
+                }
+            }
+          break;
+
+          case WFS_FILE_ENTRY_OP_COUNT:
+            if (!wfs_file_entry_is_empty(&tmp_entry))
+              count++;
+            break;
+
+          case WFS_FILE_ENTRY_OP_CALLBACK:
+            if (!wfs_file_entry_is_empty(&tmp_entry))
+              (* callback) (&tmp_entry, i, callback_data);
+            break;
+
+          case WFS_FILE_ENTRY_OP_MKDIR:
+            /* The kernel may still refer to a removed entry by its
+             * inode number, so such a slot must not be reused yet.
+             */
+            if (wfs_file_entry_is_empty(&tmp_entry)
+                && !wfs_inode_is_referenced(image,
+                                            wfs_ino_make(dir_block, i)))
+              {
+                int res = wfs_image_write_entry(image, dir_block, i, entry);
+                return res < 0 ? res : i;
+              }
+            break;
+
+          case WFS_FILE_ENTRY_OP_RMDIR:
+            if (!wfs_file_entry_is_empty(&tmp_entry)
+                && !strncmp(tmp_entry.filename, entry->filename,
+                            WFS_FILENAME_SIZE))
+              {
+                wfs_file_entry_t empty_entry = { { 0, }, };
+                int res = wfs_image_write_entry(image, dir_block, i,
+                                                &empty_entry);
+                return res < 0 ? res : i;
+              }
+            break;
+        }
+    }
+
+  if (op == WFS_FILE_ENTRY_OP_FIND || op == WFS_FILE_ENTRY_OP_RMDIR)
+    return -ENOENT;
+
+  if (op == WFS_FILE_ENTRY_OP_MKDIR)
+    return -ENOSPC;
+
+  return count;
+}
+
+/* Performs the specified file entry operation within the directory
+ * specified by "parent". "parent" must be a directory. If "parent" is
+ * the empty entry, the root directory is used. The use of the "entry"
+ * argument depends on the selected file entry operation. For
+ * WFS_FILE_ENTRY_OP_FIND the slot of the entry is returned.
+ * WFS_FILE_ENTRY_OP_MKDIR stores "entry" in a free slot and
+ * WFS_FILE_ENTRY_OP_RMDIR clears the slot of the entry with the name of
+ * "entry"; both return the slot used. The caller must hold the lock of
+ * the directory, exclusively for the modifying operations.
+ */
+static int
+wfs_file_entry_operation_locked(wfs_image_t                  *image,
+                                const wfs_file_entry_t       *parent,
+                                wfs_file_entry_op_t           op,
+                                wfs_file_entry_t             *entry,
+                                wfs_file_entry_op_callback_t  callback,
+                                void                         *callback_data)
+{
+  if (!parent)
+    return -EINVAL;
+
+  /* The root directory is represented by the empty entry and uses the
+   * entry table at the start of the image. Other directories occupy a
+   * single data block.
+   */
+  uint16_t dir_block = wfs_file_entry_get_dir_block(parent);
+  int aantalfiles = wfs_dir_get_n_entries(&image->layout, dir_block);
+  off_t entrystart = wfs_dir_get_entry_offset(&image->layout, dir_block, 0);
+
+  /* Refuse to perform find operation if the filename is empty. */
+  if (op == WFS_FILE_ENTRY_OP_FIND && entry->filename[0] == 0)
+    return -EINVAL;
+
+  /* Once a directory has been indexed, a name lookup only reads the
+   * entries whose name hash matches.
+   */
+  uint32_t *index = wfs_dir_index_get(image, dir_block);
+  if (op == WFS_FILE_ENTRY_OP_FIND && index)
+    return wfs_dir_index_find(image, dir_block, index, NULL, aantalfiles,
+                              entry);
+
+  /* The entries of a directory are contiguous, read them all at once;
+   * or use them in place when the image is mapped, unless they are
+   * taken from a snapshot. Directory blocks larger than the root
+   * directory are read into a buffer taken from the arena of the
+   * calling thread.
+   */
+  wfs_file_entry_t buffer[WFS_N_FILES];
+  wfs_file_entry_t *entries = buffer;
+  size_t entries_size = aantalfiles * sizeof(wfs_file_entry_t);
+  bool in_place = image->map && !image->snapshot;
+
+  if (in_place && wfs_image_has_pending(image, dir_block))
+    in_place = false;
+
+  if (in_place)
+    {
+      if (entrystart + entries_size > image->map_size)
+        return -EIO;
+
+      entries = (wfs_file_entry_t *)(image->map + entrystart);
+    }
+  else
+    {
+      if (aantalfiles > WFS_N_FILES)
+        {
+          entries = wfs_arena_alloc(image, entries_size);
+          if (!entries)
+            return -ENOMEM;
+        }
+
+      if (wfs_image_pread(image, entries, entries_size, entrystart)
+          != entries_size)
+        {
+          if (entries != buffer)
+            wfs_arena_release(image, entries);
+          return -EIO;
+        }
+
+      wfs_image_apply_pending(image, dir_block, entries, aantalfiles);
+    }
+
+  if (!index)
+    index = wfs_dir_index_build(image, dir_block, entries, aantalfiles);
+
+  int res;
+  if (op == WFS_FILE_ENTRY_OP_FIND && index)
+    res = wfs_dir_index_find(image, dir_block, index, entries, aantalfiles,
+                             entry);
+  else
+    res = wfs_dir_scan_locked(image, dir_block, entries, aantalfiles, op,
+                              entry, callback, callback_data);
+
+  if (entries != buffer && !in_place)
+    wfs_arena_release(image, entries);
+
+  return res;
+}
+
+/* As wfs_file_entry_operation_locked(), but takes the lock of the
+ * directory. Callbacks are called with the lock held and must not
+ * access the entries of the same directory through this function.
+ */
+int
+wfs_file_entry_operation(wfs_image_t                  *image,
+                         const wfs_file_entry_t       *parent,
+                         wfs_file_entry_op_t           op,
+                         wfs_file_entry_t             *entry,
+                         wfs_file_entry_op_callback_t  callback,
+                         void                         *callback_data)
+{
+  if (!parent)
+    return -EINVAL;
+
+  pthread_rwlock_t *lock =
+      wfs_image_get_dir_lock(image, wfs_file_entry_get_dir_block(parent));
+
+  if (op == WFS_FILE_ENTRY_OP_MKDIR || op == WFS_FILE_ENTRY_OP_RMDIR)
+    pthread_rwlock_wrlock(lock);
+  else
+    pthread_rwlock_rdlock(lock);
+
+  int res = wfs_file_entry_operation_locked(image, parent, op, entry,
+                                            callback, callback_data);
+  pthread_rwlock_unlock(lock);
+
+  return res;
+}
+
+/* Finds "name" within the directory "parent", consulting the dentry
+ * cache first. Returns the slot of the entry on success, error code
+ * otherwise.
+ */
+int
+wfs_dir_lookup(wfs_image_t *image, const wfs_file_entry_t *parent,
+               const char *name, wfs_file_entry_t *entry)
+{
+  if (strnlen(name, WFS_FILENAME_SIZE) >= WFS_FILENAME_SIZE)
+    return -ENAMETOOLONG;
+
+  uint16_t dir_block = wfs_file_entry_get_dir_block(parent);
+  pthread_rwlock_t *lock = wfs_image_get_dir_lock(image, dir_block);
+  wfs_dentry_t dentry;
+  int slot;
+
+  pthread_rwlock_rdlock(lock);
+
+  if (wfs_dcache_lookup(image, dir_block, name, &dentry))
+    {
+      WFS_STATS_ADD(image, n_dcache_hits, 1);
+      if (dentry.negative)
+        slot = -ENOENT;
+      else
+        {
+          *entry = dentry.entry;
+          slot = dentry.slot;
+        }
+    }
+  else
+    {
+      WFS_STATS_ADD(image, n_dcache_misses, 1);
+      memset(entry, 0, sizeof(wfs_file_entry_t));
+      wfs_copy_filename(entry->filename, name);
+
+      slot = wfs_file_entry_operation_locked(image, parent,
+                                             WFS_FILE_ENTRY_OP_FIND,
+                                             entry, NULL, NULL);
+      if (slot == -ENOENT)
+        wfs_dcache_insert(image, dir_block, name, -1, NULL);
+      else if (slot >= 0)
+        wfs_dcache_insert(image, dir_block, name, slot, entry);
+    }
+
+  pthread_rwlock_unlock(lock);
+
+  return slot;
+}
+
+struct wfs_dir_preload_data
+{
+  wfs_image_t *image;
+  uint16_t dir_block;
+  wfs_file_entry_op_callback_t callback;
+  void *callback_data;
+};
+
+static void
+wfs_dir_preload_callback(wfs_file_entry_t *entry, int slot, void *data)
+{
+  struct wfs_dir_preload_data *preload = data;
+
+  if (wfs_dcache_has_room(preload->image))
+    wfs_dcache_insert(preload->image, preload->dir_block, entry->filename,
+                      slot, entry);
+
+  preload->callback(entry, slot, preload->callback_data);
+}
+
+/* Reads all entries of the directory "dir" identified by "ino" into the
+ * dentry cache, as far as it has room, and builds the index of the
+ * directory. "callback" is called for every entry, with the lock of the
+ * directory held. Returns 0 on success, error code otherwise; -ENOENT if
+ * the directory has been removed.
+ */
+int
+wfs_dir_preload(wfs_image_t *image, wfs_ino_t ino,
+                const wfs_file_entry_t *dir,
+                wfs_file_entry_op_callback_t callback, void *callback_data)
+{
+  struct wfs_dir_preload_data data =
+    {
+      image, wfs_file_entry_get_dir_block(dir), callback, callback_data
+    };
+  pthread_rwlock_t *lock = wfs_image_get_dir_lock(image, data.dir_block);
+
+  pthread_rwlock_rdlock(lock);
+
+  int res = wfs_image_check_dir(image, ino, dir);
+  if (res == 0)
+    res = wfs_file_entry_operation_locked(image, dir,
+                                          WFS_FILE_ENTRY_OP_CALLBACK, NULL,
+                                          wfs_dir_preload_callback, &data);
+
+  pthread_rwlock_unlock(lock);
+
+  return res;
+}
+
+/*
+ * Queued file entries
+ */
+
+/* Entries stored while the image has a journal are queued until the
+ * journal holds their records on disk; see wfsjournal.c. Only the last
+ * entry stored in a slot is kept, with the position of its record.
+ * Entries are only queued with the lock of their directory held
+ * exclusively, so a reader holding it that finds no queued entries for
+ * the directories sharing the lock may read the image without taking
+ * pending_lock. The count is lowered only once the entry is written.
+ */
+
+static inline wfs_pending_entry_t **
+wfs_image_get_pending_bucket(wfs_image_t *image, uint16_t dir_block)
+{
+  return &image->pending[dir_block & (WFS_PENDING_HASH_SIZE - 1)];
+}
+
+/* Returns whether entries of the directory stored at "dir_block" may be
+ * queued. The caller must hold the lock of the directory.
+ */
+static bool
+wfs_image_has_pending(wfs_image_t *image, uint16_t dir_block)
+{
+  return __atomic_load_n(&image->pending_dirs[dir_block % WFS_N_DIR_LOCKS],
+                         __ATOMIC_ACQUIRE) != 0;
+}
+
+/* Removes the queued entry "*link" points to. The caller must hold
+ * pending_lock.
+ */
+static void
+wfs_image_remove_pending_locked(wfs_image_t *image,
+                                wfs_pending_entry_t **link)
+{
+  wfs_pending_entry_t *pending = *link;
+
+  *link = pending->next;
+  image->n_pending--;
+  __atomic_sub_fetch(&image->pending_dirs[pending->dir_block
+                                          % WFS_N_DIR_LOCKS],
+                     1, __ATOMIC_RELEASE);
+  free(pending);
+}
+
+/* Queues "entry" for "slot" of the directory stored at "dir_block",
+ * replacing an entry queued for the slot before. "position" is the
+ * position of its record in the journal. The caller must hold the lock
+ * of the directory exclusively. Returns 0 on success, error code
+ * otherwise.
+ */
+static int
+wfs_image_queue_entry(wfs_image_t *image, uint16_t dir_block, int slot,
+                      const wfs_file_entry_t *entry, uint64_t position)
+{
+  wfs_pending_entry_t **bucket =
+      wfs_image_get_pending_bucket(image, dir_block);
+
+  pthread_mutex_lock(&image->pending_lock);
+
+  wfs_pending_entry_t *pending;
+  for (pending = *bucket; pending; pending = pending->next)
+    if (pending->dir_block == dir_block && pending->slot == slot)
+      break;
+
+  if (!pending)
+    {
+      pending = malloc(sizeof(wfs_pending_entry_t));
+      if (!pending)
+        {
+          pthread_mutex_unlock(&image->pending_lock);
+          return -ENOMEM;
+        }
+
+      pending->dir_block = dir_block;
+      pending->slot = slot;
+      pending->next = *bucket;
+      *bucket = pending;
+      image->n_pending++;
+      __atomic_add_fetch(&image->pending_dirs[dir_block % WFS_N_DIR_LOCKS],
+                         1, __ATOMIC_RELEASE);
+    }
+
+  pending->entry = *entry;
+  pending->position = position;
+
+  pthread_mutex_unlock(&image->pending_lock);
+
+  return 0;
+}
+
+/* Copies the entry queued for "slot" of the directory stored at
+ * "dir_block" to "entry". The caller must hold the lock of the
+ * directory. Returns whether an entry was queued.
+ */
+static bool
+wfs_image_find_pending(wfs_image_t *image, uint16_t dir_block, int slot,
+                       wfs_file_entry_t *entry)
+{
+  if (!wfs_image_has_pending(image, dir_block))
+    return false;
+
+  bool found = false;
+
+  pthread_mutex_lock(&image->pending_lock);
+  for (wfs_pending_entry_t *pending =
+           *wfs_image_get_pending_bucket(image, dir_block);
+       pending; pending = pending->next)
+    if (pending->dir_block == dir_block && pending->slot == slot)
+      {
+        *entry = pending->entry;
+        found = true;
+        break;
+      }
+  pthread_mutex_unlock(&image->pending_lock);
+
+  return found;
+}
+
+/* Replaces the "n_entries" entries "entries" read from the directory
+ * stored at "dir_block" by the entries queued for it. The caller must
+ * hold the lock of the directory.
+ */
+static void
+wfs_image_apply_pending(wfs_image_t *image, uint16_t dir_block,
+                        wfs_file_entry_t *entries, int n_entries)
+{
+  if (!wfs_image_has_pending(image, dir_block))
+    return;
+
+  pthread_mutex_lock(&image->pending_lock);
+  for (wfs_pending_entry_t *pending =
+           *wfs_image_get_pending_bucket(image, dir_block);
+       pending; pending = pending->next)
+    if (pending->dir_block == dir_block && pending->slot < n_entries)
+      entries[pending->slot] = pending->entry;
+  pthread_mutex_unlock(&image->pending_lock);
+}
+
+/* Drops the entries queued for the directory stored at "dir_block",
+ * which is being freed. Their records are skipped when the journal is
+ * replayed.
+ */
+static void
+wfs_image_discard_entries(wfs_image_t *image, uint16_t dir_block)
+{
+  wfs_pending_entry_t **link =
+      wfs_image_get_pending_bucket(image, dir_block);
+
+  pthread_mutex_lock(&image->pending_lock);
+  while (*link)
+    {
+      if ((*link)->dir_block == dir_block)
+        wfs_image_remove_pending_locked(image, link);
+      else
+        link = &(*link)->next;
+    }
+  pthread_mutex_unlock(&image->pending_lock);
+}
+
+/* Writes the queued entries of which the records are on disk to the
+ * image. Takes no directory lock, so that it may be called with all of
+ * them held. Returns 0 on success, error code otherwise; entries that
+ * could not be written stay queued.
+ */
+static int
+wfs_image_write_back(wfs_image_t *image)
+{
+  if (!image->journal)
+    return 0;
+
+  const uint64_t n_durable = wfs_journal_get_n_durable(image);
+  int res = 0;
+
+  /* Readers take the entries from the queue until they are removed
+   * from it, so they are written with pending_lock held.
+   */
+  pthread_mutex_lock(&image->pending_lock);
+  for (int i = 0; i < WFS_PENDING_HASH_SIZE && image->n_pending > 0; i++)
+    {
+      wfs_pending_entry_t **link = &image->pending[i];
+      while (*link)
+        {
+          wfs_pending_entry_t *pending = *link;
+          if (pending->position > n_durable)
+            {
+              link = &pending->next;
+              continue;
+            }
+
+          off_t offset = wfs_dir_get_entry_offset(&image->layout,
+                                                  pending->dir_block,
+                                                  pending->slot);
+          if (wfs_image_pwrite(image, &pending->entry,
+                               sizeof(wfs_file_entry_t), offset)
+              != sizeof(wfs_file_entry_t))
+            {
+              res = -EIO;
+              link = &pending->next;
+              continue;
+            }
+
+          wfs_image_remove_pending_locked(image, link);
+        }
+    }
+  pthread_mutex_unlock(&image->pending_lock);
+
+  return res;
+}
+
+/* Reads the entry in "slot" of the directory stored at "dir_block". The
+ * caller must hold the lock of the directory. Returns 0 on success, error
+ * code otherwise.
+ */
+static int
+wfs_image_read_entry(wfs_image_t *image, uint16_t dir_block, int slot,
+                     wfs_file_entry_t *entry)
+{
+  if (dir_block > image->layout.n_blocks || slot < 0
+      || slot >= wfs_dir_get_n_entries(&image->layout, dir_block))
+    return -ENOENT;
+
+  off_t offset = wfs_dir_get_entry_offset(&image->layout, dir_block, slot);
+  if (!wfs_image_find_pending(image, dir_block, slot, entry)
+      && wfs_image_pread(image, entry, sizeof(wfs_file_entry_t), offset)
+         != sizeof(wfs_file_entry_t))
+    return -EIO;
+
+  if (wfs_file_entry_is_empty(entry))
+    return -ENOENT;
+
+  return 0;
+}
+
+/* Stores "entry" in "slot" of the directory stored at "dir_block". The
+ * caller must hold the lock of the directory exclusively.
+ */
+static int
+wfs_image_write_entry(wfs_image_t *image, uint16_t dir_block, int slot,
+                      const wfs_file_entry_t *entry)
+{
+  /* The entry may refer to blocks whose allocation is only recorded in
+   * the journal, so it must not reach the image before the journal is
+   * on disk. The records are only written here and the entry is queued;
+   * the caller commits them once it has released the directory lock,
+   * after which the entry is written back.
+   */
+  if (image->journal)
+    {
+      uint64_t position = wfs_journal_log_entry(image, dir_block, slot,
+                                                entry);
+      int res = wfs_journal_write(image);
+      if (res == 0)
+        res = wfs_image_queue_entry(image, dir_block, slot, entry,
+                                    position);
+      if (res < 0)
+        return res;
+    }
+  else
+    {
+      off_t offset = wfs_dir_get_entry_offset(&image->layout, dir_block,
+                                              slot);
+      if (wfs_image_pwrite(image, entry, sizeof(wfs_file_entry_t), offset)
+          != sizeof(wfs_file_entry_t))
+        return -EIO;
+    }
+
+  wfs_dir_index_update(image, dir_block, slot, entry);
+
+  return 0;
+}
+
+/* Reads the file entry identified by "ino". For the root directory the
+ * empty entry is returned. Returns 0 on success, error code otherwise.
+ */
+int
+wfs_image_get_entry(wfs_image_t *image, wfs_ino_t ino,
+                    wfs_file_entry_t *entry)
+{
+  if (ino == WFS_ROOT_INO)
+    {
+      memset(entry, 0, sizeof(wfs_file_entry_t));
+      return 0;
+    }
+
+  uint16_t dir_block = wfs_ino_get_dir_block(ino);
+  pthread_rwlock_t *lock = wfs_image_get_dir_lock(image, dir_block);
+
+  pthread_rwlock_rdlock(lock);
+  int res = wfs_image_read_entry(image, dir_block, wfs_ino_get_slot(ino),
+                                 entry);
+  pthread_rwlock_unlock(lock);
+
+  return res;
+}
+
+/* Reads the directory entry identified by "ino" into "dir". Returns 0
+ * on success, error code otherwise.
+ */
+static int
+wfs_image_get_dir(wfs_image_t *image, wfs_ino_t ino, wfs_file_entry_t *dir)
+{
+  int res = wfs_image_get_entry(image, ino, dir);
+  if (res < 0)
+    return res;
+
+  /* Note that an empty entry represents the root directory. */
+  if (!wfs_file_entry_is_empty(dir) && !wfs_file_entry_is_directory(dir))
+    return -ENOTDIR;
+
+  return 0;
+}
+
+/* Looks up "name" in the directory identified by "parent" and returns
+ * its entry and inode number. Returns 0 on success, error code
+ * otherwise.
+ */
+int
+wfs_image_lookup(wfs_image_t *image, wfs_ino_t parent, const char *name,
+                 wfs_file_entry_t *entry, wfs_ino_t *ino)
+{
+  wfs_file_entry_t parent_entry;
+
+  int res = wfs_image_get_dir(image, parent, &parent_entry);
+  if (res < 0)
+    return res;
+
+  int slot = wfs_dir_lookup(image, &parent_entry, name, entry);
+  if (slot < 0)
+    return slot;
+
+  *ino = wfs_ino_make(wfs_file_entry_get_dir_block(&parent_entry), slot);
+
+  return 0;
+}
+
+/* Checks, after taking the lock of the directory "dir" identified by
+ * "ino", that it has not been removed in the meantime. Removal requires
+ * that lock as well, so the entry cannot change while it is held.
+ */
+static int
+wfs_image_check_dir(wfs_image_t *image, wfs_ino_t ino,
+                    const wfs_file_entry_t *dir)
+{
+  wfs_file_entry_t current;
+
+  if (ino == WFS_ROOT_INO)
+    return 0;
+
+  int res = wfs_image_read_entry(image, wfs_ino_get_dir_block(ino),
+                                 wfs_ino_get_slot(ino), &current);
+  if (res < 0)
+    return res;
+
+  if (current.start_block != dir->start_block
+      || !wfs_file_entry_is_directory(&current))
+    return -ENOENT;
+
+  return 0;
+}
+
+/* Takes the locks of two directories exclusively. Locks are taken in
+ * order of their index, so that this cannot deadlock against another
+ * caller; directories sharing a lock are locked once.
+ */
+static void
+wfs_image_lock_dirs(wfs_image_t *image, uint16_t dir_block1,
+                    uint16_t dir_block2)
+{
+  pthread_rwlock_t *lock1 = wfs_image_get_dir_lock(image, dir_block1);
+  pthread_rwlock_t *lock2 = wfs_image_get_dir_lock(image, dir_block2);
+
+  if (lock1 > lock2)
+    {
+      pthread_rwlock_t *tmp = lock1;
+      lock1 = lock2;
+      lock2 = tmp;
+    }
+
+  pthread_rwlock_wrlock(lock1);
+  if (lock2 != lock1)
+    pthread_rwlock_wrlock(lock2);
+}
+
+static void
+wfs_image_unlock_dirs(wfs_image_t *image, uint16_t dir_block1,
+                      uint16_t dir_block2)
+{
+  pthread_rwlock_t *lock1 = wfs_image_get_dir_lock(image, dir_block1);
+  pthread_rwlock_t *lock2 = wfs_image_get_dir_lock(image, dir_block2);
+
+  pthread_rwlock_unlock(lock1);
+  if (lock2 != lock1)
+    pthread_rwlock_unlock(lock2);
+}
+
+/* Creates an empty file or directory named "name" in the directory
+ * identified by "parent", and returns its entry and inode number.
+ * Returns 0 on success, error code otherwise.
+ */
+int
+wfs_image_create(wfs_image_t *image, wfs_ino_t parent, const char *name,
+                 bool is_directory, wfs_file_entry_t *entry, wfs_ino_t *ino)
+{
+  wfs_file_entry_t parent_entry;
+
+  if (name[0] == 0)
+    return -EINVAL;
+
+  if (image->read_only)
+    return -EROFS;
+
+  if (strnlen(name, WFS_FILENAME_SIZE) >= WFS_FILENAME_SIZE)
+    return -ENAMETOOLONG;
+
+  int res = wfs_image_get_dir(image, parent, &parent_entry);
+  if (res < 0)
+    return res;
+
+  uint16_t dir_block = wfs_file_entry_get_dir_block(&parent_entry);
+  pthread_rwlock_t *lock = wfs_image_get_dir_lock(image, dir_block);
+
+  pthread_rwlock_wrlock(lock);
+
+  res = wfs_image_check_dir(image, parent, &parent_entry);
+  if (res < 0)
+    goto out;
+
+  memset(entry, 0, sizeof(wfs_file_entry_t));
+  wfs_copy_filename(entry->filename, name);
+
+  res = wfs_file_entry_operation_locked(image, &parent_entry,
+                                        WFS_FILE_ENTRY_OP_FIND, entry,
+                                        NULL, NULL);
+  if (res >= 0)
+    {
+      res = -EEXIST;
+      goto out;
+    }
+  else if (res != -ENOENT)
+    goto out;
+
+  /* Every entry except that of an inline file owns at least one block;
+   * for a directory it holds its entries, which must start out empty.
+   */
+  const bool is_inline = !is_directory
+      && (image->features & WFS_FEATURE_INLINE);
+  uint16_t block = WFS_BLOCK_EOF;
+  if (!is_inline)
+    {
+      pthread_rwlock_wrlock(&image->table_lock);
+      block = wfs_block_alloc(image, WFS_BLOCK_FREE);
+      pthread_rwlock_unlock(&image->table_lock);
+    }
+
+  if (block == WFS_BLOCK_FREE)
+    {
+      res = -ENOSPC;
+      goto out;
+    }
+
+  memset(entry, 0, sizeof(wfs_file_entry_t));
+  wfs_copy_filename(entry->filename, name);
+  entry->start_block = block;
+  if (is_directory)
+    entry->size = WFS_SIZE_IS_DIRECTORY;
+  else
+    entry->size = is_inline ? WFS_SIZE_IS_INLINE : 0;
+
+  res = 0;
+  if (is_directory)
+    {
+      const uint32_t block_size = image->layout.block_size;
+      off_t offset = wfs_get_block_offset(&image->layout, block - 1);
+      void *entries = calloc(1, block_size);
+
+      if (!entries)
+        res = -ENOMEM;
+      else if (wfs_image_pwrite(image, entries, block_size, offset)
+               != block_size)
+        res = -EIO;
+      else if (image->journal)
+        wfs_journal_log_clear(image, block);
+
+      free(entries);
+    }
+
+  if (res == 0)
+    res = wfs_file_entry_operation_locked(image, &parent_entry,
+                                          WFS_FILE_ENTRY_OP_MKDIR, entry,
+                                          NULL, NULL);
+  if (res < 0 && !is_inline)
+    {
+      pthread_rwlock_wrlock(&image->table_lock);
+      wfs_block_free_chain(image, block);
+      pthread_rwlock_unlock(&image->table_lock);
+    }
+  if (res < 0)
+    goto out;
+
+  wfs_dcache_remove(image, dir_block, name);
+  *ino = wfs_ino_make(dir_block, res);
+  res = 0;
+
+out:
+  pthread_rwlock_unlock(lock);
+
+  if (res == 0)
+    res = wfs_image_commit(image, true);
+
+  return res;
+}
+
+/* Removes the empty directory named "name" from the directory identified
+ * by "parent". Returns 0 on success, error code otherwise.
+ */
+int
+wfs_image_rmdir(wfs_image_t *image, wfs_ino_t parent, const char *name)
+{
+  wfs_file_entry_t parent_entry, entry, current;
+
+  if (image->read_only)
+    return -EROFS;
+
+  int res = wfs_image_get_dir(image, parent, &parent_entry);
+  if (res < 0)
+    return res;
+
+  int slot = wfs_dir_lookup(image, &parent_entry, name, &entry);
+  if (slot < 0)
+    return slot;
+
+  if (!wfs_file_entry_is_directory(&entry))
+    return -ENOTDIR;
+
+  uint16_t dir_block = wfs_file_entry_get_dir_block(&parent_entry);
+
+  wfs_image_lock_dirs(image, dir_block, entry.start_block);
+
+  /* Make sure neither directory was changed before the locks were
+   * taken.
+   */
+  res = wfs_image_check_dir(image, parent, &parent_entry);
+  if (res == 0)
+    res = wfs_image_read_entry(image, dir_block, slot, &current);
+  if (res == 0 && memcmp(&current, &entry, sizeof(wfs_file_entry_t)))
+    res = -ENOENT;
+  if (res < 0)
+    goto out;
+
+  res = wfs_file_entry_operation_locked(image, &entry,
+                                        WFS_FILE_ENTRY_OP_COUNT,
+                                        NULL, NULL, NULL);
+  if (res > 0)
+    res = -ENOTEMPTY;
+  if (res < 0)
+    goto out;
+
+  res = wfs_file_entry_operation_locked(image, &parent_entry,
+                                        WFS_FILE_ENTRY_OP_RMDIR, &entry,
+                                        NULL, NULL);
+  if (res < 0)
+    goto out;
+
+  pthread_rwlock_wrlock(&image->table_lock);
+  wfs_block_free_chain(image, entry.start_block);
+  pthread_rwlock_unlock(&image->table_lock);
+
+  /* The block may be reused for another directory, so negative dentries
+   * and the index recorded for this one must go as well.
+   */
+  wfs_dcache_invalidate(image);
+  wfs_dir_index_drop(image, entry.start_block);
+  res = 0;
+
+out:
+  wfs_image_unlock_dirs(image, dir_block, entry.start_block);
+
+  if (res == 0)
+    res = wfs_image_commit(image, true);
+
+  return res;
+}
+
+
+/*
+ * Inode reference counts
+ */
+
+static inline wfs_inode_ref_t **
+wfs_inode_table_bucket(wfs_image_t *image, wfs_ino_t ino)
+{
+  return &image->inodes[(ino ^ (ino >> 32)) & (WFS_INODE_TABLE_SIZE - 1)];
+}
+
+/* Records that the inode number "ino" has been handed out once more. */
+void
+wfs_inode_ref(wfs_image_t *image, wfs_ino_t ino)
+{
+  wfs_inode_ref_t **bucket = wfs_inode_table_bucket(image, ino);
+
+  pthread_mutex_lock(&image->inodes_lock);
+
+  wfs_inode_ref_t *ref;
+  for (ref = *bucket; ref; ref = ref->next)
+    {
+      if (ref->ino == ino)
+        {
+          ref->nlookup++;
+          break;
+        }
+    }
+
+  if (!ref && (ref = malloc(sizeof(wfs_inode_ref_t))))
+    {
+      ref->ino = ino;
+      ref->nlookup = 1;
+      ref->next = *bucket;
+      *bucket = ref;
+    }
+
+  pthread_mutex_unlock(&image->inodes_lock);
+}
+
+/* Drops "nlookup" references to "ino". */
+void
+wfs_inode_forget(wfs_image_t *image, wfs_ino_t ino, uint64_t nlookup)
+{
+  pthread_mutex_lock(&image->inodes_lock);
+
+  for (wfs_inode_ref_t **ref = wfs_inode_table_bucket(image, ino);
+       *ref; ref = &(*ref)->next)
+    {
+      if ((*ref)->ino != ino)
+        continue;
+
+      if ((*ref)->nlookup > nlookup)
+        (*ref)->nlookup -= nlookup;
+      else
+        {
+          wfs_inode_ref_t *dead = *ref;
+          *ref = dead->next;
+          free(dead);
+        }
+      break;
+    }
+
+  pthread_mutex_unlock(&image->inodes_lock);
+}
+
+/* Returns whether the kernel may still use the inode number "ino". Slots
+ * of such inodes must not be reused for new entries.
+ */
+bool
+wfs_inode_is_referenced(wfs_image_t *image, wfs_ino_t ino)
+{
+  bool referenced = false;
+
+  pthread_mutex_lock(&image->inodes_lock);
+
+  for (wfs_inode_ref_t *ref = *wfs_inode_table_bucket(image, ino);
+       ref; ref = ref->next)
+    {
+      if (ref->ino == ino)
+        {
+          referenced = true;
+          break;
+        }
+    }
+
+  pthread_mutex_unlock(&image->inodes_lock);
+
+  return referenced;
+}
+
+static void
+wfs_inode_table_clear(wfs_image_t *image)
+{
+  for (int i = 0; i < WFS_INODE_TABLE_SIZE; i++)
+    {
+      wfs_inode_ref_t *ref = image->inodes[i];
+      while (ref)
+        {
+          wfs_inode_ref_t *next = ref->next;
+          free(ref);
+          ref = next;
+        }
+      image->inodes[i] = NULL;
+    }
+}
+
+
+/*
+ * Path based lookups
+ */
+
+/* Iterates over the components of the first "len" bytes of a path
+ * without copying it. Separators are skipped, so repeated and trailing
+ * slashes yield no empty components.
+ */
+typedef struct
+{
+  const char *pos;
+  const char *end;
+} wfs_path_iter_t;
+
+static void
+wfs_path_iter_init(wfs_path_iter_t *iter, const char *path, size_t len)
+{
+  iter->pos = path;
+  iter->end = path + len;
+}
+
+/* Stores the next component in "name" and "len", which is not
+ * terminated. Returns false if there are no more components.
+ */
+static bool
+wfs_path_iter_next(wfs_path_iter_t *iter, const char **name, size_t *len)
+{
+  while (iter->pos < iter->end && *iter->pos == '/')
+    iter->pos++;
+  if (iter->pos == iter->end)
+    return false;
+
+  *name = iter->pos;
+  while (iter->pos < iter->end && *iter->pos != '/')
+    iter->pos++;
+  *len = iter->pos - *name;
+
+  return true;
+}
+
+/* Searches the file system hierarchy to find the file entry for
+ * the given path. Returns true if the operation succeeded.
+ */
+bool
+wfs_find_entry(wfs_image_t *image, const char *path, wfs_file_entry_t *entry)
+{
+  size_t len = strnlen(path, PATH_MAX);
+  if (len == 0 || path[0] != '/')
+    return false;
+
+  /* Note that an empty entry represents the root directory. */
+  wfs_file_entry_t current_entry = { { 0, }, };
+  wfs_path_iter_t iter;
+  const char *name;
+  size_t name_len;
+
+  wfs_path_iter_init(&iter, path, len);
+  while (wfs_path_iter_next(&iter, &name, &name_len))
+    {
+      if (!wfs_file_entry_is_empty(&current_entry)
+          && !wfs_file_entry_is_directory(&current_entry))
+        return false;
+
+      /* Verify length of component is not larger than maximum allowed
+       * filename size.
+       */
+      if (name_len >= WFS_FILENAME_SIZE)
+        return false;
+
+      char filename[WFS_FILENAME_SIZE];
+      memcpy(filename, name, name_len);
+      filename[name_len] = 0;
+
+      wfs_file_entry_t parent_entry = current_entry;
+      if (wfs_dir_lookup(image, &parent_entry, filename, &current_entry) < 0)
+        return false;
+    }
+
+  *entry = current_entry;
+
+  return true;
+}
@@ -0,0 +1,791 @@
+/* wfsimage -- Access to WFS file system images.
+ *
+ * Copyright (C) 2017  Leiden University, The Netherlands.
+ *
+ * Based on code from:
+ *
+ * S.M.A.C.K - An operating system kernel
+ * Copyright (C) 2010,2011,2013 Mattias Holm and Kristian Rietveld
+ * For licensing and a full list of authors of the kernel, see the files
+ * COPYING and AUTHORS.
+ */
+
+#ifndef __WFSIMAGE_H__
+#define __WFSIMAGE_H__
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <sys/types.h>
+
+#include "wfs.h"
+
+
+/*
+ * Inode numbers
+ */
+
+/* Every file entry is identified by its location: the directory block
+ * containing it (0 for the root entry table) and its slot within that
+ * directory. The root directory itself has inode number 1.
+ */
+typedef uint64_t wfs_ino_t;
+
+#define WFS_ROOT_INO 1
+
+static inline wfs_ino_t
+wfs_ino_make(uint16_t dir_block, int slot)
+{
+  return ((wfs_ino_t)dir_block << 32) | (slot + 2);
+}
+
+static inline uint16_t
+wfs_ino_get_dir_block(wfs_ino_t ino)
+{
+  return ino >> 32;
+}
+
+static inline int
+wfs_ino_get_slot(wfs_ino_t ino)
+{
+  return (int)(ino & 0xffffffff) - 2;
+}
+
+/* Returns the block holding the entries of directory "dir", or 0 for
+ * the root directory, which is represented by the empty entry.
+ */
+static inline uint16_t
+wfs_file_entry_get_dir_block(const wfs_file_entry_t *dir)
+{
+  return wfs_file_entry_is_empty(dir) ? 0 : dir->start_block;
+}
+
+static inline int
+wfs_dir_get_n_entries(const wfs_layout_t *layout, uint16_t dir_block)
+{
+  return dir_block ? layout->n_dir_files : WFS_N_FILES;
+}
+
+static inline off_t
+wfs_dir_get_entry_offset(const wfs_layout_t *layout, uint16_t dir_block,
+                         int slot)
+{
+  off_t start = dir_block ? wfs_get_block_offset(layout, dir_block - 1)
+      : layout->entries_start;
+
+  return start + slot * sizeof(wfs_file_entry_t);
+}
+
+
+/*
+ * WFS image management
+ */
+
+/* Entry of the dentry cache, which maps a name within a directory to
+ * its slot and file entry. A negative dentry records that the name does
+ * not exist.
+ */
+typedef struct wfs_dentry
+{
+  struct wfs_dentry *next;
+  uint32_t hash;
+  uint16_t dir_block;
+  bool negative;
+  int slot;
+  wfs_file_entry_t entry;
+  char name[WFS_FILENAME_SIZE];
+} wfs_dentry_t;
+
+#define WFS_DCACHE_SIZE 1024 /* Number of hash buckets, power of two */
+#define WFS_DCACHE_MAX_ENTRIES 8192
+
+/* Number of lookups of an inode number handed out to the kernel. */
+typedef struct wfs_inode_ref
+{
+  struct wfs_inode_ref *next;
+  wfs_ino_t ino;
+  uint64_t nlookup;
+} wfs_inode_ref_t;
+
+#define WFS_INODE_TABLE_SIZE 1024 /* Number of hash buckets, power of two */
+
+#define WFS_N_DIR_LOCKS 64 /* Directory locks, indexed by directory block */
+#define WFS_N_FILE_LOCKS 64 /* File locks, indexed by inode number */
+#define WFS_N_CHAIN_GENERATIONS 1024 /* Indexed by first block of chain */
+#define WFS_PENDING_HASH_SIZE 256 /* Buckets of queued entries, power of two */
+
+/* File entry that waits to be written to the image until the journal
+ * holds its record on disk, see wfs_image_write_entry(). "position" is
+ * the number of bytes of records logged up to and including its own.
+ */
+typedef struct wfs_pending_entry
+{
+  struct wfs_pending_entry *next;
+  uint64_t position;
+  uint16_t dir_block;
+  int slot;
+  wfs_file_entry_t entry;
+} wfs_pending_entry_t;
+
+/* Data block held by the block cache. Unused blocks have block number
+ * WFS_BLOCK_FREE.
+ */
+typedef struct wfs_cached_block
+{
+  struct wfs_cached_block *hash_next;
+  struct wfs_cached_block *lru_prev;
+  struct wfs_cached_block *lru_next;
+  uint16_t block;
+  bool dirty;
+  uint8_t *data;
+} wfs_cached_block_t;
+
+#define WFS_BCACHE_SIZE (1024 * 1024) /* 1 Mb of cached data */
+#define WFS_BCACHE_HASH_SIZE 4096    /* Number of hash buckets, power of two */
+#define WFS_BCACHE_FLUSH_INTERVAL 5  /* Seconds between timed flushes */
+
+/* Operations whose latency is recorded. */
+typedef enum
+{
+  WFS_OP_GETATTR,
+  WFS_OP_READDIR,
+  WFS_OP_OPEN,
+  WFS_OP_READ,
+  WFS_OP_WRITE,
+  WFS_N_OPS
+} wfs_op_t;
+
+/* Latency bucket i counts operations that took less than 2^i
+ * microseconds, the last bucket counts all slower ones.
+ */
+#define WFS_STATS_N_BUCKETS 24
+
+/* Counters describing the work done by the image. All of them are
+ * updated with relaxed atomic additions, without holding any lock.
+ */
+typedef struct
+{
+  uint64_t n_ops[WFS_N_OPS];
+  uint64_t op_time[WFS_N_OPS];  /* Nanoseconds */
+  uint64_t op_latency[WFS_N_OPS][WFS_STATS_N_BUCKETS];
+
+  uint64_t n_reads;             /* Read requests issued to the image */
+  uint64_t n_bytes_read;
+  uint64_t n_table_lookups;
+  uint64_t n_chain_hops;        /* Blocks walked to map file offsets */
+  uint64_t n_dcache_hits;
+  uint64_t n_dcache_misses;
+  uint64_t n_bcache_hits;
+  uint64_t n_bcache_misses;
+  uint64_t n_preload_dirs;      /* Directories scanned by the preload */
+  uint64_t n_preload_entries;
+  uint64_t preload_time;        /* Nanoseconds, set once it completes */
+  uint64_t n_snapshot_copies;   /* Shared blocks copied before a write */
+  uint64_t n_journal_records;
+  uint64_t n_journal_syncs;     /* Batches of records written */
+  uint64_t n_defrag_walks;      /* Completed walks of the defragmenter */
+  uint64_t n_defrag_files;      /* Files moved to a single run */
+  uint64_t n_defrag_blocks;
+  uint64_t n_arena_chunks;      /* Chunks added to request arenas */
+} wfs_stats_t;
+
+#define WFS_STATS_ADD(image, counter, n) \
+  __atomic_fetch_add(&(image)->stats.counter, (n), __ATOMIC_RELAXED)
+
+typedef enum
+{
+  WFS_IO_PREAD,
+  WFS_IO_MMAP,
+  WFS_IO_URING
+} wfs_io_mode_t;
+
+/* Flags of wfs_image_open_striped(). */
+typedef enum
+{
+  WFS_OPEN_SNAPSHOT  = 1 << 0,  /* Open the snapshot of the image */
+  WFS_OPEN_READ_ONLY = 1 << 1   /* Leave the image and its files alone */
+} wfs_open_flags_t;
+
+struct wfs_uring;
+struct wfs_arena;
+struct wfs_preload;
+struct wfs_snapshot;
+struct wfs_journal;
+struct wfs_defrag;
+
+/* An image may be used from multiple threads. Locks must be taken in
+ * the following order:
+ *
+ *  1. a file handle lock,
+ *  2. the lock of the file that is written,
+ *  3. the lock of the directory whose entries are accessed,
+ *  4. table_lock, protecting the block table, the free map and
+ *     chain_generations,
+ *  5. dcache_lock, inodes_lock, bcache_lock, pending_lock or the
+ *     journal lock.
+ */
+typedef struct
+{
+  int fd;
+  const char *filename;
+
+  /* The devices the data blocks of a striped image are stored on, see
+   * wfs.h; "stripe_fds[0]" is "fd". Offsets in the image are translated
+   * to offsets on these devices by wfs_image_locate().
+   */
+  int stripe_fds[WFS_MAX_STRIPES];
+
+  /* In WFS_IO_MMAP mode the complete file system is mapped at "map"
+   * and all image accesses are served with memcpy. In WFS_IO_URING
+   * mode segments are transferred through an io_uring owned by the
+   * calling thread, found through "uring_key"; "urings" lists all of
+   * them.
+   */
+  wfs_io_mode_t io_mode;
+  uint8_t *map;
+  size_t map_size;
+
+  pthread_key_t uring_key;
+  struct wfs_uring *urings;
+  pthread_mutex_t uring_lock;
+
+  /* Request temporaries are allocated from an arena owned by the
+   * calling thread, found through "arena_key"; "arenas" lists all of
+   * them. See wfsarena.c.
+   */
+  pthread_key_t arena_key;
+  bool arena_key_created;
+  struct wfs_arena *arenas;
+  pthread_mutex_t arena_lock;
+
+  /* Feature bits taken from the magic and the geometry of the image,
+   * see wfs.h.
+   */
+  uint32_t features;
+  wfs_layout_t layout;
+
+  /* Taken from the superblock, 0 for images without one. */
+  uint32_t image_id;
+
+  /* In-memory copy of the block table, loaded when the image is opened.
+   * Modified entries are tracked as a single dirty range [start, end)
+   * which is written back by wfs_block_table_flush(). The copy always
+   * uses the original chain format; in extent images the table is
+   * converted when it is loaded and written back.
+   */
+  uint16_t *block_table;
+  int block_table_dirty_start;
+  int block_table_dirty_end;
+
+  /* Incremented whenever the block chain of a file is modified or
+   * freed, indexed by the first block of the chain, so that cached
+   * chains can be recognized as stale without those of other files
+   * being discarded as well.
+   */
+  unsigned int chain_generations[WFS_N_CHAIN_GENERATIONS];
+
+  /* Free space bitmap with a bit set for every free block, kept in sync
+   * with the block table by wfs_block_table_write(). Allocations start
+   * searching at "alloc_hint", the block following the previous
+   * allocation.
+   */
+  uint32_t *free_map;
+  int alloc_hint;
+  int n_free_blocks;
+
+  pthread_rwlock_t table_lock;
+
+  /* Readers of the entries of a directory hold its lock shared, code
+   * modifying entry slots holds it exclusively.
+   */
+  pthread_rwlock_t dir_locks[WFS_N_DIR_LOCKS];
+
+  /* Code that writes, truncates or moves a file holds its lock, so that
+   * the size and block chain of the file stay in place while the data
+   * is transferred with only the directory lock shared.
+   */
+  pthread_mutex_t file_locks[WFS_N_FILE_LOCKS];
+
+  wfs_dentry_t *dcache[WFS_DCACHE_SIZE];
+  int dcache_n_entries;
+  pthread_mutex_t dcache_lock;
+
+  /* Name hashes of the slots of every directory read so far, indexed by
+   * directory block; empty slots have hash 0. An index is installed
+   * atomically by the first reader of a directory and updated by the
+   * holder of the exclusive directory lock.
+   */
+  uint32_t **dir_index;
+
+  wfs_inode_ref_t *inodes[WFS_INODE_TABLE_SIZE];
+  pthread_mutex_t inodes_lock;
+
+  /* Write-back cache of file data blocks, not used in WFS_IO_MMAP
+   * mode. "bcache" is NULL if the cache is disabled. "bcache_seq" is
+   * incremented whenever dirty blocks have been written back, so that
+   * uncached reads can detect that they raced with a flush.
+   */
+  wfs_cached_block_t *bcache;
+  int bcache_n_blocks;
+  uint8_t *bcache_data;
+  wfs_cached_block_t *bcache_hash[WFS_BCACHE_HASH_SIZE];
+  wfs_cached_block_t *bcache_lru_head;
+  wfs_cached_block_t *bcache_lru_tail;
+  wfs_cached_block_t *bcache_unused;
+  int bcache_n_dirty;
+  unsigned int bcache_seq;
+  wfs_cached_block_t **bcache_dirty;
+  uint8_t *bcache_flush_buf;
+  pthread_mutex_t bcache_lock;
+
+  /* Thread writing back dirty blocks, see wfs_bcache_start(). */
+  pthread_t bcache_flusher;
+  bool bcache_flusher_started;
+  pthread_cond_t bcache_cond;
+  bool bcache_stop;
+
+  /* Background walk of the directory tree, see wfs_preload_start(). */
+  struct wfs_preload *preload;
+
+  /* Background defragmenter, see wfsdefrag.c. */
+  struct wfs_defrag *defrag;
+
+  /* Bitmap of the blocks used by the snapshot of the image, or NULL if
+   * it has none; see wfssnapshot.c. Such blocks are not modified or
+   * reused, writes to them are redirected to new blocks. Protected by
+   * table_lock and only replaced while all directory locks are held.
+   */
+  uint32_t *snapshot_map;
+  uint32_t snapshot_generation;
+
+  /* Metadata of the snapshot that is shown instead of that of the image
+   * when opened with wfs_image_open_snapshot(), which makes the image
+   * read-only.
+   */
+  struct wfs_snapshot *snapshot;
+  bool read_only;
+
+  /* Log of the metadata modifications not yet synced to the image, see
+   * wfsjournal.c. NULL for read-only images.
+   */
+  struct wfs_journal *journal;
+
+  /* Entries stored while the image has a journal, which may only reach
+   * the image once their records are on disk. Readers of entries take
+   * them from here first. "pending_dirs" counts the queued entries of
+   * the directories sharing each directory lock.
+   */
+  wfs_pending_entry_t *pending[WFS_PENDING_HASH_SIZE];
+  int n_pending;
+  int pending_dirs[WFS_N_DIR_LOCKS];
+  pthread_mutex_t pending_lock;
+
+  wfs_stats_t stats;
+} wfs_image_t;
+
+static inline pthread_rwlock_t *
+wfs_image_get_dir_lock(wfs_image_t *image, uint16_t dir_block)
+{
+  return &image->dir_locks[dir_block % WFS_N_DIR_LOCKS];
+}
+
+static inline pthread_mutex_t *
+wfs_image_get_file_lock(wfs_image_t *image, wfs_ino_t ino)
+{
+  return &image->file_locks[(ino ^ (ino >> 32)) % WFS_N_FILE_LOCKS];
+}
+
+#define WFS_FREE_MAP_WORD_BITS 32
+
+static inline int
+wfs_free_map_get_n_words(const wfs_image_t *image)
+{
+  return (image->layout.n_blocks + WFS_FREE_MAP_WORD_BITS - 1)
+      / WFS_FREE_MAP_WORD_BITS;
+}
+
+/* Returns whether the block with index "idx" is used by the snapshot. */
+static inline bool
+wfs_snapshot_is_shared(const wfs_image_t *image, int idx)
+{
+  return image->snapshot_map
+      && (image->snapshot_map[idx / WFS_FREE_MAP_WORD_BITS]
+          & (1u << (idx % WFS_FREE_MAP_WORD_BITS)));
+}
+
+int          wfs_image_format (const char    *filename,
+                              uint32_t       block_size,
+                              uint32_t       n_blocks);
+wfs_image_t *wfs_image_open (const char    *filename,
+                             wfs_io_mode_t  io_mode);
+wfs_image_t *wfs_image_open_snapshot (const char    *filename,
+                                      wfs_io_mode_t  io_mode);
+wfs_image_t *wfs_image_open_striped (const char    *filename,
+                                     wfs_io_mode_t  io_mode,
+                                     int            flags,
+                                     char * const  *stripes,
+                                     int            n_stripes);
+void         wfs_image_close (wfs_image_t *img);
+int          wfs_image_sync  (wfs_image_t *image,
+                              bool         wait);
+
+ssize_t      wfs_image_pread  (wfs_image_t *image,
+                               void        *buf,
+                               size_t       size,
+                               off_t        offset);
+ssize_t      wfs_image_pwrite (wfs_image_t *image,
+                               const void  *buf,
+                               size_t       size,
+                               off_t        offset);
+
+/* A contiguous range of the image that is transferred from or into
+ * "buf" as a single request.
+ */
+typedef struct
+{
+  void *buf;
+  size_t size;
+  off_t offset;
+} wfs_io_segment_t;
+
+#define WFS_MAX_SEGMENTS 64
+
+int          wfs_image_locate         (wfs_image_t            *image,
+                                       off_t                   offset,
+                                       size_t                 *size,
+                                       off_t                  *device_offset);
+int          wfs_image_split_segments (wfs_image_t            *image,
+                                       const wfs_io_segment_t *segments,
+                                       int                     n_segments,
+                                       wfs_io_segment_t      **pieces);
+
+int          wfs_image_read_segments (wfs_image_t      *image,
+                                      wfs_io_segment_t *segments,
+                                      int               n_segments);
+int          wfs_image_write_segments (wfs_image_t            *image,
+                                       const wfs_io_segment_t *segments,
+                                       int                     n_segments);
+void         wfs_image_prefetch       (wfs_image_t            *image,
+                                       const wfs_io_segment_t *segments,
+                                       int                     n_segments);
+
+
+/*
+ * io_uring backend, only available when built with WFS_HAVE_IO_URING
+ */
+
+int          wfs_uring_init              (wfs_image_t            *image);
+void         wfs_uring_fini              (wfs_image_t            *image);
+int          wfs_uring_transfer_segments (wfs_image_t            *image,
+                                          const wfs_io_segment_t *segments,
+                                          int                     n_segments,
+                                          bool                    write);
+int          wfs_uring_prefetch          (wfs_image_t            *image,
+                                          const wfs_io_segment_t *segments,
+                                          int                     n_segments);
+
+
+/*
+ * Per-thread request arenas
+ */
+
+int          wfs_arena_init    (wfs_image_t *image);
+void         wfs_arena_fini    (wfs_image_t *image);
+void        *wfs_arena_alloc   (wfs_image_t *image,
+                                size_t       size);
+void         wfs_arena_release (wfs_image_t *image,
+                                void        *ptr);
+void         wfs_arena_reset   (wfs_image_t *image);
+
+
+/*
+ * Block cache
+ */
+
+int          wfs_bcache_init           (wfs_image_t *image);
+int          wfs_bcache_start          (wfs_image_t *image);
+void         wfs_bcache_fini           (wfs_image_t *image);
+int          wfs_bcache_flush          (wfs_image_t *image);
+void         wfs_bcache_discard        (wfs_image_t *image,
+                                        uint16_t     block);
+
+unsigned int wfs_bcache_begin_read     (wfs_image_t            *image);
+bool         wfs_bcache_end_read       (wfs_image_t            *image,
+                                        wfs_io_segment_t       *segments,
+                                        int                     n_segments,
+                                        unsigned int            seq);
+int          wfs_bcache_write_segments (wfs_image_t            *image,
+                                        const wfs_io_segment_t *segments,
+                                        int                     n_segments);
+bool         wfs_bcache_is_dirty       (wfs_image_t            *image,
+                                        const wfs_io_segment_t *segments,
+                                        int                     n_segments);
+
+
+/*
+ * Sidecar index file
+ */
+
+bool         wfs_sidecar_load          (wfs_image_t *image);
+void         wfs_sidecar_save          (wfs_image_t *image);
+void         wfs_sidecar_remove        (const char  *filename);
+uint32_t     wfs_crc32                 (uint32_t     crc,
+                                        const void  *data,
+                                        size_t       size);
+
+/*
+ * Snapshots
+ */
+
+int          wfs_snapshot_init         (wfs_image_t *image);
+int          wfs_snapshot_open         (wfs_image_t *image);
+void         wfs_snapshot_fini         (wfs_image_t *image);
+int          wfs_snapshot_create       (wfs_image_t *image);
+void         wfs_snapshot_remove       (const char  *filename);
+ssize_t      wfs_snapshot_pread        (wfs_image_t *image,
+                                        void        *buf,
+                                        size_t       size,
+                                        off_t        offset);
+
+/*
+ * Metadata journal
+ */
+
+int          wfs_journal_open             (wfs_image_t            *image);
+int          wfs_journal_get_n_pending    (wfs_image_t            *image);
+void         wfs_journal_close            (wfs_image_t            *image,
+                                           bool                   synced);
+void         wfs_journal_log_table        (wfs_image_t            *image,
+                                           uint16_t               idx,
+                                           uint16_t               value);
+uint64_t     wfs_journal_log_entry        (wfs_image_t            *image,
+                                           uint16_t               dir_block,
+                                           int                    slot,
+                                           const wfs_file_entry_t *entry);
+void         wfs_journal_log_clear        (wfs_image_t            *image,
+                                           uint16_t               block);
+int          wfs_journal_write            (wfs_image_t            *image);
+int          wfs_journal_commit           (wfs_image_t            *image);
+uint64_t     wfs_journal_get_n_durable    (wfs_image_t            *image);
+bool         wfs_journal_needs_checkpoint (wfs_image_t            *image);
+int          wfs_journal_checkpoint       (wfs_image_t            *image);
+void         wfs_journal_remove           (const char             *filename);
+
+/*
+ * Metadata preload
+ */
+
+int          wfs_preload_start         (wfs_image_t *image);
+void         wfs_preload_stop          (wfs_image_t *image);
+
+/*
+ * Defragmenter
+ */
+
+int          wfs_defrag_start          (wfs_image_t *image);
+void         wfs_defrag_stop           (wfs_image_t *image);
+void         wfs_defrag_print          (wfs_image_t *image,
+                                        FILE        *stream);
+
+/*
+ * Statistics
+ */
+
+uint64_t     wfs_stats_begin           (void);
+void         wfs_stats_end             (wfs_image_t *image,
+                                        wfs_op_t     op,
+                                        uint64_t     start);
+int          wfs_stats_print           (wfs_image_t *image,
+                                        FILE        *stream);
+
+
+/*
+ * Low-level file system routines
+ */
+
+/* The block table functions require the caller to hold table_lock,
+ * exclusively for wfs_block_table_write().
+ */
+static inline uint16_t
+wfs_block_table_read(wfs_image_t *image, uint16_t idx)
+{
+  /* Treat out of range indices, e.g. resulting from a corrupt chain,
+   * as the end of the chain.
+   */
+  if (idx >= image->layout.n_blocks)
+    return WFS_BLOCK_EOF;
+
+  return image->block_table[idx];
+}
+
+void         wfs_block_table_write (wfs_image_t *image,
+                                    uint16_t     idx,
+                                    uint16_t     value);
+int          wfs_block_table_flush (wfs_image_t *image);
+
+uint16_t     wfs_get_next_block    (wfs_image_t *image,
+                                    uint16_t     current_block);
+
+int          wfs_block_alloc_run   (wfs_image_t *image,
+                                    uint16_t     goal,
+                                    int          n,
+                                    uint16_t    *first);
+uint16_t     wfs_block_alloc       (wfs_image_t *image,
+                                    uint16_t     goal);
+void         wfs_block_free_chain  (wfs_image_t *image,
+                                    uint16_t     block);
+
+
+/*
+ * Open file handles
+ */
+
+/* State kept for every open file. "blocks" maps logical block numbers
+ * to physical block numbers. It is filled lazily while the block chain
+ * is walked, and discarded when the chain has been modified since.
+ * Concurrent requests on the same handle are serialized by "lock".
+ *
+ * "ra_next" is the offset at which a sequential read would continue,
+ * "ra_window" the current readahead window in blocks and "ra_end" the
+ * logical block up to which readahead has been issued.
+ */
+typedef struct
+{
+  pthread_mutex_t lock;
+
+  off_t ra_next;
+  int ra_window;
+  int ra_end;
+
+  uint16_t start_block;
+  unsigned int generation;
+
+  uint16_t *blocks;
+  int n_blocks;
+  int n_allocated;
+  bool complete;
+} wfs_file_handle_t;
+
+#define WFS_READAHEAD_MIN 16   /* Initial readahead window, in blocks */
+#define WFS_READAHEAD_MAX 512  /* Largest readahead window, in blocks */
+
+void         wfs_file_handle_init     (wfs_file_handle_t      *fh,
+                                       const wfs_file_entry_t *entry);
+void         wfs_file_handle_fini     (wfs_file_handle_t      *fh);
+void         wfs_file_handle_validate (wfs_image_t            *image,
+                                       wfs_file_handle_t      *fh,
+                                       const wfs_file_entry_t *entry);
+uint16_t     wfs_file_handle_map      (wfs_image_t            *image,
+                                       wfs_file_handle_t      *fh,
+                                       int                     n);
+uint16_t     wfs_get_current_block    (wfs_image_t            *image,
+                                       wfs_file_handle_t      *fh,
+                                       off_t                   off,
+                                       uint16_t               *block_position);
+
+ssize_t      wfs_file_read            (wfs_image_t            *image,
+                                       const wfs_file_entry_t *entry,
+                                       wfs_file_handle_t      *fh,
+                                       char                   *buf,
+                                       size_t                  size,
+                                       off_t                   offset);
+ssize_t      wfs_file_read_segments   (wfs_image_t            *image,
+                                       const wfs_file_entry_t *entry,
+                                       wfs_file_handle_t      *fh,
+                                       size_t                  size,
+                                       off_t                   offset,
+                                       wfs_io_segment_t       *segments,
+                                       int                     max_segments,
+                                       int                    *n_segments);
+ssize_t      wfs_file_write           (wfs_image_t            *image,
+                                       wfs_ino_t               ino,
+                                       wfs_file_handle_t      *fh,
+                                       const char             *buf,
+                                       size_t                  size,
+                                       off_t                   offset);
+int          wfs_file_truncate        (wfs_image_t            *image,
+                                       wfs_ino_t               ino,
+                                       wfs_file_handle_t      *fh,
+                                       off_t                   size);
+int          wfs_file_relocate        (wfs_image_t            *image,
+                                       wfs_ino_t               ino,
+                                       const wfs_file_entry_t *entry,
+                                       int                     max_blocks,
+                                       uint16_t               *old_chain);
+
+
+/*
+ * Generic file entry operations
+ */
+
+typedef enum
+{
+  WFS_FILE_ENTRY_OP_FIND,
+  WFS_FILE_ENTRY_OP_COUNT,
+  WFS_FILE_ENTRY_OP_CALLBACK,
+  WFS_FILE_ENTRY_OP_MKDIR,
+  WFS_FILE_ENTRY_OP_RMDIR
+} wfs_file_entry_op_t;
+
+typedef void (* wfs_file_entry_op_callback_t) (wfs_file_entry_t *entry,
+                                               int               slot,
+                                               void             *data);
+
+int          wfs_file_entry_operation (wfs_image_t                  *image,
+                                       const wfs_file_entry_t       *parent,
+                                       wfs_file_entry_op_t           op,
+                                       wfs_file_entry_t             *entry,
+                                       wfs_file_entry_op_callback_t  callback,
+                                       void                         *callback_data);
+
+int          wfs_dir_lookup           (wfs_image_t            *image,
+                                       const wfs_file_entry_t *parent,
+                                       const char             *name,
+                                       wfs_file_entry_t       *entry);
+
+void         wfs_dcache_invalidate    (wfs_image_t *image);
+int          wfs_dir_index_init       (wfs_image_t *image);
+int          wfs_dir_preload          (wfs_image_t                  *image,
+                                       wfs_ino_t                     ino,
+                                       const wfs_file_entry_t       *dir,
+                                       wfs_file_entry_op_callback_t  callback,
+                                       void                         *callback_data);
+
+int          wfs_image_get_entry      (wfs_image_t      *image,
+                                       wfs_ino_t         ino,
+                                       wfs_file_entry_t *entry);
+int          wfs_image_lookup         (wfs_image_t      *image,
+                                       wfs_ino_t         parent,
+                                       const char       *name,
+                                       wfs_file_entry_t *entry,
+                                       wfs_ino_t        *ino);
+int          wfs_image_create         (wfs_image_t      *image,
+                                       wfs_ino_t         parent,
+                                       const char       *name,
+                                       bool              is_directory,
+                                       wfs_file_entry_t *entry,
+                                       wfs_ino_t        *ino);
+int          wfs_image_rmdir          (wfs_image_t      *image,
+                                       wfs_ino_t         parent,
+                                       const char       *name);
+
+void         wfs_inode_ref            (wfs_image_t *image,
+                                       wfs_ino_t    ino);
+void         wfs_inode_forget         (wfs_image_t *image,
+                                       wfs_ino_t    ino,
+                                       uint64_t     nlookup);
+bool         wfs_inode_is_referenced  (wfs_image_t *image,
+                                       wfs_ino_t    ino);
+
+
+/*
+ * Path based lookups
+ */
+
+bool         wfs_find_entry           (wfs_image_t      *image,
+                                       const char       *path,
+                                       wfs_file_entry_t *entry);
+
+#endif /* __WFSIMAGE_H__ */
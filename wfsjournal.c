@@ -0,0 +1,804 @@
+/* wfsjournal -- Write-ahead journal of the metadata of WFS images.
+ *
+ * Copyright (C) 2017  Leiden University, The Netherlands.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+
+#include "wfsimage.h"
+
+
+/* Modifications of the block table and of file entries are logged in
+ * the file "<image>.jnl" before they are allowed to reach the image.
+ * The block table is only written back to the image when it is synced.
+ * Entries are queued in memory by wfs_image_write_entry() and written
+ * to the image once the journal holds their records, and so all records
+ * logged before them, on disk. An entry in the image therefore never
+ * refers to blocks whose allocation was lost, neither when the process
+ * is killed nor when the system crashes.
+ *
+ * Records are collected in memory and written as a batch. Writing a
+ * batch does not wait for the disk; the journal is synced only when a
+ * request needs its records to be durable, see wfs_journal_commit(), and
+ * when the image is synced. A thread that needs its records on disk
+ * syncs the journal itself, unless another thread is already doing so;
+ * then it waits and the records written in the meantime are covered by
+ * the next sync. Concurrent requests thus share a single fdatasync, and
+ * writes to files, which only become durable when the file is synced,
+ * do not wait for one at all. After a crash of the system, the batches
+ * that were not synced are lost, together with the queued entries that
+ * depend on them; the image and the journal stay consistent.
+ *
+ * When the image is opened, the valid batches found in the journal are
+ * replayed in order, which brings the metadata up to date with every
+ * completed request. The journal is emptied whenever the image has been
+ * synced while no modification was in progress: when it is closed, and
+ * once the journal has grown beyond WFS_JOURNAL_CHECKPOINT_SIZE. File
+ * data is not journaled.
+ *
+ * The file consists of the header followed by the batches, each of
+ * which is a batch header followed by its records.
+ */
+
+#define WFS_JOURNAL_MAGIC 0x4c4e4a57 /* "WJNL" */
+#define WFS_JOURNAL_BATCH_MAGIC 0x54414257 /* "WBAT" */
+#define WFS_JOURNAL_VERSION 1
+
+#define WFS_JOURNAL_CHECKPOINT_SIZE (4 * 1024 * 1024)
+
+typedef struct
+{
+  uint32_t magic;
+  uint32_t version;
+  uint32_t block_size;
+  uint32_t n_blocks;
+} wfs_journal_header_t;
+
+typedef struct
+{
+  uint32_t magic;
+  uint32_t sequence;   /* Starts at 1 once the journal is emptied */
+  uint32_t size;       /* Of the records */
+  uint32_t crc;        /* Of the records */
+} wfs_journal_batch_t;
+
+typedef enum
+{
+  WFS_JOURNAL_TABLE = 1,  /* Block table entry "block" became "value" */
+  WFS_JOURNAL_ENTRY,      /* Slot "value" of directory "block" */
+  WFS_JOURNAL_CLEAR       /* Directory block "block" was emptied */
+} wfs_journal_record_type_t;
+
+/* Records of type WFS_JOURNAL_ENTRY are followed by the new entry. */
+typedef struct
+{
+  uint16_t type;
+  uint16_t block;
+  uint16_t value;
+  uint16_t reserved;
+} wfs_journal_record_t;
+
+struct wfs_journal
+{
+  int fd;
+  off_t size;              /* Of the journal file */
+  uint32_t sequence;       /* Of the next batch */
+
+  /* Records that have not been written yet, preceded by room for the
+   * batch header.
+   */
+  uint8_t *buf;
+  size_t buf_size;
+  size_t buf_capacity;
+
+  /* Bytes of records logged since the image was opened, and the number
+   * of those that have been written to the journal and that are on disk.
+   */
+  uint64_t n_logged;
+  uint64_t n_written;
+  uint64_t n_durable;
+
+  bool syncing;            /* The journal is being synced */
+  bool resetting;          /* The journal is being emptied */
+  int error;               /* Of a failed batch, fatal */
+
+  pthread_mutex_t lock;
+  pthread_cond_t cond;
+};
+
+static char *
+wfs_journal_get_filename(const char *filename)
+{
+  char *journal = malloc(strlen(filename) + sizeof(".jnl"));
+  if (journal)
+    {
+      strcpy(journal, filename);
+      strcat(journal, ".jnl");
+    }
+
+  return journal;
+}
+
+static size_t
+wfs_journal_record_size(const wfs_journal_record_t *record)
+{
+  return sizeof(wfs_journal_record_t)
+      + (record->type == WFS_JOURNAL_ENTRY ? sizeof(wfs_file_entry_t) : 0);
+}
+
+static bool
+wfs_journal_record_is_valid(wfs_image_t *image,
+                            const wfs_journal_record_t *record)
+{
+  const uint16_t n_blocks = image->layout.n_blocks;
+
+  switch (record->type)
+    {
+      case WFS_JOURNAL_TABLE:
+        return record->block < n_blocks
+            && (record->value <= n_blocks || record->value == WFS_BLOCK_EOF);
+
+      case WFS_JOURNAL_ENTRY:
+        return record->block <= n_blocks
+            && record->value < wfs_dir_get_n_entries(&image->layout,
+                                                     record->block);
+
+      case WFS_JOURNAL_CLEAR:
+        return record->block != WFS_BLOCK_FREE && record->block <= n_blocks;
+    }
+
+  return false;
+}
+
+/* Returns the size of the part of the journal "data" that consists of
+ * complete, valid batches. A crash may have left a partially written
+ * batch at the end.
+ */
+static size_t
+wfs_journal_get_valid_size(wfs_image_t *image, const uint8_t *data,
+                           size_t size)
+{
+  size_t pos = sizeof(wfs_journal_header_t);
+  uint32_t sequence = 1;
+
+  while (size - pos >= sizeof(wfs_journal_batch_t))
+    {
+      wfs_journal_batch_t batch;
+      memcpy(&batch, data + pos, sizeof(batch));
+
+      const size_t start = pos + sizeof(batch);
+      if (batch.magic != WFS_JOURNAL_BATCH_MAGIC
+          || batch.sequence != sequence
+          || batch.size > size - start
+          || batch.crc != wfs_crc32(0, data + start, batch.size))
+        break;
+
+      size_t end = start + batch.size;
+      size_t record_pos = start;
+      while (record_pos < end)
+        {
+          wfs_journal_record_t record;
+          if (end - record_pos < sizeof(record))
+            break;
+          memcpy(&record, data + record_pos, sizeof(record));
+          if (!wfs_journal_record_is_valid(image, &record)
+              || end - record_pos < wfs_journal_record_size(&record))
+            break;
+          record_pos += wfs_journal_record_size(&record);
+        }
+      if (record_pos != end)
+        break;
+
+      pos = end;
+      sequence++;
+    }
+
+  return pos;
+}
+
+/* Walks the records in the first "size" bytes of "data", which must
+ * have been validated. Unless "apply" is set, only determines for every
+ * block the number of the last record freeing it, in "last_free".
+ * Otherwise the records are applied to the image; those storing
+ * entries in a directory block that is freed later are skipped, as the
+ * block may hold file data written since. Returns the number of
+ * records, or -1 on failure.
+ */
+static int
+wfs_journal_walk(wfs_image_t *image, const uint8_t *data, size_t size,
+                 uint32_t *last_free, bool apply)
+{
+  const uint32_t block_size = image->layout.block_size;
+  uint8_t *zero = NULL;
+  uint32_t n = 0;
+  size_t pos = sizeof(wfs_journal_header_t);
+  int res = 0;
+
+  while (pos < size && res == 0)
+    {
+      wfs_journal_batch_t batch;
+      memcpy(&batch, data + pos, sizeof(batch));
+
+      const size_t end = pos + sizeof(batch) + batch.size;
+      for (pos += sizeof(batch); pos < end && res == 0; n++)
+        {
+          wfs_journal_record_t record;
+          wfs_file_entry_t entry;
+
+          memcpy(&record, data + pos, sizeof(record));
+          if (record.type == WFS_JOURNAL_ENTRY)
+            memcpy(&entry, data + pos + sizeof(record), sizeof(entry));
+          pos += wfs_journal_record_size(&record);
+
+          if (!apply)
+            {
+              if (record.type == WFS_JOURNAL_TABLE
+                  && record.value == WFS_BLOCK_FREE)
+                last_free[record.block + 1] = n + 1;
+            }
+          else if (record.type == WFS_JOURNAL_TABLE)
+            wfs_block_table_write(image, record.block, record.value);
+          else if (last_free[record.block] > n)
+            continue;
+          else if (record.type == WFS_JOURNAL_ENTRY)
+            {
+              off_t offset = wfs_dir_get_entry_offset(&image->layout,
+                                                      record.block,
+                                                      record.value);
+              if (wfs_image_pwrite(image, &entry, sizeof(entry), offset)
+                  != sizeof(entry))
+                res = -1;
+            }
+          else
+            {
+              off_t offset = wfs_get_block_offset(&image->layout,
+                                                  record.block - 1);
+              if (!zero && !(zero = calloc(1, block_size)))
+                res = -1;
+              else if (wfs_image_pwrite(image, zero, block_size, offset)
+                       != block_size)
+                res = -1;
+            }
+        }
+    }
+
+  free(zero);
+
+  return res < 0 ? res : n;
+}
+
+/* Reads the journal from "fd" into a buffer stored in "data", which is
+ * NULL if the journal is empty. Returns its size, or -1 on failure.
+ */
+static ssize_t
+wfs_journal_read(int fd, uint8_t **data)
+{
+  struct stat buf;
+
+  *data = NULL;
+  if (fstat(fd, &buf) < 0)
+    return -1;
+  if (buf.st_size > 0 && !(*data = malloc(buf.st_size)))
+    return -1;
+
+  size_t done = 0;
+  while (done < buf.st_size)
+    {
+      ssize_t n = pread(fd, *data + done, buf.st_size - done, done);
+      if (n < 0 && errno == EINTR)
+        continue;
+      if (n <= 0)
+        {
+          free(*data);
+          *data = NULL;
+          return -1;
+        }
+      done += n;
+    }
+
+  return done;
+}
+
+/* Walks the journal "data" read from "filename", applying its records to
+ * the image if "apply" is set. Returns the number of records, or -1 on
+ * failure.
+ */
+static int
+wfs_journal_replay(wfs_image_t *image, const char *filename,
+                   const uint8_t *data, size_t size, bool apply)
+{
+  wfs_journal_header_t header;
+  if (size < sizeof(header))
+    return 0;
+  memcpy(&header, data, sizeof(header));
+
+  if (header.magic != WFS_JOURNAL_MAGIC
+      || header.version != WFS_JOURNAL_VERSION
+      || header.block_size != image->layout.block_size
+      || header.n_blocks != image->layout.n_blocks)
+    {
+      fprintf(stderr, "warning: ignoring journal '%s', which does not "
+              "match the image\n", filename);
+      return 0;
+    }
+
+  size = wfs_journal_get_valid_size(image, data, size);
+
+  uint32_t *last_free = calloc(image->layout.n_blocks + 1, sizeof(uint32_t));
+  if (!last_free)
+    return -1;
+
+  int res = wfs_journal_walk(image, data, size, last_free, false);
+  if (apply)
+    res = wfs_journal_walk(image, data, size, last_free, true);
+  free(last_free);
+
+  return res;
+}
+
+/* Empties the journal, leaving only its header. The caller must own the
+ * journal file, either because it is not used yet or by setting
+ * "resetting". Returns 0 on success, error code otherwise.
+ */
+static int
+wfs_journal_reset(wfs_image_t *image, struct wfs_journal *journal)
+{
+  wfs_journal_header_t header =
+    {
+      WFS_JOURNAL_MAGIC, WFS_JOURNAL_VERSION,
+      image->layout.block_size, image->layout.n_blocks
+    };
+
+  if (ftruncate(journal->fd, 0) < 0)
+    return -errno;
+
+  ssize_t n = pwrite(journal->fd, &header, sizeof(header), 0);
+  if (n != sizeof(header))
+    return n < 0 ? -errno : -EIO;
+
+  if (fdatasync(journal->fd) < 0)
+    return -errno;
+
+  journal->size = sizeof(header);
+  journal->sequence = 1;
+
+  return 0;
+}
+
+/* Opens the journal of "image", creating it if necessary, and replays
+ * the records it holds. Must be called once the block table has been
+ * loaded, before the free space bitmap and the indexes are set up.
+ * Returns 0 on success, -1 on failure.
+ */
+int
+wfs_journal_open(wfs_image_t *image)
+{
+  image->journal = NULL;
+
+  char *filename = wfs_journal_get_filename(image->filename);
+  if (!filename)
+    return -1;
+
+  struct wfs_journal *journal = calloc(1, sizeof(struct wfs_journal));
+  if (!journal)
+    {
+      free(filename);
+      return -1;
+    }
+
+  journal->fd = open(filename, O_RDWR | O_CREAT, 0644);
+  if (journal->fd < 0)
+    {
+      fprintf(stderr, "error: could not open journal '%s': %s\n",
+              filename, strerror(errno));
+      free(journal);
+      free(filename);
+      return -1;
+    }
+
+  uint8_t *data;
+  ssize_t size = wfs_journal_read(journal->fd, &data);
+  int res = size < 0 ? -1 : 0;
+
+  /* The index file describes the image as it was before the replay. */
+  if (res == 0 && data)
+    {
+      res = wfs_journal_replay(image, filename, data, size, true);
+      if (res > 0)
+        {
+          fprintf(stderr, "warning: image '%s' was not closed cleanly, "
+                  "replayed %d journal records\n", image->filename, res);
+          wfs_sidecar_remove(image->filename);
+          res = wfs_image_sync(image, true) < 0 ? -1 : 0;
+        }
+    }
+  free(data);
+
+  if (res < 0)
+    fprintf(stderr, "error: could not replay journal '%s'\n", filename);
+  else if ((res = wfs_journal_reset(image, journal)) < 0)
+    fprintf(stderr, "error: could not write journal '%s': %s\n",
+            filename, strerror(-res));
+
+  journal->buf_size = sizeof(wfs_journal_batch_t);
+  journal->buf_capacity = 4096;
+  journal->buf = malloc(journal->buf_capacity);
+  if (!journal->buf)
+    res = -1;
+
+  free(filename);
+
+  /* A journal that could not be replayed is kept as it is. */
+  if (res < 0)
+    {
+      close(journal->fd);
+      free(journal->buf);
+      free(journal);
+      return -1;
+    }
+
+  pthread_mutex_init(&journal->lock, NULL);
+  pthread_cond_init(&journal->cond, NULL);
+  image->journal = journal;
+
+  return 0;
+}
+
+/* Returns the number of records in the journal of "image", which was
+ * opened read-only, that are replayed once it is opened for writing. The
+ * journal is left as it is. Returns -1 on failure.
+ */
+int
+wfs_journal_get_n_pending(wfs_image_t *image)
+{
+  char *filename = wfs_journal_get_filename(image->filename);
+  if (!filename)
+    return -1;
+
+  int fd = open(filename, O_RDONLY);
+  if (fd < 0)
+    {
+      int res = errno == ENOENT ? 0 : -1;
+      free(filename);
+      return res;
+    }
+
+  uint8_t *data;
+  ssize_t size = wfs_journal_read(fd, &data);
+  int res = size < 0 ? -1 : 0;
+  if (res == 0 && data)
+    res = wfs_journal_replay(image, filename, data, size, false);
+
+  free(data);
+  close(fd);
+  free(filename);
+
+  return res;
+}
+
+/* Closes the journal of "image". If "synced" is set the image holds
+ * all logged modifications and the journal is emptied.
+ */
+void
+wfs_journal_close(wfs_image_t *image, bool synced)
+{
+  struct wfs_journal *journal = image->journal;
+  if (!journal)
+    return;
+
+  int res = synced ? wfs_journal_reset(image, journal) : 0;
+  if (res < 0)
+    fprintf(stderr, "warning: could not empty journal of '%s': %s\n",
+            image->filename, strerror(-res));
+
+  close(journal->fd);
+  pthread_mutex_destroy(&journal->lock);
+  pthread_cond_destroy(&journal->cond);
+  free(journal->buf);
+  free(journal);
+  image->journal = NULL;
+}
+
+/* Appends a record to the pending batch. Returns the number of bytes of
+ * records logged up to and including this one. Errors are reported by
+ * the next call to wfs_journal_write() or wfs_journal_commit().
+ */
+static uint64_t
+wfs_journal_log(wfs_image_t *image, wfs_journal_record_type_t type,
+                uint16_t block, uint16_t value,
+                const wfs_file_entry_t *entry)
+{
+  struct wfs_journal *journal = image->journal;
+  wfs_journal_record_t record = { type, block, value, 0 };
+  const size_t size = wfs_journal_record_size(&record);
+
+  pthread_mutex_lock(&journal->lock);
+
+  if (journal->buf_size + size > journal->buf_capacity)
+    {
+      size_t capacity = journal->buf_capacity * 2;
+      uint8_t *buf = realloc(journal->buf, capacity);
+      if (!buf)
+        {
+          journal->error = -ENOMEM;
+          pthread_mutex_unlock(&journal->lock);
+          return journal->n_logged;
+        }
+      journal->buf = buf;
+      journal->buf_capacity = capacity;
+    }
+
+  memcpy(journal->buf + journal->buf_size, &record, sizeof(record));
+  if (entry)
+    memcpy(journal->buf + journal->buf_size + sizeof(record), entry,
+           sizeof(wfs_file_entry_t));
+  journal->buf_size += size;
+  journal->n_logged += size;
+  const uint64_t position = journal->n_logged;
+
+  pthread_mutex_unlock(&journal->lock);
+
+  WFS_STATS_ADD(image, n_journal_records, 1);
+
+  return position;
+}
+
+/* Logs that block table entry "idx" is set to "value". Called by
+ * wfs_block_table_write(), with table_lock held exclusively.
+ */
+void
+wfs_journal_log_table(wfs_image_t *image, uint16_t idx, uint16_t value)
+{
+  wfs_journal_log(image, WFS_JOURNAL_TABLE, idx, value, NULL);
+}
+
+/* Logs that "entry" is stored in "slot" of the directory stored at
+ * "dir_block". The caller must hold the lock of the directory
+ * exclusively. Returns the position of the record, which may be
+ * compared with wfs_journal_get_n_durable().
+ */
+uint64_t
+wfs_journal_log_entry(wfs_image_t *image, uint16_t dir_block, int slot,
+                      const wfs_file_entry_t *entry)
+{
+  return wfs_journal_log(image, WFS_JOURNAL_ENTRY, dir_block, slot, entry);
+}
+
+/* Logs that the new directory at "block" was emptied. */
+void
+wfs_journal_log_clear(wfs_image_t *image, uint16_t block)
+{
+  wfs_journal_log(image, WFS_JOURNAL_CLEAR, block, 0, NULL);
+}
+
+/* Writes the pending batch to the journal, without waiting for it to
+ * reach the disk. Called with the journal lock held, by a thread that
+ * does not empty the journal.
+ */
+static void
+wfs_journal_write_locked(wfs_image_t *image, struct wfs_journal *journal)
+{
+  const size_t size = journal->buf_size;
+  if (size == sizeof(wfs_journal_batch_t) || journal->error != 0)
+    return;
+
+  wfs_journal_batch_t batch =
+    {
+      WFS_JOURNAL_BATCH_MAGIC, journal->sequence,
+      size - sizeof(wfs_journal_batch_t),
+      wfs_crc32(0, journal->buf + sizeof(wfs_journal_batch_t),
+                size - sizeof(wfs_journal_batch_t))
+    };
+  memcpy(journal->buf, &batch, sizeof(batch));
+
+  /* The batch only goes to the page cache, so the lock is kept. */
+  int res = 0;
+  size_t done = 0;
+  while (res == 0 && done < size)
+    {
+      ssize_t n = pwrite(journal->fd, journal->buf + done, size - done,
+                         journal->size + done);
+      if (n < 0 && errno == EINTR)
+        continue;
+      if (n <= 0)
+        res = n < 0 ? -errno : -EIO;
+      else
+        done += n;
+    }
+
+  if (res < 0)
+    {
+      fprintf(stderr, "error: could not write journal of '%s': %s\n",
+              image->filename, strerror(-res));
+      journal->error = res;
+      return;
+    }
+
+  journal->size += size;
+  journal->sequence++;
+  journal->n_written = journal->n_logged;
+  journal->buf_size = sizeof(wfs_journal_batch_t);
+}
+
+/* Writes the records logged so far to the journal, without waiting for
+ * them to reach the disk. Returns 0 on success, error code otherwise.
+ */
+int
+wfs_journal_write(wfs_image_t *image)
+{
+  struct wfs_journal *journal = image->journal;
+  if (!journal)
+    return 0;
+
+  pthread_mutex_lock(&journal->lock);
+
+  while (journal->resetting)
+    pthread_cond_wait(&journal->cond, &journal->lock);
+
+  wfs_journal_write_locked(image, journal);
+  int res = journal->error;
+
+  pthread_mutex_unlock(&journal->lock);
+
+  return res;
+}
+
+/* Writes the pending batch and syncs the journal. Called with the
+ * journal lock held, which is released during the sync. Batches may be
+ * written by other threads meanwhile; they are covered by the next sync.
+ */
+static void
+wfs_journal_sync_locked(wfs_image_t *image, struct wfs_journal *journal)
+{
+  wfs_journal_write_locked(image, journal);
+  if (journal->error != 0)
+    return;
+
+  const uint64_t n_written = journal->n_written;
+  journal->syncing = true;
+
+  pthread_mutex_unlock(&journal->lock);
+
+  int res = fdatasync(journal->fd) < 0 ? -errno : 0;
+
+  WFS_STATS_ADD(image, n_journal_syncs, 1);
+
+  pthread_mutex_lock(&journal->lock);
+
+  if (res == 0)
+    journal->n_durable = n_written;
+  else
+    {
+      fprintf(stderr, "error: could not sync journal of '%s': %s\n",
+              image->filename, strerror(-res));
+      journal->error = res;
+    }
+
+  journal->syncing = false;
+  pthread_cond_broadcast(&journal->cond);
+}
+
+/* Waits until all records logged so far are on disk, syncing the
+ * journal if no other thread is doing so already. Should be called
+ * without holding a directory lock, so that requests on the same
+ * directory can share the sync. Returns 0 on success, error code
+ * otherwise.
+ */
+int
+wfs_journal_commit(wfs_image_t *image)
+{
+  struct wfs_journal *journal = image->journal;
+  if (!journal)
+    return 0;
+
+  pthread_mutex_lock(&journal->lock);
+
+  const uint64_t n_logged = journal->n_logged;
+  while (journal->n_durable < n_logged && journal->error == 0)
+    {
+      if (journal->syncing || journal->resetting)
+        pthread_cond_wait(&journal->cond, &journal->lock);
+      else
+        wfs_journal_sync_locked(image, journal);
+    }
+
+  int res = journal->n_durable < n_logged ? journal->error : 0;
+
+  pthread_mutex_unlock(&journal->lock);
+
+  return res;
+}
+
+/* Returns the number of bytes of records logged so far that are on
+ * disk.
+ */
+uint64_t
+wfs_journal_get_n_durable(wfs_image_t *image)
+{
+  struct wfs_journal *journal = image->journal;
+  if (!journal)
+    return 0;
+
+  pthread_mutex_lock(&journal->lock);
+  uint64_t n_durable = journal->n_durable;
+  pthread_mutex_unlock(&journal->lock);
+
+  return n_durable;
+}
+
+/* Returns whether the journal has grown large enough to be emptied. */
+bool
+wfs_journal_needs_checkpoint(wfs_image_t *image)
+{
+  struct wfs_journal *journal = image->journal;
+  if (!journal)
+    return false;
+
+  pthread_mutex_lock(&journal->lock);
+  bool res = journal->size >= WFS_JOURNAL_CHECKPOINT_SIZE;
+  pthread_mutex_unlock(&journal->lock);
+
+  return res;
+}
+
+/* Syncs the image and empties the journal, if it still needs to be.
+ * The caller must hold all directory locks, so that no modification is
+ * in progress. The journal is kept if records were logged while the
+ * image was synced, as they may not have reached it. Returns 0 on
+ * success, error code otherwise.
+ */
+int
+wfs_journal_checkpoint(wfs_image_t *image)
+{
+  struct wfs_journal *journal = image->journal;
+  if (!wfs_journal_needs_checkpoint(image))
+    return 0;
+
+  pthread_mutex_lock(&journal->lock);
+  const uint64_t n_logged = journal->n_logged;
+  pthread_mutex_unlock(&journal->lock);
+
+  int res = wfs_image_sync(image, true);
+  if (res < 0)
+    return res;
+
+  pthread_mutex_lock(&journal->lock);
+  while (journal->syncing)
+    pthread_cond_wait(&journal->cond, &journal->lock);
+
+  if (journal->n_logged != n_logged)
+    {
+      pthread_mutex_unlock(&journal->lock);
+      return 0;
+    }
+
+  journal->resetting = true;
+  pthread_mutex_unlock(&journal->lock);
+
+  res = wfs_journal_reset(image, journal);
+
+  pthread_mutex_lock(&journal->lock);
+  journal->resetting = false;
+  pthread_cond_broadcast(&journal->cond);
+  pthread_mutex_unlock(&journal->lock);
+
+  return res;
+}
+
+/* Removes a journal left behind by a previous image stored at
+ * "filename", which is being replaced.
+ */
+void
+wfs_journal_remove(const char *filename)
+{
+  char *journal = wfs_journal_get_filename(filename);
+  if (journal)
+    unlink(journal);
+  free(journal);
+}
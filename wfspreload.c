@@ -0,0 +1,218 @@
+/* wfspreload -- Background preload of WFS directory metadata.
+ *
+ * Copyright (C) 2017  Leiden University, The Netherlands.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "wfsimage.h"
+
+
+/* The directory tree is walked breadth first by a few threads sharing a
+ * queue of directories still to be scanned. Scanning a directory enters
+ * its entries in the dentry cache and builds its index, so that lookups
+ * after mounting do not have to read the image. The walk runs at most
+ * once and ends when the queue is empty and no thread is scanning, or
+ * when the image is closed. The queue lock is taken while holding the
+ * lock of the directory being scanned.
+ */
+
+#define WFS_PRELOAD_N_THREADS 4
+
+typedef struct wfs_preload_dir
+{
+  struct wfs_preload_dir *next;
+  wfs_ino_t ino;
+  wfs_file_entry_t entry;
+} wfs_preload_dir_t;
+
+struct wfs_preload
+{
+  wfs_image_t *image;
+  uint64_t start;
+
+  pthread_mutex_t lock;
+  pthread_cond_t cond;
+  wfs_preload_dir_t *head;
+  wfs_preload_dir_t *tail;
+  int n_busy;
+  bool stop;
+
+  pthread_t threads[WFS_PRELOAD_N_THREADS];
+  int n_threads;
+};
+
+/* Appends a directory to the queue. The caller must hold the lock. */
+static void
+wfs_preload_push(struct wfs_preload *preload, wfs_ino_t ino,
+                 const wfs_file_entry_t *entry)
+{
+  wfs_preload_dir_t *dir = malloc(sizeof(wfs_preload_dir_t));
+  if (!dir)
+    return;
+
+  dir->next = NULL;
+  dir->ino = ino;
+  dir->entry = *entry;
+
+  if (preload->tail)
+    preload->tail->next = dir;
+  else
+    preload->head = dir;
+  preload->tail = dir;
+
+  pthread_cond_signal(&preload->cond);
+}
+
+struct wfs_preload_scan
+{
+  struct wfs_preload *preload;
+  uint16_t dir_block;
+  int n_entries;
+};
+
+static void
+wfs_preload_callback(wfs_file_entry_t *entry, int slot, void *data)
+{
+  struct wfs_preload_scan *scan = data;
+
+  scan->n_entries++;
+
+  if (wfs_file_entry_is_directory(entry))
+    {
+      pthread_mutex_lock(&scan->preload->lock);
+      wfs_preload_push(scan->preload, wfs_ino_make(scan->dir_block, slot),
+                       entry);
+      pthread_mutex_unlock(&scan->preload->lock);
+    }
+}
+
+static void *
+wfs_preload_thread(void *data)
+{
+  struct wfs_preload *preload = data;
+  wfs_image_t *image = preload->image;
+
+  pthread_mutex_lock(&preload->lock);
+
+  while (!preload->stop)
+    {
+      wfs_preload_dir_t *dir = preload->head;
+      if (!dir)
+        {
+          /* The last thread to go idle finds the walk completed. */
+          if (preload->n_busy == 0)
+            {
+              if (!__atomic_load_n(&image->stats.preload_time,
+                                   __ATOMIC_RELAXED))
+                __atomic_store_n(&image->stats.preload_time,
+                                 wfs_stats_begin() - preload->start,
+                                 __ATOMIC_RELAXED);
+              pthread_cond_broadcast(&preload->cond);
+              break;
+            }
+
+          pthread_cond_wait(&preload->cond, &preload->lock);
+          continue;
+        }
+
+      preload->head = dir->next;
+      if (!preload->head)
+        preload->tail = NULL;
+      preload->n_busy++;
+      pthread_mutex_unlock(&preload->lock);
+
+      struct wfs_preload_scan scan =
+        {
+          preload, wfs_file_entry_get_dir_block(&dir->entry), 0
+        };
+
+      /* Directories removed since they were queued are skipped. */
+      if (wfs_dir_preload(image, dir->ino, &dir->entry,
+                          wfs_preload_callback, &scan) == 0)
+        {
+          WFS_STATS_ADD(image, n_preload_dirs, 1);
+          WFS_STATS_ADD(image, n_preload_entries, scan.n_entries);
+        }
+      free(dir);
+
+      pthread_mutex_lock(&preload->lock);
+      preload->n_busy--;
+    }
+
+  pthread_mutex_unlock(&preload->lock);
+
+  return NULL;
+}
+
+/* Starts walking the directory tree of "image" in the background. Must
+ * be called after forking, as the walk runs in separate threads. Returns
+ * 0 on success, -1 on failure.
+ */
+int
+wfs_preload_start(wfs_image_t *image)
+{
+  struct wfs_preload *preload = calloc(1, sizeof(struct wfs_preload));
+  if (!preload)
+    {
+      fprintf(stderr, "error: could not allocate preload state\n");
+      return -1;
+    }
+
+  const wfs_file_entry_t root = { { 0, }, };
+
+  preload->image = image;
+  preload->start = wfs_stats_begin();
+  pthread_mutex_init(&preload->lock, NULL);
+  pthread_cond_init(&preload->cond, NULL);
+  wfs_preload_push(preload, WFS_ROOT_INO, &root);
+
+  for (int i = 0; i < WFS_PRELOAD_N_THREADS; i++)
+    {
+      if (pthread_create(&preload->threads[i], NULL, wfs_preload_thread,
+                         preload) != 0)
+        break;
+      preload->n_threads++;
+    }
+
+  image->preload = preload;
+
+  if (preload->n_threads == 0)
+    {
+      fprintf(stderr, "error: could not start preload thread\n");
+      wfs_preload_stop(image);
+      return -1;
+    }
+
+  return 0;
+}
+
+/* Stops the walk, if it is still running, and releases its state. */
+void
+wfs_preload_stop(wfs_image_t *image)
+{
+  struct wfs_preload *preload = image->preload;
+  if (!preload)
+    return;
+
+  pthread_mutex_lock(&preload->lock);
+  preload->stop = true;
+  pthread_cond_broadcast(&preload->cond);
+  pthread_mutex_unlock(&preload->lock);
+
+  for (int i = 0; i < preload->n_threads; i++)
+    pthread_join(preload->threads[i], NULL);
+
+  while (preload->head)
+    {
+      wfs_preload_dir_t *dir = preload->head;
+      preload->head = dir->next;
+      free(dir);
+    }
+
+  pthread_mutex_destroy(&preload->lock);
+  pthread_cond_destroy(&preload->cond);
+  free(preload);
+  image->preload = NULL;
+}
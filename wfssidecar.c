@@ -0,0 +1,317 @@
+/* wfssidecar -- Index file kept next to a WFS image.
+ *
+ * Copyright (C) 2017  Leiden University, The Netherlands.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "wfsimage.h"
+
+
+/* When an image is closed, the in-memory structures built from it, the
+ * free space bitmap and the directory indexes, are saved to the file
+ * "<image>.idx". The next open maps that file and takes the structures
+ * from it instead of rebuilding them, provided that it matches the
+ * image: the geometry, the size and modification time of the image, a
+ * CRC of its block table and the generation of its snapshot must be
+ * equal to the recorded ones, and the contents must match their own
+ * CRC. Otherwise the file is ignored and replaced at the next close.
+ *
+ * The file consists of the header, the free space bitmap, and a record
+ * for every indexed directory: its block, its number of slots and the
+ * name hash of every slot.
+ */
+
+#define WFS_SIDECAR_MAGIC 0x58444957 /* "WIDX" */
+#define WFS_SIDECAR_VERSION 1
+
+typedef struct
+{
+  uint32_t magic;
+  uint32_t version;
+  uint32_t features;
+  uint32_t block_size;
+  uint32_t n_blocks;
+  uint32_t n_free_blocks;
+  uint32_t n_dirs;
+  uint32_t table_crc;
+  uint64_t image_size;
+  int64_t image_mtime_sec;
+  int64_t image_mtime_nsec;
+  uint32_t data_crc;   /* Of everything following the header */
+  uint32_t snapshot;   /* Generation of the snapshot, 0 if none */
+} wfs_sidecar_header_t;
+
+typedef struct
+{
+  uint32_t dir_block;
+  uint32_t n_entries;
+} wfs_sidecar_dir_t;
+
+/* CRC-32 as used by zlib. */
+uint32_t
+wfs_crc32(uint32_t crc, const void *data, size_t size)
+{
+  const uint8_t *p = data;
+
+  crc = ~crc;
+  while (size--)
+    {
+      crc ^= *p++;
+      for (int i = 0; i < 8; i++)
+        crc = (crc >> 1) ^ (0xedb88320 & -(crc & 1));
+    }
+
+  return ~crc;
+}
+
+static char *
+wfs_sidecar_get_filename(const char *filename)
+{
+  char *sidecar = malloc(strlen(filename) + sizeof(".idx"));
+  if (sidecar)
+    {
+      strcpy(sidecar, filename);
+      strcat(sidecar, ".idx");
+    }
+
+  return sidecar;
+}
+
+/* Fills in the fields of "header" that identify the current state of
+ * "image". Returns 0 on success, -1 on failure.
+ */
+static int
+wfs_sidecar_init_header(wfs_image_t *image, wfs_sidecar_header_t *header)
+{
+  struct stat buf;
+
+  if (fstat(image->fd, &buf) < 0)
+    return -1;
+
+  memset(header, 0, sizeof(wfs_sidecar_header_t));
+  header->magic = WFS_SIDECAR_MAGIC;
+  header->version = WFS_SIDECAR_VERSION;
+  header->features = image->features;
+  header->block_size = image->layout.block_size;
+  header->n_blocks = image->layout.n_blocks;
+  header->table_crc = wfs_crc32(0, image->block_table,
+                                image->layout.block_table_size);
+  header->image_size = buf.st_size;
+  header->image_mtime_sec = buf.st_mtim.tv_sec;
+  header->image_mtime_nsec = buf.st_mtim.tv_nsec;
+  header->snapshot = image->snapshot_generation;
+
+  return 0;
+}
+
+/* Takes the free space bitmap and the directory indexes of "image" from
+ * its index file, which is validated against the loaded block table.
+ * Returns false if there is no usable index file; the structures must
+ * then be built instead.
+ */
+bool
+wfs_sidecar_load(wfs_image_t *image)
+{
+  char *filename = wfs_sidecar_get_filename(image->filename);
+  if (!filename)
+    return false;
+
+  int fd = open(filename, O_RDONLY);
+  free(filename);
+  if (fd < 0)
+    return false;
+
+  struct stat buf;
+  uint8_t *map = MAP_FAILED;
+  if (fstat(fd, &buf) == 0 && buf.st_size >= sizeof(wfs_sidecar_header_t))
+    map = mmap(NULL, buf.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (map == MAP_FAILED)
+    return false;
+
+  const size_t size = buf.st_size;
+  const wfs_sidecar_header_t *header = (const wfs_sidecar_header_t *)map;
+  const int n_words = wfs_free_map_get_n_words(image);
+  wfs_sidecar_header_t expected;
+  bool valid = false;
+
+  if (wfs_sidecar_init_header(image, &expected) == 0
+      && header->magic == expected.magic
+      && header->version == expected.version
+      && header->features == expected.features
+      && header->block_size == expected.block_size
+      && header->n_blocks == expected.n_blocks
+      && header->table_crc == expected.table_crc
+      && header->image_size == expected.image_size
+      && header->image_mtime_sec == expected.image_mtime_sec
+      && header->image_mtime_nsec == expected.image_mtime_nsec
+      && header->snapshot == expected.snapshot
+      && header->n_free_blocks <= header->n_blocks
+      && size >= sizeof(wfs_sidecar_header_t) + n_words * sizeof(uint32_t)
+      && header->data_crc
+         == wfs_crc32(0, map + sizeof(wfs_sidecar_header_t),
+                      size - sizeof(wfs_sidecar_header_t)))
+    valid = true;
+
+  image->free_map = NULL;
+  image->dir_index = NULL;
+  if (valid)
+    {
+      image->free_map = malloc(n_words * sizeof(uint32_t));
+      valid = image->free_map && wfs_dir_index_init(image) == 0;
+    }
+
+  size_t pos = sizeof(wfs_sidecar_header_t);
+  if (valid)
+    {
+      memcpy(image->free_map, map + pos, n_words * sizeof(uint32_t));
+      pos += n_words * sizeof(uint32_t);
+    }
+
+  for (uint32_t i = 0; valid && i < header->n_dirs; i++)
+    {
+      wfs_sidecar_dir_t dir;
+
+      valid = false;
+      if (size - pos < sizeof(dir))
+        break;
+      memcpy(&dir, map + pos, sizeof(dir));
+      pos += sizeof(dir);
+
+      if (dir.dir_block > image->layout.n_blocks
+          || image->dir_index[dir.dir_block]
+          || dir.n_entries
+             != wfs_dir_get_n_entries(&image->layout, dir.dir_block)
+          || size - pos < dir.n_entries * sizeof(uint32_t))
+        break;
+
+      uint32_t *index = malloc(dir.n_entries * sizeof(uint32_t));
+      if (!index)
+        break;
+      memcpy(index, map + pos, dir.n_entries * sizeof(uint32_t));
+      pos += dir.n_entries * sizeof(uint32_t);
+
+      image->dir_index[dir.dir_block] = index;
+      valid = true;
+    }
+
+  if (valid)
+    {
+      image->n_free_blocks = header->n_free_blocks;
+      image->alloc_hint = 0;
+    }
+
+  munmap(map, size);
+
+  if (!valid)
+    {
+      if (image->dir_index)
+        {
+          for (uint32_t i = 0; i <= image->layout.n_blocks; i++)
+            free(image->dir_index[i]);
+          free(image->dir_index);
+        }
+      free(image->free_map);
+      image->free_map = NULL;
+      image->dir_index = NULL;
+    }
+
+  return valid;
+}
+
+/* Removes the index file of the image "filename", once the image has
+ * been modified behind its back or replaced.
+ */
+void
+wfs_sidecar_remove(const char *filename)
+{
+  char *sidecar = wfs_sidecar_get_filename(filename);
+  if (sidecar)
+    unlink(sidecar);
+  free(sidecar);
+}
+
+/* Writes the index file of "image", which must be in sync with the
+ * image. The file is replaced atomically. Failures only result in a
+ * warning, as the index file is rebuilt if it is missing.
+ */
+void
+wfs_sidecar_save(wfs_image_t *image)
+{
+  if (!image->free_map || !image->dir_index)
+    return;
+
+  wfs_sidecar_header_t header;
+  if (wfs_sidecar_init_header(image, &header) < 0)
+    return;
+
+  const int n_words = wfs_free_map_get_n_words(image);
+  size_t size = sizeof(header) + n_words * sizeof(uint32_t);
+
+  for (uint32_t i = 0; i <= image->layout.n_blocks; i++)
+    {
+      if (!image->dir_index[i])
+        continue;
+
+      header.n_dirs++;
+      size += sizeof(wfs_sidecar_dir_t)
+          + wfs_dir_get_n_entries(&image->layout, i) * sizeof(uint32_t);
+    }
+  header.n_free_blocks = image->n_free_blocks;
+
+  uint8_t *data = malloc(size);
+  char *filename = wfs_sidecar_get_filename(image->filename);
+  char *tmp = filename ? malloc(strlen(filename) + sizeof(".tmp")) : NULL;
+  if (!data || !tmp)
+    {
+      free(data);
+      free(filename);
+      return;
+    }
+  sprintf(tmp, "%s.tmp", filename);
+
+  size_t pos = sizeof(header);
+  memcpy(data + pos, image->free_map, n_words * sizeof(uint32_t));
+  pos += n_words * sizeof(uint32_t);
+
+  for (uint32_t i = 0; i <= image->layout.n_blocks; i++)
+    {
+      if (!image->dir_index[i])
+        continue;
+
+      wfs_sidecar_dir_t dir = { i, wfs_dir_get_n_entries(&image->layout, i) };
+      memcpy(data + pos, &dir, sizeof(dir));
+      pos += sizeof(dir);
+      memcpy(data + pos, image->dir_index[i],
+             dir.n_entries * sizeof(uint32_t));
+      pos += dir.n_entries * sizeof(uint32_t);
+    }
+
+  header.data_crc = wfs_crc32(0, data + sizeof(header),
+                              size - sizeof(header));
+  memcpy(data, &header, sizeof(header));
+
+  int fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  bool written = fd >= 0 && write(fd, data, size) == size;
+  if (fd >= 0 && close(fd) < 0)
+    written = false;
+
+  if (!written || rename(tmp, filename) < 0)
+    {
+      fprintf(stderr, "warning: could not write index file '%s': %s\n",
+              filename, strerror(errno));
+      unlink(tmp);
+    }
+
+  free(data);
+  free(filename);
+  free(tmp);
+}
@@ -0,0 +1,565 @@
+/* wfssnapshot -- Copy-on-write snapshots of WFS images.
+ *
+ * Copyright (C) 2017  Leiden University, The Netherlands.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+
+#include "wfsimage.h"
+
+
+/* A snapshot freezes the state of an image at the time it is taken. It
+ * is stored in the file "<image>.snap", which holds a copy of the
+ * metadata area of the image (the magic, the superblock, the root
+ * entries and the block table) and of every directory block reachable
+ * from the root. File data is not copied: the blocks in use when the
+ * snapshot was taken are shared with the image and recorded in
+ * "snapshot_map". Writes to a shared block go to a newly allocated copy
+ * instead, see wfs_file_unshare(), and shared blocks that are freed are
+ * not reused until the snapshot is replaced by the next one.
+ *
+ * The snapshot is read through wfs_image_open_snapshot(), which serves
+ * reads of the metadata and directory blocks from the snapshot file and
+ * all other reads from the image. Taking a new snapshot releases the
+ * blocks only the previous one used, so it must not be mounted then.
+ */
+
+#define WFS_SNAPSHOT_MAGIC 0x504e5357 /* "WSNP" */
+#define WFS_SNAPSHOT_VERSION 2
+
+/* The snapshot records the id of the image it was taken of, so that
+ * one left behind by an image previously stored at the same path is
+ * not shown with the data of the new one. Images without a superblock
+ * have no id; the snapshot is removed when an image is created instead.
+ */
+typedef struct
+{
+  uint32_t magic;
+  uint32_t version;
+  uint32_t image_id;
+  uint32_t features;
+  uint32_t block_size;
+  uint32_t n_blocks;
+  uint32_t generation;     /* Incremented with every snapshot taken */
+  uint32_t n_dirs;
+  uint32_t data_crc;       /* Of everything following the header */
+  uint32_t reserved;
+  uint64_t metadata_size;
+} wfs_snapshot_header_t;
+
+/* Directory blocks follow the metadata, each preceded by its number. */
+typedef struct
+{
+  uint32_t block;
+} wfs_snapshot_dir_t;
+
+struct wfs_snapshot
+{
+  uint8_t *data;         /* Contents of the snapshot file */
+  uint8_t *metadata;
+  uint8_t **dir_blocks;  /* Indexed by block index, NULL if not copied */
+};
+
+static char *
+wfs_snapshot_get_filename(const char *filename)
+{
+  char *snapshot = malloc(strlen(filename) + sizeof(".snap"));
+  if (snapshot)
+    {
+      strcpy(snapshot, filename);
+      strcat(snapshot, ".snap");
+    }
+
+  return snapshot;
+}
+
+/* Reads and validates the snapshot file of "image". Returns the
+ * contents, of which the size is stored in "size", or NULL if there is
+ * no usable snapshot; "missing" tells whether there is no file at all.
+ */
+static uint8_t *
+wfs_snapshot_read(wfs_image_t *image, size_t *size, bool *missing)
+{
+  char *filename = wfs_snapshot_get_filename(image->filename);
+  if (!filename)
+    return NULL;
+
+  *missing = false;
+
+  int fd = open(filename, O_RDONLY);
+  if (fd < 0)
+    {
+      *missing = errno == ENOENT;
+      if (!*missing)
+        fprintf(stderr, "warning: could not open snapshot '%s': %s\n",
+                filename, strerror(errno));
+      free(filename);
+      return NULL;
+    }
+
+  struct stat buf;
+  uint8_t *data = NULL;
+  if (fstat(fd, &buf) == 0 && buf.st_size >= sizeof(wfs_snapshot_header_t))
+    data = malloc(buf.st_size);
+
+  size_t done = 0;
+  while (data && done < buf.st_size)
+    {
+      ssize_t res = read(fd, data + done, buf.st_size - done);
+      if (res < 0 && errno == EINTR)
+        continue;
+      if (res <= 0)
+        break;
+      done += res;
+    }
+  close(fd);
+
+  const wfs_layout_t *layout = &image->layout;
+  const wfs_snapshot_header_t *header = (const wfs_snapshot_header_t *)data;
+  const size_t record_size = sizeof(wfs_snapshot_dir_t) + layout->block_size;
+
+  if (!data || done != buf.st_size
+      || header->magic != WFS_SNAPSHOT_MAGIC
+      || header->version != WFS_SNAPSHOT_VERSION
+      || header->image_id != image->image_id
+      || header->features != image->features
+      || header->block_size != layout->block_size
+      || header->n_blocks != layout->n_blocks
+      || header->metadata_size != layout->data_start
+      || header->n_dirs > layout->n_blocks
+      || done != sizeof(wfs_snapshot_header_t) + header->metadata_size
+                 + header->n_dirs * record_size
+      || header->data_crc
+         != wfs_crc32(0, data + sizeof(wfs_snapshot_header_t),
+                      done - sizeof(wfs_snapshot_header_t)))
+    {
+      fprintf(stderr, "warning: ignoring snapshot '%s', which does not "
+              "match the image\n", filename);
+      free(data);
+      free(filename);
+      return NULL;
+    }
+
+  free(filename);
+  *size = done;
+
+  return data;
+}
+
+/* Loads the map of blocks used by the snapshot of "image", if it has
+ * one. Must be called before the free space bitmap is set up, which
+ * excludes these blocks. Returns 0 on success, -1 on failure.
+ */
+int
+wfs_snapshot_init(wfs_image_t *image)
+{
+  size_t size;
+  bool missing;
+
+  image->snapshot_map = NULL;
+  image->snapshot_generation = 0;
+
+  uint8_t *data = wfs_snapshot_read(image, &size, &missing);
+  if (!data)
+    return 0;
+
+  const wfs_layout_t *layout = &image->layout;
+  const wfs_snapshot_header_t *header = (const wfs_snapshot_header_t *)data;
+
+  image->snapshot_map = calloc(wfs_free_map_get_n_words(image),
+                               sizeof(uint32_t));
+  if (!image->snapshot_map)
+    {
+      fprintf(stderr, "error: could not allocate snapshot map\n");
+      free(data);
+      return -1;
+    }
+
+  /* Used blocks have a non-zero entry in either table format. */
+  const uint8_t *table = data + sizeof(wfs_snapshot_header_t)
+      + layout->block_table_start;
+  for (int i = 0; i < layout->n_blocks; i++)
+    {
+      uint16_t value;
+
+      memcpy(&value, table + i * sizeof(uint16_t), sizeof(uint16_t));
+      if (value != WFS_BLOCK_FREE)
+        image->snapshot_map[i / WFS_FREE_MAP_WORD_BITS]
+            |= 1u << (i % WFS_FREE_MAP_WORD_BITS);
+    }
+
+  image->snapshot_generation = header->generation;
+  free(data);
+
+  return 0;
+}
+
+/* Loads the snapshot of "image" to be shown instead of the image's own
+ * metadata. Must be called before the image's metadata is read. Returns
+ * 0 on success, -1 on failure.
+ */
+int
+wfs_snapshot_open(wfs_image_t *image)
+{
+  size_t size;
+  bool missing;
+
+  uint8_t *data = wfs_snapshot_read(image, &size, &missing);
+  if (!data)
+    {
+      if (missing)
+        fprintf(stderr, "error: image '%s' has no snapshot\n",
+                image->filename);
+      return -1;
+    }
+
+  const wfs_layout_t *layout = &image->layout;
+  const wfs_snapshot_header_t *header = (const wfs_snapshot_header_t *)data;
+  struct wfs_snapshot *snapshot = malloc(sizeof(struct wfs_snapshot));
+  uint8_t **dir_blocks = calloc(layout->n_blocks, sizeof(uint8_t *));
+  if (!snapshot || !dir_blocks)
+    {
+      fprintf(stderr, "error: could not allocate snapshot\n");
+      free(snapshot);
+      free(dir_blocks);
+      free(data);
+      return -1;
+    }
+
+  snapshot->data = data;
+  snapshot->metadata = data + sizeof(wfs_snapshot_header_t);
+  snapshot->dir_blocks = dir_blocks;
+
+  uint8_t *pos = snapshot->metadata + header->metadata_size;
+  for (uint32_t i = 0; i < header->n_dirs; i++)
+    {
+      wfs_snapshot_dir_t dir;
+
+      memcpy(&dir, pos, sizeof(dir));
+      pos += sizeof(dir);
+      if (dir.block >= 1 && dir.block <= layout->n_blocks)
+        dir_blocks[dir.block - 1] = pos;
+      pos += layout->block_size;
+    }
+
+  image->snapshot = snapshot;
+  image->snapshot_generation = header->generation;
+
+  return 0;
+}
+
+void
+wfs_snapshot_fini(wfs_image_t *image)
+{
+  if (image->snapshot)
+    {
+      free(image->snapshot->dir_blocks);
+      free(image->snapshot->data);
+      free(image->snapshot);
+      image->snapshot = NULL;
+    }
+
+  free(image->snapshot_map);
+  image->snapshot_map = NULL;
+}
+
+/* Serves a read from an image opened with wfs_image_open_snapshot() if
+ * the range at "offset" is stored in the snapshot, with the semantics of
+ * pread. Returns -1 if the range must be read from the image.
+ */
+ssize_t
+wfs_snapshot_pread(wfs_image_t *image, void *buf, size_t size, off_t offset)
+{
+  const struct wfs_snapshot *snapshot = image->snapshot;
+  const wfs_layout_t *layout = &image->layout;
+  const uint8_t *src;
+  size_t available;
+
+  if (offset < layout->data_start)
+    {
+      src = snapshot->metadata + offset;
+      available = layout->data_start - offset;
+    }
+  else
+    {
+      uint64_t idx = (offset - layout->data_start) / layout->block_size;
+      uint32_t block_position = (offset - layout->data_start)
+          % layout->block_size;
+
+      if (idx >= layout->n_blocks || !snapshot->dir_blocks[idx])
+        return -1;
+
+      src = snapshot->dir_blocks[idx] + block_position;
+      available = layout->block_size - block_position;
+    }
+
+  if (size > available)
+    size = available;
+  memcpy(buf, src, size);
+
+  return size;
+}
+
+/* Output buffer of wfs_snapshot_create(). */
+struct wfs_snapshot_buffer
+{
+  uint8_t *data;
+  size_t size;
+  size_t allocated;
+};
+
+static uint8_t *
+wfs_snapshot_buffer_grow(struct wfs_snapshot_buffer *buffer, size_t size)
+{
+  if (buffer->size + size > buffer->allocated)
+    {
+      size_t allocated = buffer->allocated * 2;
+      if (allocated < buffer->size + size)
+        allocated = buffer->size + size;
+
+      uint8_t *data = realloc(buffer->data, allocated);
+      if (!data)
+        return NULL;
+
+      buffer->data = data;
+      buffer->allocated = allocated;
+    }
+
+  uint8_t *pos = buffer->data + buffer->size;
+  buffer->size += size;
+
+  return pos;
+}
+
+/* Appends a copy of every directory block referenced by the "n_entries"
+ * entries at offset "pos" of "buffer" that was not copied before, as
+ * recorded in "visited". Returns 0 on success, error code otherwise.
+ */
+static int
+wfs_snapshot_copy_dirs(wfs_image_t *image,
+                       struct wfs_snapshot_buffer *buffer, size_t pos,
+                       int n_entries, uint32_t *visited, uint32_t *n_dirs)
+{
+  const wfs_layout_t *layout = &image->layout;
+
+  for (int i = 0; i < n_entries; i++)
+    {
+      wfs_file_entry_t entry;
+
+      /* The buffer may move while it grows. */
+      memcpy(&entry, buffer->data + pos + i * sizeof(wfs_file_entry_t),
+             sizeof(wfs_file_entry_t));
+      if (wfs_file_entry_is_empty(&entry)
+          || !wfs_file_entry_is_directory(&entry)
+          || entry.start_block < 1 || entry.start_block > layout->n_blocks)
+        continue;
+
+      int idx = entry.start_block - 1;
+      uint32_t bit = 1u << (idx % WFS_FREE_MAP_WORD_BITS);
+      if (visited[idx / WFS_FREE_MAP_WORD_BITS] & bit)
+        continue;
+      visited[idx / WFS_FREE_MAP_WORD_BITS] |= bit;
+
+      wfs_snapshot_dir_t dir = { entry.start_block };
+      uint8_t *record = wfs_snapshot_buffer_grow(buffer, sizeof(dir)
+                                                 + layout->block_size);
+      if (!record)
+        return -ENOMEM;
+
+      memcpy(record, &dir, sizeof(dir));
+      if (wfs_image_pread(image, record + sizeof(dir), layout->block_size,
+                          wfs_get_block_offset(layout, idx))
+          != layout->block_size)
+        return -EIO;
+
+      (*n_dirs)++;
+    }
+
+  return 0;
+}
+
+/* Writes "size" bytes of "data" to "filename" through a temporary file,
+ * so that an existing file is replaced atomically. Returns 0 on success,
+ * error code otherwise.
+ */
+static int
+wfs_snapshot_write(const char *filename, const uint8_t *data, size_t size)
+{
+  char *tmp = malloc(strlen(filename) + sizeof(".tmp"));
+  if (!tmp)
+    return -ENOMEM;
+  sprintf(tmp, "%s.tmp", filename);
+
+  int res = 0;
+  int fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  if (fd < 0)
+    res = -errno;
+
+  size_t done = 0;
+  while (res == 0 && done < size)
+    {
+      ssize_t written = write(fd, data + done, size - done);
+      if (written < 0 && errno == EINTR)
+        continue;
+      if (written <= 0)
+        res = written < 0 ? -errno : -EIO;
+      else
+        done += written;
+    }
+
+  if (res == 0 && fsync(fd) < 0)
+    res = -errno;
+  if (fd >= 0 && close(fd) < 0 && res == 0)
+    res = -errno;
+  if (res == 0 && rename(tmp, filename) < 0)
+    res = -errno;
+
+  if (res < 0 && fd >= 0)
+    unlink(tmp);
+  free(tmp);
+
+  return res;
+}
+
+/* Takes a snapshot of "image", replacing the previous one. Modifications
+ * are blocked while the metadata is copied, which includes waiting for
+ * the image to reach the disk. Returns 0 on success, error code
+ * otherwise.
+ */
+int
+wfs_snapshot_create(wfs_image_t *image)
+{
+  const wfs_layout_t *layout = &image->layout;
+
+  if (image->read_only)
+    return -EROFS;
+
+  char *filename = wfs_snapshot_get_filename(image->filename);
+  uint32_t *map = calloc(wfs_free_map_get_n_words(image), sizeof(uint32_t));
+  uint32_t *visited = calloc(wfs_free_map_get_n_words(image),
+                             sizeof(uint32_t));
+  struct wfs_snapshot_buffer buffer = { NULL, 0, 0 };
+  int res = 0;
+
+  if (!filename || !map || !visited
+      || !wfs_snapshot_buffer_grow(&buffer, sizeof(wfs_snapshot_header_t)
+                                   + layout->data_start))
+    res = -ENOMEM;
+
+  /* All modifications of entries and blocks are done while holding the
+   * lock of a directory. The locks are taken in order of their index.
+   */
+  for (int i = 0; i < WFS_N_DIR_LOCKS; i++)
+    pthread_rwlock_wrlock(&image->dir_locks[i]);
+
+  if (res == 0)
+    res = wfs_image_sync(image, true);
+
+  wfs_snapshot_header_t header;
+  memset(&header, 0, sizeof(header));
+  header.magic = WFS_SNAPSHOT_MAGIC;
+  header.version = WFS_SNAPSHOT_VERSION;
+  header.image_id = image->image_id;
+  header.features = image->features;
+  header.block_size = layout->block_size;
+  header.n_blocks = layout->n_blocks;
+  header.generation = image->snapshot_generation + 1;
+  header.metadata_size = layout->data_start;
+
+  const size_t metadata_pos = sizeof(wfs_snapshot_header_t);
+  if (res == 0
+      && wfs_image_pread(image, buffer.data + metadata_pos,
+                         layout->data_start, 0) != layout->data_start)
+    res = -EIO;
+
+  /* The directory blocks are copied breadth first, starting with the
+   * root entries.
+   */
+  if (res == 0)
+    res = wfs_snapshot_copy_dirs(image, &buffer,
+                                 metadata_pos + layout->entries_start,
+                                 WFS_N_FILES, visited, &header.n_dirs);
+  for (size_t pos = metadata_pos + layout->data_start;
+       res == 0 && pos < buffer.size;
+       pos += sizeof(wfs_snapshot_dir_t) + layout->block_size)
+    res = wfs_snapshot_copy_dirs(image, &buffer,
+                                 pos + sizeof(wfs_snapshot_dir_t),
+                                 layout->n_dir_files, visited,
+                                 &header.n_dirs);
+
+  if (res == 0)
+    {
+      header.data_crc = wfs_crc32(0, buffer.data + metadata_pos,
+                                  buffer.size - metadata_pos);
+      memcpy(buffer.data, &header, sizeof(header));
+      res = wfs_snapshot_write(filename, buffer.data, buffer.size);
+    }
+
+  if (res == 0)
+    {
+      pthread_rwlock_wrlock(&image->table_lock);
+
+      int n = 0;
+      for (; n + WFS_FREE_MAP_WORD_BITS <= layout->n_blocks;
+           n += WFS_FREE_MAP_WORD_BITS)
+        map[n / WFS_FREE_MAP_WORD_BITS] =
+            ~wfs_block_table_match32(image->block_table + n, WFS_BLOCK_FREE);
+      for (; n < layout->n_blocks; n++)
+        if (image->block_table[n] != WFS_BLOCK_FREE)
+          map[n / WFS_FREE_MAP_WORD_BITS]
+              |= 1u << (n % WFS_FREE_MAP_WORD_BITS);
+
+      /* Blocks that were only kept for the previous snapshot are free
+       * now.
+       */
+      for (int i = 0; image->snapshot_map && i < layout->n_blocks; i++)
+        {
+          if (wfs_snapshot_is_shared(image, i)
+              && image->block_table[i] == WFS_BLOCK_FREE)
+            {
+              image->free_map[i / WFS_FREE_MAP_WORD_BITS]
+                  |= 1u << (i % WFS_FREE_MAP_WORD_BITS);
+              image->n_free_blocks++;
+            }
+        }
+
+      free(image->snapshot_map);
+      image->snapshot_map = map;
+      image->snapshot_generation = header.generation;
+      map = NULL;
+
+      pthread_rwlock_unlock(&image->table_lock);
+    }
+
+  for (int i = WFS_N_DIR_LOCKS - 1; i >= 0; i--)
+    pthread_rwlock_unlock(&image->dir_locks[i]);
+
+  if (res < 0)
+    fprintf(stderr, "warning: could not take snapshot '%s': %s\n",
+            filename ? filename : image->filename, strerror(-res));
+
+  free(buffer.data);
+  free(visited);
+  free(map);
+  free(filename);
+
+  return res;
+}
+
+/* Removes the snapshot of the image "filename", which is being
+ * replaced.
+ */
+void
+wfs_snapshot_remove(const char *filename)
+{
+  char *snapshot = wfs_snapshot_get_filename(filename);
+  if (snapshot)
+    unlink(snapshot);
+  free(snapshot);
+}
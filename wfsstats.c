@@ -0,0 +1,134 @@
+/* wfsstats -- Operation and I/O statistics of WFS images.
+ *
+ * Copyright (C) 2017  Leiden University, The Netherlands.
+ */
+
+#include <stdio.h>
+#include <time.h>
+
+#include "wfsimage.h"
+
+
+static const char *wfs_op_names[WFS_N_OPS] =
+{
+  "getattr",
+  "readdir",
+  "open",
+  "read",
+  "write"
+};
+
+static uint64_t
+wfs_stats_now(void)
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+
+  return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static uint64_t
+wfs_stats_get(const uint64_t *counter)
+{
+  return __atomic_load_n(counter, __ATOMIC_RELAXED);
+}
+
+/* Returns the start time of an operation, to be passed to
+ * wfs_stats_end() once it has completed.
+ */
+uint64_t
+wfs_stats_begin(void)
+{
+  return wfs_stats_now();
+}
+
+/* Records the completion of an operation of type "op" that started at
+ * "start".
+ */
+void
+wfs_stats_end(wfs_image_t *image, wfs_op_t op, uint64_t start)
+{
+  uint64_t time = wfs_stats_now() - start;
+  uint64_t us = time / 1000;
+
+  int bucket = us ? 64 - __builtin_clzll(us) : 0;
+  if (bucket >= WFS_STATS_N_BUCKETS)
+    bucket = WFS_STATS_N_BUCKETS - 1;
+
+  WFS_STATS_ADD(image, n_ops[op], 1);
+  WFS_STATS_ADD(image, op_time[op], time);
+  WFS_STATS_ADD(image, op_latency[op][bucket], 1);
+}
+
+/* Writes the statistics to "stream" in a line based "name value"
+ * format. Only non-empty latency buckets are written; they are named
+ * after their exclusive upper bound in microseconds, except for the
+ * last one, which is named "inf". Returns 0 on success, -1 on error.
+ */
+int
+wfs_stats_print(wfs_image_t *image, FILE *stream)
+{
+  wfs_stats_t *stats = &image->stats;
+
+  for (int op = 0; op < WFS_N_OPS; op++)
+    {
+      const char *name = wfs_op_names[op];
+
+      fprintf(stream, "op.%s.count %llu\n", name,
+              (unsigned long long)wfs_stats_get(&stats->n_ops[op]));
+      fprintf(stream, "op.%s.time_us %llu\n", name,
+              (unsigned long long)wfs_stats_get(&stats->op_time[op]) / 1000);
+
+      for (int i = 0; i < WFS_STATS_N_BUCKETS; i++)
+        {
+          uint64_t n = wfs_stats_get(&stats->op_latency[op][i]);
+          if (n == 0)
+            continue;
+
+          if (i < WFS_STATS_N_BUCKETS - 1)
+            fprintf(stream, "op.%s.latency_us.%llu %llu\n", name,
+                    1ULL << i, (unsigned long long)n);
+          else
+            fprintf(stream, "op.%s.latency_us.inf %llu\n", name,
+                    (unsigned long long)n);
+        }
+    }
+
+  const struct
+  {
+    const char *name;
+    const uint64_t *counter;
+  }
+  counters[] =
+    {
+      { "io.reads", &stats->n_reads },
+      { "io.bytes_read", &stats->n_bytes_read },
+      { "io.table_lookups", &stats->n_table_lookups },
+      { "io.chain_hops", &stats->n_chain_hops },
+      { "dcache.hits", &stats->n_dcache_hits },
+      { "dcache.misses", &stats->n_dcache_misses },
+      { "bcache.hits", &stats->n_bcache_hits },
+      { "bcache.misses", &stats->n_bcache_misses },
+      { "preload.dirs", &stats->n_preload_dirs },
+      { "preload.entries", &stats->n_preload_entries },
+      { "snapshot.copies", &stats->n_snapshot_copies },
+      { "journal.records", &stats->n_journal_records },
+      { "journal.syncs", &stats->n_journal_syncs },
+      { "defrag.walks", &stats->n_defrag_walks },
+      { "defrag.files", &stats->n_defrag_files },
+      { "defrag.blocks", &stats->n_defrag_blocks },
+      { "arena.chunks", &stats->n_arena_chunks }
+    };
+
+  for (size_t i = 0; i < sizeof(counters) / sizeof(counters[0]); i++)
+    fprintf(stream, "%s %llu\n", counters[i].name,
+            (unsigned long long)wfs_stats_get(counters[i].counter));
+
+  fprintf(stream, "preload.time_us %llu\n",
+          (unsigned long long)wfs_stats_get(&stats->preload_time) / 1000);
+
+  wfs_defrag_print(image, stream);
+
+  return ferror(stream) ? -1 : 0;
+}
@@ -0,0 +1,329 @@
+/* wfsuring -- io_uring backend for WFS image access.
+ *
+ * Copyright (C) 2017  Leiden University, The Netherlands.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <liburing.h>
+
+#include "wfsimage.h"
+
+
+/* Every thread accessing the image gets its own ring, so no locking is
+ * needed to submit and reap requests. All segments of a request are
+ * queued together and submitted with a single system call.
+ */
+
+#define WFS_URING_DEPTH (2 * WFS_MAX_SEGMENTS)
+
+/* Completions of prefetch requests carry this user data; they are not
+ * waited for and are reaped whenever they show up.
+ */
+#define WFS_URING_PREFETCH 0
+
+struct wfs_uring
+{
+  struct io_uring ring;
+  wfs_image_t *image;
+  struct wfs_uring *prev;
+  struct wfs_uring *next;
+};
+
+static void
+wfs_uring_free(struct wfs_uring *uring)
+{
+  io_uring_queue_exit(&uring->ring);
+  free(uring);
+}
+
+/* Called when a thread that used the image exits. */
+static void
+wfs_uring_destroy(void *data)
+{
+  struct wfs_uring *uring = data;
+  wfs_image_t *image = uring->image;
+
+  pthread_mutex_lock(&image->uring_lock);
+
+  if (uring->prev)
+    uring->prev->next = uring->next;
+  else
+    image->urings = uring->next;
+  if (uring->next)
+    uring->next->prev = uring->prev;
+
+  pthread_mutex_unlock(&image->uring_lock);
+
+  wfs_uring_free(uring);
+}
+
+/* Returns the ring of the calling thread, setting it up on first use.
+ * Returns NULL if no ring could be created.
+ */
+static struct wfs_uring *
+wfs_uring_get(wfs_image_t *image)
+{
+  struct wfs_uring *uring = pthread_getspecific(image->uring_key);
+  if (uring)
+    return uring;
+
+  uring = calloc(1, sizeof(struct wfs_uring));
+  if (!uring)
+    return NULL;
+
+  if (io_uring_queue_init(WFS_URING_DEPTH, &uring->ring, 0) < 0)
+    {
+      free(uring);
+      return NULL;
+    }
+
+  uring->image = image;
+
+  pthread_mutex_lock(&image->uring_lock);
+  uring->next = image->urings;
+  if (uring->next)
+    uring->next->prev = uring;
+  image->urings = uring;
+  pthread_mutex_unlock(&image->uring_lock);
+
+  pthread_setspecific(image->uring_key, uring);
+
+  return uring;
+}
+
+/* Reaps the completions of prefetch requests that have arrived. */
+static void
+wfs_uring_reap(struct wfs_uring *uring)
+{
+  struct io_uring_cqe *cqe;
+
+  while (io_uring_peek_cqe(&uring->ring, &cqe) == 0)
+    io_uring_cqe_seen(&uring->ring, cqe);
+}
+
+static void
+wfs_uring_queue(struct wfs_uring *uring, struct io_uring_sqe *sqe,
+                const wfs_io_segment_t *segment, size_t done, int index,
+                bool write)
+{
+  char *buf = (char *)segment->buf + done;
+  size_t size = segment->size - done;
+  off_t offset;
+  int fd = wfs_image_locate(uring->image, segment->offset + done, &size,
+                            &offset);
+
+  if (write)
+    io_uring_prep_write(sqe, fd, buf, size, offset);
+  else
+    io_uring_prep_read(sqe, fd, buf, size, offset);
+
+  io_uring_sqe_set_data64(sqe, index + 1);
+}
+
+/* Transfers up to WFS_MAX_SEGMENTS segments as one batch and waits
+ * until all of them have completed. Short transfers are resubmitted for
+ * the remainder.
+ */
+static int
+wfs_uring_transfer_batch(struct wfs_uring *uring,
+                         const wfs_io_segment_t *segments, int n_segments,
+                         bool write)
+{
+  size_t done[WFS_MAX_SEGMENTS];
+  int pending = 0;
+  int res = 0;
+  bool failed = false;
+
+  for (int i = 0; i < n_segments; i++)
+    {
+      struct io_uring_sqe *sqe = io_uring_get_sqe(&uring->ring);
+      if (!sqe)
+        {
+          /* Make room by submitting what was queued so far. */
+          io_uring_submit(&uring->ring);
+          sqe = io_uring_get_sqe(&uring->ring);
+          if (!sqe)
+            {
+              res = -EBUSY;
+              break;
+            }
+        }
+
+      done[i] = 0;
+      wfs_uring_queue(uring, sqe, &segments[i], 0, i, write);
+      pending++;
+    }
+
+  /* Buffers of submitted requests are in use until their completion
+   * has been seen, so wait for all of them, also after an error. Once
+   * submitting has failed, short transfers are no longer resubmitted.
+   */
+  while (pending > 0)
+    {
+      struct io_uring_cqe *cqe;
+
+      int ret = io_uring_submit_and_wait(&uring->ring, 1);
+      if (ret < 0 && ret != -EINTR)
+        {
+          res = -EIO;
+          failed = true;
+        }
+
+      while (io_uring_peek_cqe(&uring->ring, &cqe) == 0)
+        {
+          uint64_t data = io_uring_cqe_get_data64(cqe);
+          int cqe_res = cqe->res;
+          io_uring_cqe_seen(&uring->ring, cqe);
+
+          if (data == WFS_URING_PREFETCH)
+            continue;
+
+          int i = data - 1;
+          if (cqe_res > 0)
+            done[i] += cqe_res;
+
+          if (!failed
+              && (cqe_res == -EINTR || cqe_res == -EAGAIN
+                  || (cqe_res > 0 && done[i] < segments[i].size)))
+            {
+              struct io_uring_sqe *sqe = io_uring_get_sqe(&uring->ring);
+              if (sqe)
+                {
+                  wfs_uring_queue(uring, sqe, &segments[i], done[i], i,
+                                  write);
+                  continue;
+                }
+            }
+
+          if (done[i] < segments[i].size)
+            res = -EIO;
+          pending--;
+        }
+    }
+
+  return res;
+}
+
+/* Transfers all segments completely. Returns 0 on success, -ENOSYS if
+ * the calling thread has no ring, in which case the caller should fall
+ * back to synchronous I/O, or another error code. The segments of a
+ * striped image are split into pieces stored on a single device first,
+ * so that the requests of a batch are served by all devices at once.
+ */
+int
+wfs_uring_transfer_segments(wfs_image_t *image,
+                            const wfs_io_segment_t *segments, int n_segments,
+                            bool write)
+{
+  struct wfs_uring *uring = wfs_uring_get(image);
+  if (!uring)
+    return -ENOSYS;
+
+  wfs_io_segment_t *pieces;
+  int n_pieces = wfs_image_split_segments(image, segments, n_segments,
+                                          &pieces);
+  if (n_pieces < 0)
+    return n_pieces;
+
+  int res = 0;
+  for (int i = 0; i < n_pieces && res == 0; i += WFS_MAX_SEGMENTS)
+    {
+      int n = n_pieces - i;
+      if (n > WFS_MAX_SEGMENTS)
+        n = WFS_MAX_SEGMENTS;
+
+      res = wfs_uring_transfer_batch(uring, pieces + i, n, write);
+    }
+
+  if (pieces != segments)
+    wfs_arena_release(image, pieces);
+
+  return res;
+}
+
+/* Submits readahead requests for the segments without waiting for
+ * them. Returns 0 on success, -ENOSYS if the calling thread has no
+ * ring.
+ */
+int
+wfs_uring_prefetch(wfs_image_t *image, const wfs_io_segment_t *segments,
+                   int n_segments)
+{
+  struct wfs_uring *uring = wfs_uring_get(image);
+  if (!uring)
+    return -ENOSYS;
+
+  wfs_uring_reap(uring);
+
+  for (int i = 0; i < n_segments; i++)
+    {
+      for (size_t done = 0; done < segments[i].size; )
+        {
+          struct io_uring_sqe *sqe = io_uring_get_sqe(&uring->ring);
+          if (!sqe)
+            break;
+
+          size_t size = segments[i].size - done;
+          off_t offset;
+          int fd = wfs_image_locate(image, segments[i].offset + done, &size,
+                                    &offset);
+
+          io_uring_prep_fadvise(sqe, fd, offset, size, POSIX_FADV_WILLNEED);
+          io_uring_sqe_set_data64(sqe, WFS_URING_PREFETCH);
+          done += size;
+        }
+    }
+
+  io_uring_submit(&uring->ring);
+
+  return 0;
+}
+
+/* Prepares the image for io_uring access. The ring of the calling
+ * thread is created right away, to find out whether io_uring is
+ * available at all. Returns 0 on success, -1 on failure.
+ */
+int
+wfs_uring_init(wfs_image_t *image)
+{
+  if (pthread_key_create(&image->uring_key, wfs_uring_destroy) != 0)
+    {
+      fprintf(stderr, "error: could not create io_uring thread key\n");
+      return -1;
+    }
+
+  if (!wfs_uring_get(image))
+    {
+      fprintf(stderr, "error: could not set up io_uring for '%s'\n",
+              image->filename);
+      pthread_key_delete(image->uring_key);
+      return -1;
+    }
+
+  return 0;
+}
+
+/* Releases the rings of all threads. No thread may access the image
+ * concurrently.
+ */
+void
+wfs_uring_fini(wfs_image_t *image)
+{
+  pthread_setspecific(image->uring_key, NULL);
+  pthread_key_delete(image->uring_key);
+
+  pthread_mutex_lock(&image->uring_lock);
+
+  while (image->urings)
+    {
+      struct wfs_uring *next = image->urings->next;
+      wfs_uring_free(image->urings);
+      image->urings = next;
+    }
+
+  pthread_mutex_unlock(&image->uring_lock);
+}